@@ -0,0 +1,41 @@
+#ifndef AI_H
+#define AI_H
+
+#include "common.h"
+
+// Monte-Carlo tree search over sim_step.
+// Opponents and rollouts play random legal actions, nodes are shared through a
+// transposition table keyed by sim_hash so transpositions add up their visits.
+
+#define AI_DEFAULT_BUDGET_MS 50
+#define AI_DEFAULT_MAX_DEPTH 24
+#define AI_MAX_ACTIONS 32
+
+typedef struct {
+    int budget_ms;  // Per decision
+    int threads;    // Independent searches whose root visits are summed
+    int max_depth;  // Turns played after the root, in the tree and the rollout together
+} ai_config;
+
+typedef struct ai ai;
+
+// Allocates the tables and starts the threads of every search once, deciding never allocates nor starts threads
+ai* ai_create(ai_config config, uint64_t seed);
+void ai_destroy(ai* a);
+// Action of player for the next turn, within budget_ms. Spells whose cooldowns are not over are skipped.
+// map is the background layer of the map (walls are not 0), NULL for an empty board. distances are the
+// walking distances of a compiled map (mapb), walked from map at every decision when NULL.
+sim_action ai_choose_action(ai* a, const sim_state* s, const rng* r, int player, const uint8_t* map,
+                            const int8_t (*distances)[MAP_CELL_COUNT]);
+int ai_last_iterations(const ai* a);
+
+// Cooldowns are not part of the rules, whoever plays an AI keeps them up to date
+void ai_start_cooldown(player_info* p, sim_action action);
+void ai_tick_cooldowns(player_info* p);
+
+// What the search plays for the others, also useful as a baseline opponent
+sim_action ai_random_action(const sim_state* s, rng* r, int player);
+// Ten different spells and the 200 stat points of the build menu spread at random
+void ai_random_build(rng* r, player_info* p);
+
+#endif
@@ -16,6 +16,10 @@ typedef enum {
     CT_CLEAR,
     CT_HELP,
     CT_LOAD_EDITOR,
+    CT_ROOM_LIST,
+    CT_ROOM,
+    CT_MATCH,
+    CT_SPECTATE,
 } command_type;
 
 
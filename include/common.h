@@ -9,6 +9,13 @@
 
 #define MAX_PACKET_SIZE 2048
 
+// Length prefixed string on the wire. Unpacked strings point inside the
+// received frame and are not null terminated.
+typedef struct {
+    uint8_t len;
+    const char* str;
+} network_string;
+
 typedef uint8_t net_packet_type;
 typedef struct {
     uint64_t len;
@@ -38,8 +45,34 @@ typedef enum {
     LL_ERROR,
 } log_level;
 
-void LOG(const char* fmt, ...);
-void LOGL(log_level level, const char* fmt, ...);
+// Levels are bits of a mask. A filtered line costs one branch, its arguments are not evaluated.
+#define LL_BIT(LEVEL) (1u << (LEVEL))
+#define LL_ALL (LL_BIT(LL_INFO) | LL_BIT(LL_WARNING) | LL_BIT(LL_DEBUG) | LL_BIT(LL_ERROR))
+// Levels left out at compile time never reach the binary
+#ifndef LOG_COMPILED_LEVELS
+#ifdef DEBUG
+#define LOG_COMPILED_LEVELS LL_ALL
+#else
+#define LOG_COMPILED_LEVELS (LL_ALL & ~LL_BIT(LL_DEBUG))
+#endif
+#endif
+
+extern uint32_t log_mask;  // Levels logged at runtime, every compiled one by default
+
+#define LOGL(LEVEL, ...)                                             \
+    do {                                                             \
+        if ((LOG_COMPILED_LEVELS & log_mask & LL_BIT(LEVEL)) != 0) { \
+            log_write((LEVEL), __VA_ARGS__);                         \
+        }                                                            \
+    } while (0)
+#define LOG(...) LOGL(LL_INFO, __VA_ARGS__)
+
+// Formats the line into the log ring without locking, a background thread writes it to stdout
+void log_write(log_level level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+// Comma separated level names, like "info,warning,error". Returns false if one is unknown.
+bool set_log_levels(const char* levels);
+// Writes out every line already logged, for callers about to exit or print on their own
+void flush_logs();
 
 #define MAX_SPELL_COUNT 10
 #define MAX_PLAYER_COUNT 4
@@ -222,6 +255,86 @@ void clear_logs();
 int get_spell_damage(player_info* info, const spell* s);
 void apply_effect(player_info* p, const spell* s);
 
+// Turn rules
+// Shared by the server and the simulator, only all_spells is read besides the arguments
+
+#define GAME_TIE 255
+#define SIM_MAX_TURN_EVENTS 64
+
+typedef enum {
+    TO_CONTINUE,
+    TO_ROUND_END,
+    TO_GAME_END,
+} turn_outcome;
+
+typedef enum {
+    TE_ACTION,  // kind is the player_action, x/y the target and value the spell
+    TE_DAMAGE,  // kind is the player who caused it, value the damage
+    TE_EFFECT,  // kind is the spell_effect, value the rounds left
+    TE_DEATH,
+} turn_event_type;
+
+// xorshift64*, every match owns its own
+typedef struct {
+    uint64_t state;
+} rng;
+
+void rng_seed(rng* r, uint64_t seed);
+uint64_t rng_next(rng* r);
+int rng_range(rng* r, int n);  // In [0, n)
+
+// Laid out like the events of PKT_TURN_RESULT
+typedef struct {
+    uint8_t type;  // turn_event_type
+    uint8_t player;
+    uint8_t kind;
+    uint8_t x, y;
+    uint8_t value;
+} turn_event;
+
+typedef struct {
+    uint8_t action;  // player_action
+    uint8_t x, y;
+    uint8_t spell;
+} sim_action;
+
+typedef struct {
+    player_info players[MAX_PLAYER_COUNT];  // Slots which are not connected are empty
+    const uint8_t* map;  // Background layer (walls are not 0), NULL for an empty board. Not part of sim_hash.
+    // What the last turn did, in order
+    turn_event events[SIM_MAX_TURN_EVENTS];
+    int event_count;
+} sim_state;
+
+void sim_reset_player(player_info* p, int x, int y);
+player_info* sim_player_on_cell(sim_state* s, int x, int y);
+// Plays the actions of every player (indexed by id) in place.
+// Returns TO_ROUND_END once less than 2 players are alive, winner_id is GAME_TIE unless one of them is.
+turn_outcome sim_step(sim_state* s, const sim_action actions[MAX_PLAYER_COUNT], rng* r, uint8_t* winner_id);
+// Runs the program of the spell on a player it lands on, state may be NULL when no events are wanted
+void sim_spell_hit(sim_state* s, player_info* from, player_info* to, const spell* sp);
+// The rules the default programs replaced, kept to check and benchmark them against
+void sim_spell_hit_native(sim_state* s, player_info* from, player_info* to, const spell* sp);
+// Attacking a player who blocks stuns the attacker
+void sim_block_stun(player_info* p);
+// Damage of one turn of an effect, -1 when the effect does not deal any
+int sim_effect_tick(player_info* p, int effect);
+// One FNV-1a step over data, starting from h
+uint64_t hash_bytes(uint64_t h, const uint8_t* data, int size);
+// FNV-1a of everything sim_step reads and the rng, equal hashes predict equal turns
+uint64_t sim_hash(const sim_state* s, const rng* r);
+// Spell programs, which must be loaded before sim_step is used (see spells/default.spells)
+#define SPELL_PROGRAMS_MAX_SIZE 1024
+
+bool load_spell_programs(const char* filepath);
+// Installs a compiled blob as sent by the server, returns false if it is not valid
+bool set_spell_programs(const uint8_t* blob, int size);
+const uint8_t* get_spell_programs(int* size, uint32_t* hash);
+
+// Index of the spell in all_spells, NO_SPELL for NULL
+uint8_t spell_index(const spell* s);
+const spell* spell_from_index(uint8_t index);
+
 // Queue
 
 void init_queue(queue* q, size_t elem_size);
@@ -235,6 +348,7 @@ void reset_queue(queue* q);
 
 #define MAP_WIDTH 16
 #define MAP_HEIGHT 8
+#define MAP_CELL_COUNT (MAP_WIDTH * MAP_HEIGHT)
 
 typedef enum {
     MAP_HEADER_NAME,
@@ -247,16 +361,55 @@ typedef struct {
     const char* value;
 } map_header;
 
+typedef struct mapb mapb;
+
 typedef struct {
     map_header headers[MAP_HEADER_COUNT];
     uint8_t map[MAP_HEIGHT * MAP_WIDTH];
     uint8_t props[MAP_HEIGHT * MAP_WIDTH];
     uint8_t spawn_positions[MAX_PLAYER_COUNT][2];
+    const mapb* compiled;  // Mapping the map was loaded from, NULL for text maps. Closed by free_map_data.
 } map_data;
 
+// Compiled map (.mapb), written by build/mapc from the text format and mapped by the loaders as is.
+// The layout is fixed and has no pointers, multi-byte fields are little endian.
+#define MAPB_MAGIC 0x4250414du  // "MAPB"
+#define MAPB_VERSION 2
+
+struct mapb {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;  // map_layers_hash of map and props
+    uint8_t width;
+    uint8_t height;
+    uint8_t reserved[2];
+    char name[32];  // Zero padded, not terminated when it is 32 characters long
+    uint8_t spawn_positions[MAX_PLAYER_COUNT][2];
+    uint8_t map[MAP_CELL_COUNT];
+    uint8_t props[MAP_CELL_COUNT];
+    int8_t distances[MAP_CELL_COUNT][MAP_CELL_COUNT];  // From cell to cell, see walk_distances
+};
+
+_Static_assert(sizeof(mapb) == 56 + MAX_PLAYER_COUNT * 2 + MAP_CELL_COUNT * (2 + MAP_CELL_COUNT),
+               "mapb must not have padding");
+
+void map_file_path(char fullpath[256], const char* filepath, const char* extension);
+char* load_map_name(const char* filepath);
+// Text maps are reentrant, load_map prefers an up to date compiled map over the text
+bool load_map_text(const char* filepath, map_data* map);
 bool load_map(const char* filepath, map_data* map);
 bool save_map(const char* filepath, map_data* map);
 void free_map_data(map_data* map);
+void walk_distances(const uint8_t* map, int x, int y, int8_t distances[MAP_CELL_COUNT]);
+void compile_map(const map_data* map, mapb* out);
+const char* check_mapb(const mapb* b);
+void map_from_mapb(const mapb* b, map_data* map);
+#ifndef WINDOWS_BUILD
+const mapb* open_mapb(const char* path);
+void close_mapb(const mapb* b);
+const mapb* open_compiled_map(const char* filepath);
+#endif
+uint64_t map_layers_hash(uint8_t width, uint8_t height, const uint8_t* map, const uint8_t* props);
 bool create_map(const char* filename);
 
 #endif
@@ -0,0 +1,73 @@
+#ifndef MATCHMAKING_H
+#define MATCHMAKING_H
+
+#include "common.h"
+
+// Players waiting for a match, ordered by rating in a treap so joining and leaving are O(log n).
+// Entries are embedded in what they belong to, like timers. The queue does not lock, its user does.
+
+#define MM_DEFAULT_RATING 1000
+// Rating gap accepted inside a group, it widens while its players wait
+#define MM_BASE_WINDOW 100
+#define MM_WINDOW_PER_SECOND 25
+#define MM_MAX_WINDOW 800
+#define MM_ELO_K 32
+// Windows widen once a second from when the player queued, entries wait in the slot of that phase
+#define MM_PHASE_SLOTS 10
+
+struct mm_entry;
+
+typedef struct {
+    struct mm_entry* head;
+    struct mm_entry* tail;
+} mm_list;
+
+typedef struct mm_entry {
+    struct mm_entry* left;
+    struct mm_entry* right;
+    uint32_t priority;
+    int rating;
+    uint64_t ticket;  // Unique per enqueue, breaks rating ties by arrival
+    uint64_t enqueued_ms;
+    bool queued;
+    int window;  // When it was last looked at
+    // In the entries to match at the next tick, or in its phase slot until its window stops widening
+    struct mm_entry* next;
+    struct mm_entry* prev;
+    mm_list* list;
+} mm_entry;
+
+typedef struct {
+    mm_entry* root;
+    int count;
+    uint64_t tickets;
+    rng rng;  // Treap priorities
+    mm_list dirty;  // Joined or lost a neighbour since the last tick
+    mm_list phases[MM_PHASE_SLOTS];
+    uint64_t matched_ms;  // Last tick
+} mm_queue;
+
+typedef void (*mm_group_callback)(mm_entry** group, int size, void* ctx);
+
+void mm_init(mm_queue* q, uint64_t seed);
+// Returns the ticket of the entry
+uint64_t mm_push(mm_queue* q, mm_entry* e, int rating, uint64_t now_ms);
+void mm_remove(mm_queue* q, mm_entry* e);
+// Removes groups of group_size players whose ratings fit in the window of each member and gives them
+// to the callback, neighbours in rating order are grouped first. Returns the number of groups.
+// Only the entries which joined, lost a neighbour or whose window widened since the last tick are
+// looked at, each in O(log n). Entries the callback pushes back wait for the next tick.
+int mm_match(mm_queue* q, int group_size, uint64_t now_ms, mm_group_callback callback, void* ctx);
+
+// Ratings by player name, a local stand-in for a real store. Changes are appended to a text
+// file, one "rating name" line each, and the last line of a name wins when it is loaded.
+typedef struct rating_store rating_store;
+
+// path may not exist yet, NULL keeps the ratings in memory only
+rating_store* ratings_open(const char* path);
+void ratings_close(rating_store* s);
+int ratings_get(rating_store* s, const char* name);
+// Elo between the winner and every other player, winner is -1 for a tie. Thread safe.
+void ratings_update(rating_store* s, const char** names, int count, int winner);
+
+#endif
@@ -9,8 +9,10 @@
 #include <string.h>
 #ifndef WINDOWS_BUILD
 #include <netinet/in.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #endif
 #include <unistd.h>
 #include "common.h"
@@ -23,17 +25,31 @@
         send_sock(&p##__LINE__, FD);            \
     } while (0)
 
-#define GAME_TIE 255
-
 typedef enum {
     PIP_HEALTH,
 } player_info_property;
 
+typedef enum {
+    PS_KEYFRAME,  // The whole packed net_packet_player_update follows
+    PS_DELTA,     // A bitmask of the bytes that changed follows, then these bytes
+} player_state_kind;
+
+// Biggest packed net_packet_player_update a delta can describe
+#define NET_PLAYER_STATE_MAX_SIZE 64
+
 char* packu8(char* buf, uint8_t u) {
     *buf++ = u;
     return buf;
 }
 
+char* packu32(char* buf, uint32_t u) {
+    *buf++ = u >> 24;
+    *buf++ = u >> 16;
+    *buf++ = u >> 8;
+    *buf++ = u;
+    return buf;
+}
+
 char* packu64(char* buf, uint64_t u) {
     *buf++ = u >> 56;
     *buf++ = u >> 48;
@@ -46,7 +62,7 @@ char* packu64(char* buf, uint64_t u) {
     return buf;
 }
 
-char* packsv(char* buf, char* str, int len) {
+char* packsv(char* buf, const char* str, int len) {
     while (len-- > 0) {
         *buf++ = *str++;
     }
@@ -59,6 +75,13 @@ uint8_t unpacku8(uint8_t** buf) {
     return res;
 }
 
+uint32_t unpacku32(uint8_t** buf) {
+    uint8_t* b = *buf;
+    uint32_t res = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    (*buf) += sizeof(uint32_t);
+    return res;
+}
+
 uint64_t unpacku64(uint8_t** buf) {
     uint8_t* b = *buf;
     uint64_t res = ((unsigned long long int)b[0] << 56) |
@@ -78,6 +101,159 @@ void unpacksv(uint8_t** buf, char* dest, uint8_t len) {
     }
 }
 
+// Varints are unsigned LEB128: 7 bits per byte, the high bit is set on every byte but the last
+#define NET_VARINT_MAX_SIZE 10
+
+int varint_size(uint64_t u) {
+    int size = 1;
+    while (u >= 0x80) {
+        u >>= 7;
+        size++;
+    }
+    return size;
+}
+
+char* packvarint(char* buf, uint64_t u) {
+    while (u >= 0x80) {
+        *buf++ = (u & 0x7f) | 0x80;
+        u >>= 7;
+    }
+    *buf++ = u;
+    return buf;
+}
+
+uint64_t unpackvarint(uint8_t** buf) {
+    uint64_t res = 0;
+    for (int i = 0; i < NET_VARINT_MAX_SIZE; i++) {
+        uint8_t b = unpacku8(buf);
+        res |= (uint64_t)(b & 0x7f) << (7 * i);
+        if ((b & 0x80) == 0) {
+            break;
+        }
+    }
+    return res;
+}
+
+// Decodes a varint that may not be fully received yet.
+// Returns its size, 0 if more bytes are needed and -1 if it is longer than max_size.
+int varint_decode(const uint8_t* buf, int available, int max_size, uint64_t* out) {
+    uint64_t res = 0;
+    for (int i = 0; i < max_size; i++) {
+        if (i == available) {
+            return 0;
+        }
+        res |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            *out = res;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// A frame is a varint of the size of its body, then the body: the packet type and the packed packet.
+// 3 bytes are enough for any body up to MAX_PACKET_SIZE.
+#define NET_FRAME_LENGTH_MAX_SIZE 3
+
+uint32_t frame_size(net_packet* p) {
+    uint64_t body = sizeof(p->type) + get_packet_length(p->type, p->content);
+    return varint_size(body) + body;
+}
+
+char* pack_frame(char* buf, net_packet* p) {
+    buf = packvarint(buf, sizeof(p->type) + get_packet_length(p->type, p->content));
+    buf = packu8(buf, p->type);
+    return packstruct(buf, p->content, p->type);
+}
+
+// Strings of p point inside body, it has to be kept until p is handled
+void unpack_frame(uint8_t* body, uint32_t len, net_packet* p) {
+    uint8_t* base = body;
+    p->type = unpacku8(&base);
+    p->len = len - sizeof(p->type);
+    unpackstruct(p->type, base, p->content);
+}
+
+// Player states are sent as deltas against the last state the receiver got for that player.
+// An entry is the player id, a player_state_kind and its payload.
+char* pack_player_state(char* buf, uint8_t id, const uint8_t* previous, const uint8_t* state, bool keyframe) {
+    int size = get_packet_length(PKT_PLAYER_UPDATE, NULL);
+    assert(size <= NET_PLAYER_STATE_MAX_SIZE);
+    buf = packu8(buf, id);
+    buf = packu8(buf, keyframe ? PS_KEYFRAME : PS_DELTA);
+    if (keyframe) {
+        return packsv(buf, (char*)state, size);
+    }
+    char* mask = buf;
+    memset(mask, 0, (size + 7) / 8);
+    buf += (size + 7) / 8;
+    for (int i = 0; i < size; i++) {
+        if (state[i] != previous[i]) {
+            mask[i / 8] |= 1 << (i % 8);
+            *buf++ = state[i];
+        }
+    }
+    return buf;
+}
+
+// Everything sim_step reads besides the build comes with the player states
+void player_info_from_update(player_info* p, const net_packet_player_update* u) {
+    p->id = u->id;
+    p->x = u->x;
+    p->y = u->y;
+    for (int i = 0; i < STAT_COUNT; i++) {
+        p->stats[i] = u->stats[i];
+    }
+    for (int i = 0; i < SE_COUNT; i++) {
+        p->effect[i] = u->effect[i];
+        p->effect_round_left[i] = u->effect_round_left[i];
+        p->spell_effect[i] = spell_from_index(u->effect_spells[i]);
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        p->banned[i] = u->banned_spells[i];
+    }
+    p->last_spell = u->last_spell;
+    p->turn_effect = u->turn_effect;
+    p->turn_effect_duration_left = u->turn_effect_duration_left;
+}
+
+// Applies the entry at buf to states[id] and returns the next one, NULL if the entry is invalid
+uint8_t* unpack_player_state(uint8_t* buf, uint8_t* end, uint8_t states[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE],
+                             uint8_t* id) {
+    int size = get_packet_length(PKT_PLAYER_UPDATE, NULL);
+    if (end - buf < 2) {
+        return NULL;
+    }
+    *id = unpacku8(&buf);
+    uint8_t kind = unpacku8(&buf);
+    if (*id >= MAX_PLAYER_COUNT || (kind != PS_KEYFRAME && kind != PS_DELTA)) {
+        return NULL;
+    }
+    uint8_t* state = states[*id];
+    if (kind == PS_KEYFRAME) {
+        if (end - buf < size) {
+            return NULL;
+        }
+        memcpy(state, buf, size);
+        return buf + size;
+    }
+
+    uint8_t* mask = buf;
+    buf += (size + 7) / 8;
+    if (buf > end) {
+        return NULL;
+    }
+    for (int i = 0; i < size; i++) {
+        if (mask[i / 8] & (1 << (i % 8))) {
+            if (buf == end) {
+                return NULL;
+            }
+            state[i] = *buf++;
+        }
+    }
+    return buf;
+}
+
 #ifdef WINDOWS_BUILD
 #define send_data(fd, buf, len) send(fd, (char*)buf, len, 0)
 #else
@@ -85,18 +261,16 @@ void unpacksv(uint8_t** buf, char* dest, uint8_t len) {
 #endif
 
 void write_packet(net_packet* p, int fd) {
-    if (p->len > MAX_PACKET_SIZE) {
-        LOGL(LL_ERROR, "Packet is too big (%d / %d)", p->len, MAX_PACKET_SIZE);
+    uint32_t size = frame_size(p);
+    if (size > MAX_PACKET_SIZE) {
+        LOGL(LL_ERROR, "Packet is too big (%u / %d)", size, MAX_PACKET_SIZE);
         return;
     }
-    static char buf[MAX_PACKET_SIZE] = {0};
-    char* b = buf;
-    b = packu64(b, p->len);
-    b = packu8(b, p->type);
-    b = packstruct(b, p->content, p->type);
+    static __thread char buf[MAX_PACKET_SIZE] = {0};
+    pack_frame(buf, p);
 
-    b = buf;
-    uint64_t packet_size_left = p->len;
+    char* b = buf;
+    uint64_t packet_size_left = size;
     int n = 0;
     while ((n = send_data(fd, b, packet_size_left)) > 0) {
         packet_size_left -= n;
@@ -115,49 +289,221 @@ void write_packet(net_packet* p, int fd) {
 #define recv_data(fd, buf, len) read(fd, buf, len)
 #endif
 
-int packet_read(net_packet* p, int fd) {
-    uint8_t packet_len_buf[8] = {0};
-    int n = recv_data(fd, &packet_len_buf, sizeof(packet_len_buf));
-    if (n == 0) {
-        LOG("Client %d disconnected (read)", fd);
-        return -1;
-    } else if (n < 0) {
-        LOGL(LL_ERROR, "Error recieving packet header %s", strerror(errno));
-        return -1;
+// Blocks until a whole frame is received and writes its body, MAX_PACKET_SIZE bytes at most.
+// Returns the length of the body or -1 if the connection is closed or the frame is invalid.
+int frame_read(uint8_t* body, int fd) {
+    uint8_t header[NET_FRAME_LENGTH_MAX_SIZE] = {0};
+    uint64_t len = 0;
+    int header_size = 0;
+    for (int available = 1; header_size == 0; available++) {
+        int n = recv_data(fd, header + available - 1, 1);
+        if (n == 0) {
+            LOG("Client %d disconnected (read)", fd);
+            return -1;
+        } else if (n < 0) {
+            LOGL(LL_ERROR, "Error recieving packet header %s", strerror(errno));
+            return -1;
+        }
+        header_size = varint_decode(header, available, NET_FRAME_LENGTH_MAX_SIZE, &len);
     }
-    uint8_t* len_buf = packet_len_buf;
-    p->len = unpacku64(&len_buf);
-    if (p->len > MAX_PACKET_SIZE) {
+    if (header_size < 0 || len == 0 || header_size + len > MAX_PACKET_SIZE) {
+        LOGL(LL_ERROR, "Invalid packet length %" PRIu64, len);
         return -1;
     }
 
-    uint8_t buf[MAX_PACKET_SIZE] = {0};
-    uint8_t* b = buf;
-    int packet_size_left = p->len - sizeof(p->len);
-    n = 0;
-    while ((n = recv_data(fd, b, packet_size_left)) > 0) {
-        packet_size_left -= n;
-        b += n;
+    uint64_t received = 0;
+    while (received < len) {
+        int n = recv_data(fd, body + received, len - received);
+        if (n <= 0) {
+            LOGL(LL_ERROR, "Error recieving packet %s", n == 0 ? "connection closed" : strerror(errno));
+            return -1;
+        }
+        received += n;
     }
+    return len;
+}
 
-    if (n < 0) {
-        LOGL(LL_ERROR, "Error recieving packet of type %d %s", p->type,
-             strerror(errno));
+#ifndef WINDOWS_BUILD
+// Bytes received on a connection that don't form a complete packet yet.
+// head and tail only grow, the size being a power of two keeps them valid when they wrap.
+#define RECV_BUFFER_SIZE (MAX_PACKET_SIZE * 2)
+
+typedef struct {
+    uint8_t data[RECV_BUFFER_SIZE];
+    uint32_t head;  // Bytes parsed
+    uint32_t tail;  // Bytes received
+} recv_buffer;
+
+// Reads whatever is available without blocking.
+// Returns -1 once the connection is closed, 1 if the buffer got full before the socket was drained, 0 otherwise.
+int recv_buffer_fill(recv_buffer* b, int fd) {
+    while (b->tail - b->head < RECV_BUFFER_SIZE) {
+        uint32_t offset = b->tail % RECV_BUFFER_SIZE;
+        uint32_t space = RECV_BUFFER_SIZE - (b->tail - b->head);
+        uint32_t contiguous = RECV_BUFFER_SIZE - offset;
+        int n = recv(fd, b->data + offset, space < contiguous ? space : contiguous, MSG_DONTWAIT);
+        if (n == 0) {
+            LOG("Client %d disconnected (read)", fd);
+            return -1;
+        } else if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            LOGL(LL_ERROR, "Error recieving from %d %s", fd, strerror(errno));
+            return -1;
+        }
+        b->tail += n;
+    }
+    return 1;
+}
+
+// Copies buffered bytes out, the two halves of a wrapped packet end up contiguous
+void recv_buffer_peek(recv_buffer* b, uint32_t offset, uint8_t* out, uint32_t len) {
+    uint32_t start = (b->head + offset) % RECV_BUFFER_SIZE;
+    uint32_t first = RECV_BUFFER_SIZE - start < len ? RECV_BUFFER_SIZE - start : len;
+    memcpy(out, b->data + start, first);
+    memcpy(out + first, b->data, len - first);
+}
+
+// Pulls the next complete packet out of the buffer, its frame body is copied to body (MAX_PACKET_SIZE bytes).
+// Returns 1 when p has been filled, 0 when more bytes are needed and -1 if the stream is invalid.
+int packet_parse(recv_buffer* b, net_packet* p, uint8_t* body) {
+    uint32_t available = b->tail - b->head;
+    uint8_t header[NET_FRAME_LENGTH_MAX_SIZE] = {0};
+    uint32_t header_available = available < sizeof(header) ? available : sizeof(header);
+    recv_buffer_peek(b, 0, header, header_available);
+    uint64_t len = 0;
+    int header_size = varint_decode(header, header_available, NET_FRAME_LENGTH_MAX_SIZE, &len);
+    if (header_size == 0) {
+        return 0;
+    }
+    if (header_size < 0 || len == 0 || header_size + len > MAX_PACKET_SIZE) {
+        LOGL(LL_ERROR, "Invalid packet length %" PRIu64, len);
         return -1;
     }
+    if (available < header_size + len) {
+        return 0;
+    }
 
-    uint8_t* base = buf;
-    p->type = unpacku8(&base);
-    unpackstruct(p->type, base, p->content);
+    recv_buffer_peek(b, header_size, body, len);
+    b->head += header_size + len;
+    unpack_frame(body, len, p);
+    return 1;
+}
+#endif
+
+#ifndef WINDOWS_BUILD
+// A packet serialized once and shared by every outbound queue it was pushed to.
+// Queues move between workers and relays with their connection, so the count is atomic.
+typedef struct {
+    atomic_int refs;
+    uint32_t len;
+    uint8_t data[];
+} net_frame;
+
+net_frame* frame_encode(net_packet* p) {
+    uint32_t len = frame_size(p);
+    if (len > MAX_PACKET_SIZE) {
+        LOGL(LL_ERROR, "Packet is too big (%u / %d)", len, MAX_PACKET_SIZE);
+        return NULL;
+    }
+    net_frame* f = malloc(sizeof(net_frame) + len);
+    if (f == NULL) {
+        return NULL;
+    }
+    atomic_init(&f->refs, 1);
+    f->len = len;
+    pack_frame((char*)f->data, p);
+    return f;
+}
+
+net_frame* frame_retain(net_frame* f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    return f;
+}
+
+void frame_release(net_frame* f) {
+    if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        free(f);
+    }
+}
+
+#define SEND_QUEUE_SIZE 1024
+#define SEND_QUEUE_IOV 64
+
+// Frames waiting for the socket to accept them
+typedef struct {
+    net_frame* frames[SEND_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t offset;  // Bytes of the oldest frame already written
+} send_queue;
+
+bool send_queue_push(send_queue* q, net_frame* f) {
+    if (q->tail - q->head == SEND_QUEUE_SIZE) {
+        return false;
+    }
+    q->frames[q->tail % SEND_QUEUE_SIZE] = frame_retain(f);
+    q->tail++;
+    return true;
+}
+
+// Writes as much as the socket accepts with a single writev per batch of frames.
+// Returns -1 on error, 1 when frames are left for the next EPOLLOUT and 0 once the queue is empty.
+int send_queue_flush(send_queue* q, int fd) {
+    while (q->head != q->tail) {
+        struct iovec iov[SEND_QUEUE_IOV];
+        int count = 0;
+        for (uint32_t i = q->head; i != q->tail && count < SEND_QUEUE_IOV; i++, count++) {
+            net_frame* f = q->frames[i % SEND_QUEUE_SIZE];
+            uint32_t skip = i == q->head ? q->offset : 0;
+            iov[count].iov_base = f->data + skip;
+            iov[count].iov_len = f->len - skip;
+        }
+
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            LOGL(LL_ERROR, "Error sending to %d %s", fd, strerror(errno));
+            return -1;
+        }
+
+        while (n > 0) {
+            net_frame* f = q->frames[q->head % SEND_QUEUE_SIZE];
+            uint32_t left = f->len - q->offset;
+            if ((size_t)n < left) {
+                q->offset += n;
+                break;
+            }
+            n -= left;
+            q->offset = 0;
+            q->head++;
+            frame_release(f);
+        }
+    }
     return 0;
 }
 
+void send_queue_clear(send_queue* q) {
+    while (q->head != q->tail) {
+        frame_release(q->frames[q->head % SEND_QUEUE_SIZE]);
+        q->head++;
+    }
+    q->offset = 0;
+}
+#endif
+
 void send_sock(net_packet* packet, int fd) {
     if (fd == 0) {
         LOGL(LL_ERROR, "Can't send packet when not connected");
         return;
     }
-    packet->len += sizeof(packet->len) + sizeof(packet->type);
     write_packet(packet, fd);
 }
 
@@ -16,17 +16,15 @@ typedef struct {
 
 #endif
 
-typedef struct {
-    uint8_t len;
-    char str[255];
-} network_string;
-
 typedef struct {
     uint64_t send_time;
     uint64_t recieve_time;
 } net_packet_ping;
 
+// First packet sent by a client, the server drops it if the protocols differ
 typedef struct {
+    uint32_t protocol_version;  // NET_PROTOCOL_VERSION
+    network_string version;     // GIT_VERSION
     network_string username;
     network_string password;
 } net_packet_join;
@@ -39,6 +37,7 @@ typedef struct {
 typedef struct {
     uint8_t id;
     uint8_t master;  // Is the player the lobby's master ?
+    uint32_t room_id;
 } net_packet_connected;
 
 typedef struct {
@@ -47,13 +46,15 @@ typedef struct {
 } net_packet_disconnect;
 
 // TODO: Better way to handle strings in net_protocol_builder
+// Names of the maps starting at id first, a list that does not fit a packet comes in several
 typedef struct {
+    uint32_t first;
     uint8_t map_count;
     uint8_t* map_names NET_SIZE("s->map_count * 32");
 } net_packet_server_map_list;
 
 typedef struct {
-    uint8_t map_index;
+    uint32_t map_index;
     uint8_t round_count;
 } net_packet_update_server_configuration;
 
@@ -64,14 +65,30 @@ typedef struct {
     uint8_t* content NET_SIZE("s->width * s->height");
 } net_packet_map;
 
+// Names the map of the game by the hash of its layers (see map_layers_hash).
+// Clients without it in their cache fetch the layers with a PKT_MAP_REQUEST.
+typedef struct {
+    uint64_t hash;
+} net_packet_map_hash;
+
+// Answered with both PKT_MAP layers while the room still plays that map
+typedef struct {
+    uint64_t hash;
+} net_packet_map_request;
+
 typedef struct {
-    uint8_t map_id;
+    uint32_t map_id;
     uint8_t round_count;
 } net_packet_request_game_start;
 
+// Every random draw of the match comes from the seed, so clients can replay its turns
 typedef struct {
+    uint64_t seed;
 } net_packet_game_start;
 
+// Layout of a player state. It is never sent alone, clients receive it as
+// a keyframe or as a delta against the previous one (see pack_player_state).
+// It holds everything sim_step reads besides the build, so clients can predict turns from it.
 typedef struct {
     uint8_t id;
     net_player_stat stats[STAT_COUNT] NET_SIZE(
@@ -81,11 +98,22 @@ typedef struct {
     uint8_t effect[SE_COUNT] NET_SIZE("SE_COUNT");
     uint8_t effect_round_left[SE_COUNT] NET_SIZE("SE_COUNT");
     uint8_t banned_spells[MAX_SPELL_COUNT] NET_SIZE("MAX_SPELL_COUNT");
+    uint8_t effect_spells[SE_COUNT] NET_SIZE("SE_COUNT");  // Spell behind each effect, NO_SPELL if none
+    uint8_t last_spell;
+    uint8_t turn_effect;
+    uint8_t turn_effect_duration_left;
     // Should the game updates the status right as the packet is recieved (true)
     // or wait for the end of the round (false) ?
     uint8_t immediate;
 } net_packet_player_update;
 
+// A single packed player state entry
+typedef struct {
+    uint8_t immediate;
+    uint8_t size;
+    uint8_t* state NET_SIZE("s->size");
+} net_packet_player_state;
+
 // Player build
 // Includes stats and spells
 typedef struct {
@@ -104,21 +132,21 @@ typedef struct {
     uint8_t spell;
 } net_packet_player_action;
 
+// Sent once the whole turn is resolved. Clients replay the actions with sim_step and
+// compare the hash of their state with state_hash (see sim_hash), then ask for a resync if it differs.
+// Each action is player, action, x, y, spell.
+#define NET_TURN_ACTION_SIZE 5
 typedef struct {
-} net_packet_turn_end;
-
-typedef struct {
-} net_packet_round_start;
-
-typedef struct {
+    uint8_t outcome;  // turn_outcome
     uint8_t winner_id;
     uint8_t player_scores[MAX_PLAYER_COUNT] NET_SIZE("MAX_PLAYER_COUNT");
-} net_packet_round_end;
+    uint8_t action_count;
+    uint8_t* actions NET_SIZE("s->action_count * NET_TURN_ACTION_SIZE");
+    uint32_t state_hash;
+} net_packet_turn_result;
 
 typedef struct {
-    uint8_t winner_id;
-    uint8_t player_scores[MAX_PLAYER_COUNT] NET_SIZE("MAX_PLAYER_COUNT");
-} net_packet_game_end;
+} net_packet_round_start;
 
 typedef struct {
 } net_packet_player_ready;
@@ -126,10 +154,15 @@ typedef struct {
 typedef struct {
 } net_packet_game_reset;
 
+// Sent every second to the players of a room
 typedef struct {
     uint64_t round_timer;
 } net_packet_game_stats;
 
+// Sent by the server to idle connections, clients answer with the same packet
+typedef struct {
+} net_packet_heartbeat;
+
 typedef struct {
     char password[8];
 } net_packet_admin_connect;
@@ -148,3 +181,79 @@ typedef struct {
     uint8_t level;  // Log Level
     char message[128];
 } net_packet_server_message;
+
+// Rooms
+// Each entry of the room list is the room id (u32) followed by the player count and the game state
+#define NET_ROOM_ENTRY_SIZE 6
+#define NET_MAX_LISTED_ROOMS 255
+
+typedef struct {
+} net_packet_room_list_request;
+
+typedef struct {
+    uint8_t room_count;
+    uint8_t* rooms NET_SIZE("s->room_count * NET_ROOM_ENTRY_SIZE");
+} net_packet_room_list;
+
+// Creates a new room and moves the player inside it
+typedef struct {
+} net_packet_room_create;
+
+typedef struct {
+    uint32_t room_id;
+} net_packet_room_join;
+
+// Prediction
+
+// Sent by a client whose state does not match the server's anymore
+typedef struct {
+} net_packet_resync_request;
+
+// Current state of every player as keyframes, which do not replace the delta baseline
+typedef struct {
+    uint64_t rng_state;
+    uint8_t state_count;
+    uint32_t states_size;
+    uint8_t* states NET_SIZE("(int)s->states_size");
+} net_packet_resync;
+
+// Spells
+
+// Compiled spell programs of the server (see set_spell_programs), sent once joined.
+// Clients keep theirs when the hash is the same.
+typedef struct {
+    uint32_t hash;
+    uint32_t size;
+    uint8_t* programs NET_SIZE("(int)s->size");
+} net_packet_spell_programs;
+
+// Matchmaking
+
+// Leaves the current room to wait for a match, or leaves the queue when join is 0
+typedef struct {
+    uint8_t join;
+} net_packet_matchmake;
+
+// Answer to PKT_MATCHMAKE, the match itself comes as a PKT_CONNECTED
+typedef struct {
+    uint8_t queued;
+    uint32_t rating;
+    uint32_t waiting;  // Players in the queue, including this one
+} net_packet_matchmake_status;
+
+// Spectators
+
+// Leaves the current room to watch room_id, the connection only receives from then on
+typedef struct {
+    uint32_t room_id;
+} net_packet_spectate;
+
+// Starts the stream of a watched room. A snapshot follows, made of the packets a player gets
+// (players, builds, player states, the map and a resync), then everything broadcast to the room.
+typedef struct {
+    uint32_t room_id;
+    uint8_t in_game;
+    uint8_t master;
+    uint8_t max_round_count;
+    uint8_t round_scores[MAX_PLAYER_COUNT] NET_SIZE("MAX_PLAYER_COUNT");
+} net_packet_spectate_start;
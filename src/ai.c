@@ -0,0 +1,482 @@
+#include "ai.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern const spell all_spells[];
+extern const int spell_count;
+
+#define AI_TABLE_BITS 14
+#define AI_TABLE_SIZE (1 << AI_TABLE_BITS)
+#define AI_PROBES 8
+#define AI_MAX_DEPTH 64
+#define AI_EXPLORATION 0.7
+
+// Statistics of the searching player's actions in one state
+typedef struct {
+    uint64_t key;
+    uint32_t generation;  // Entries of older searches are free
+    uint32_t visits;
+    uint32_t count[AI_MAX_ACTIONS];
+    float value[AI_MAX_ACTIONS];
+} ai_node;
+
+typedef struct {
+    struct ai *owner;
+    pthread_t thread;
+    bool running;  // thread was started, it waits for the next decision between them
+    ai_node *nodes;
+    uint32_t generation;
+    rng policy;  // Opponents and rollouts
+    ai_node *root;
+    int iterations;
+} ai_search;
+
+struct ai {
+    ai_config config;
+    // Decision being searched, read by every thread
+    const sim_state *root;
+    const rng *root_rng;
+    int player;
+    const uint8_t *map;
+    const int8_t (*distances)[MAP_CELL_COUNT];
+    uint64_t deadline_ns;
+    int last_iterations;
+    // Wakes the helper searches up for a decision and waits for them
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t decision;
+    int helpers;    // Started threads
+    int searching;  // Helpers still searching the current decision
+    bool stopping;
+    ai_search searches[];
+};
+
+uint64_t ai_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Cooldowns
+
+void ai_start_cooldown(player_info *p, sim_action action) {
+    for (int i = 0; i < MAX_SPELL_COUNT && action.action == PA_SPELL; i++) {
+        if (p->spells[i] == action.spell && action.spell < spell_count) {
+            p->cooldowns[i] = all_spells[action.spell].cooldown;
+            return;
+        }
+    }
+}
+
+// Same as the client, which counts the turn of the cast
+void ai_tick_cooldowns(player_info *p) {
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        if (p->cooldowns[i] > 0) {
+            p->cooldowns[i]--;
+        }
+    }
+}
+
+// Policies
+
+sim_action ai_random_action(const sim_state *s, rng *r, int player) {
+    const player_info *me = &s->players[player];
+    for (int attempt = 0; attempt < MAX_SPELL_COUNT * 2 && me->stats[STAT_HEALTH].value > 0; attempt++) {
+        int index = rng_range(r, MAX_SPELL_COUNT);
+        if (me->banned[index] || me->spells[index] >= spell_count) {
+            continue;
+        }
+        const spell *sp = &all_spells[me->spells[index]];
+        if (sp->type == ST_TARGET) {
+            for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+                const player_info *other = &s->players[i];
+                int distance = abs(other->x - me->x) + abs(other->y - me->y);
+                if (other != me && other->connected && other->stats[STAT_HEALTH].value > 0 &&
+                    distance >= sp->min_range && distance <= sp->range) {
+                    return (sim_action){.action = PA_SPELL, .x = other->x, .y = other->y, .spell = me->spells[index]};
+                }
+            }
+        } else if (sp->type == ST_AROUND) {
+            return (sim_action){.action = PA_SPELL, .x = me->x, .y = me->y, .spell = me->spells[index]};
+        } else if (sp->type == ST_MOVE) {
+            int dx = rng_range(r, 2 * sp->range + 1) - sp->range;
+            int dy = rng_range(r, 2 * sp->range + 1) - sp->range;
+            int x = me->x + dx, y = me->y + dy;
+            int distance = abs(dx) + abs(dy);
+            if (x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT && distance >= sp->min_range &&
+                distance <= sp->range && sim_player_on_cell((sim_state *)s, x, y) == NULL) {
+                return (sim_action){.action = PA_SPELL, .x = x, .y = y, .spell = me->spells[index]};
+            }
+        }
+    }
+    return (sim_action){.action = PA_STUNNED, .x = me->x, .y = me->y, .spell = NO_SPELL};
+}
+
+void ai_random_build(rng *r, player_info *p) {
+    uint8_t pool[256];
+    for (int i = 0; i < spell_count; i++) {
+        pool[i] = i;
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        int j = i + rng_range(r, spell_count - i);
+        uint8_t tmp = pool[i];
+        pool[i] = pool[j];
+        pool[j] = tmp;
+        p->spells[i] = pool[i];
+    }
+    int health = rng_range(r, 201);
+    int strength = rng_range(r, 201 - health);
+    int speed = 200 - health - strength;
+    p->stats[STAT_HEALTH].base = 50 + health;
+    p->stats[STAT_STRENGTH].base = strength;
+    p->stats[STAT_SPEED].base = speed > 155 ? 255 : 100 + speed;
+    for (int i = 0; i < STAT_COUNT; i++) {
+        p->stats[i].max = p->stats[i].base;
+        p->stats[i].value = p->stats[i].base;
+    }
+}
+
+int nearest_opponent(const sim_state *s, int player, int x, int y) {
+    int nearest = INT_MAX;
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        const player_info *p = &s->players[i];
+        if (i != player && p->connected && p->stats[STAT_HEALTH].value > 0) {
+            nearest = fmin(nearest, abs(p->x - x) + abs(p->y - y));
+        }
+    }
+    return nearest;
+}
+
+// Actions the searching player considers. Each move spell only keeps the reachable cells
+// closest to and farthest from the opponents, so the tree stays narrow.
+int legal_actions(const sim_state *s, int player, const uint8_t *map, const int8_t (*distance_table)[MAP_CELL_COUNT],
+                  sim_action out[AI_MAX_ACTIONS]) {
+    const player_info *me = &s->players[player];
+    int count = 0;
+    if (me->effect[SE_STUN] || me->stats[STAT_HEALTH].value == 0) {
+        out[count++] = (sim_action){.action = PA_STUNNED, .x = me->x, .y = me->y, .spell = NO_SPELL};
+        return count;
+    }
+
+    int8_t walked[MAP_CELL_COUNT];
+    const int8_t *distances = walked;
+    if (distance_table != NULL) {
+        distances = distance_table[me->y * MAP_WIDTH + me->x];
+    } else {
+        walk_distances(map, me->x, me->y, walked);
+    }
+    for (int slot = 0; slot < MAX_SPELL_COUNT && count < AI_MAX_ACTIONS; slot++) {
+        uint8_t id = me->spells[slot];
+        if (me->banned[slot] || me->cooldowns[slot] > 0 || id >= spell_count) {
+            continue;
+        }
+        const spell *sp = &all_spells[id];
+        if ((sp->type == ST_TARGET && sp->range == 0) || sp->type == ST_AROUND) {
+            out[count++] = (sim_action){.action = PA_SPELL, .x = me->x, .y = me->y, .spell = id};
+        } else if (sp->type == ST_TARGET) {
+            for (int i = 0; i < MAX_PLAYER_COUNT && count < AI_MAX_ACTIONS; i++) {
+                const player_info *other = &s->players[i];
+                int distance = distances[other->y * MAP_WIDTH + other->x];
+                if (i != player && other->connected && other->stats[STAT_HEALTH].value > 0 &&
+                    distance >= sp->min_range && distance <= sp->range) {
+                    out[count++] = (sim_action){.action = PA_SPELL, .x = other->x, .y = other->y, .spell = id};
+                }
+            }
+        } else if (sp->type == ST_MOVE) {
+            int closest = -1, farthest = -1;
+            int closest_distance = INT_MAX, farthest_distance = -1;
+            for (int cell = 0; cell < MAP_WIDTH * MAP_HEIGHT; cell++) {
+                int x = cell % MAP_WIDTH, y = cell / MAP_WIDTH;
+                if (distances[cell] < fmax(sp->min_range, 1) || distances[cell] > sp->range ||
+                    sim_player_on_cell((sim_state *)s, x, y) != NULL) {
+                    continue;
+                }
+                int d = nearest_opponent(s, player, x, y);
+                if (d < closest_distance) {
+                    closest_distance = d;
+                    closest = cell;
+                }
+                if (d > farthest_distance) {
+                    farthest_distance = d;
+                    farthest = cell;
+                }
+            }
+            if (closest != -1) {
+                out[count++] = (sim_action){
+                    .action = PA_SPELL, .x = closest % MAP_WIDTH, .y = closest / MAP_WIDTH, .spell = id};
+            }
+            if (farthest != -1 && farthest != closest && count < AI_MAX_ACTIONS) {
+                out[count++] = (sim_action){
+                    .action = PA_SPELL, .x = farthest % MAP_WIDTH, .y = farthest / MAP_WIDTH, .spell = id};
+            }
+        }
+    }
+    if (count == 0) {
+        out[count++] = (sim_action){.action = PA_STUNNED, .x = me->x, .y = me->y, .spell = NO_SPELL};
+    }
+    return count;
+}
+
+// Search
+
+// Cooldowns change what the player can do, so they are part of the key
+uint64_t node_key(const sim_state *s, const rng *r, int player) {
+    return hash_bytes(sim_hash(s, r), s->players[player].cooldowns, MAX_SPELL_COUNT);
+}
+
+// Returns NULL when the probed entries are all taken by other states
+ai_node *find_node(ai_search *t, uint64_t key) {
+    for (int i = 0; i < AI_PROBES; i++) {
+        ai_node *n = &t->nodes[(key + i) & (AI_TABLE_SIZE - 1)];
+        if (n->generation != t->generation) {
+            memset(n, 0, sizeof(*n));
+            n->key = key;
+            n->generation = t->generation;
+            return n;
+        }
+        if (n->key == key) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+// UCB1, actions which were never tried come first
+int select_action(const ai_node *n, int count) {
+    int best = 0;
+    double best_score = -1;
+    double log_visits = log(n->visits + 1);
+    for (int i = 0; i < count; i++) {
+        if (n->count[i] == 0) {
+            return i;
+        }
+        double score = n->value[i] / n->count[i] + AI_EXPLORATION * sqrt(log_visits / n->count[i]);
+        if (score > best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// 1 for a win, 0 for a loss. Unfinished games are judged on the health left.
+float evaluate(const sim_state *s, int player, turn_outcome outcome, uint8_t winner_id) {
+    if (outcome != TO_CONTINUE) {
+        return winner_id == player ? 1.f : winner_id == GAME_TIE ? 0.5f : 0.f;
+    }
+    float mine = 0, best_other = 0;
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        const player_info *p = &s->players[i];
+        if (p->connected == false || p->stats[STAT_HEALTH].max == 0) {
+            continue;
+        }
+        float health = (float)p->stats[STAT_HEALTH].value / p->stats[STAT_HEALTH].max;
+        if (i == player) {
+            mine = health;
+        } else if (health > best_other) {
+            best_other = health;
+        }
+    }
+    return 0.5f + 0.5f * (mine - best_other);
+}
+
+void search_iteration(ai *a, ai_search *t) {
+    sim_state s = *a->root;
+    // The caller's state may point to a map that changes during the search
+    s.map = a->map;
+    rng game = *a->root_rng;
+    ai_node *path[AI_MAX_DEPTH];
+    int chosen[AI_MAX_DEPTH];
+    int path_length = 0;
+    bool in_tree = true;
+    sim_action actions[MAX_PLAYER_COUNT] = {0};
+    sim_action mine[AI_MAX_ACTIONS];
+
+    turn_outcome outcome = TO_CONTINUE;
+    uint8_t winner_id = GAME_TIE;
+    for (int depth = 0; depth < a->config.max_depth && outcome == TO_CONTINUE; depth++) {
+        player_info *me = &s.players[a->player];
+        int count = legal_actions(&s, a->player, a->map, a->distances, mine);
+        int choice = 0;
+        ai_node *node = in_tree ? find_node(t, node_key(&s, &game, a->player)) : NULL;
+        if (node != NULL) {
+            choice = select_action(node, count);
+            path[path_length] = node;
+            chosen[path_length] = choice;
+            path_length++;
+            // The tree grows by one node per iteration
+            in_tree = node->visits > 0;
+        } else {
+            in_tree = false;
+            choice = rng_range(&t->policy, count);
+        }
+
+        for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+            if (s.players[i].connected && i != a->player) {
+                actions[i] = ai_random_action(&s, &t->policy, i);
+            }
+        }
+        actions[a->player] = mine[choice];
+        ai_start_cooldown(me, mine[choice]);
+        outcome = sim_step(&s, actions, &game, &winner_id);
+        ai_tick_cooldowns(me);
+    }
+
+    float value = evaluate(&s, a->player, outcome, winner_id);
+    for (int i = 0; i < path_length; i++) {
+        path[i]->visits++;
+        path[i]->count[chosen[i]]++;
+        path[i]->value[chosen[i]] += value;
+    }
+    t->iterations++;
+}
+
+void *run_search(void *arg) {
+    ai_search *t = arg;
+    ai *a = t->owner;
+    t->generation++;
+    t->iterations = 0;
+    t->root = find_node(t, node_key(a->root, a->root_rng, a->player));
+    // Stops before an iteration as long as the slowest one so far would end past the deadline
+    uint64_t now = ai_now_ns(), slowest = 0;
+    while (now + slowest < a->deadline_ns) {
+        search_iteration(a, t);
+        uint64_t end = ai_now_ns();
+        slowest = end - now > slowest ? end - now : slowest;
+        now = end;
+    }
+    return NULL;
+}
+
+// Searches after the first one run on their own thread, parked between decisions
+void *run_helper(void *arg) {
+    ai_search *t = arg;
+    ai *a = t->owner;
+    uint64_t decision = 0;
+    pthread_mutex_lock(&a->lock);
+    while (1) {
+        while (a->decision == decision && a->stopping == false) {
+            pthread_cond_wait(&a->start, &a->lock);
+        }
+        if (a->stopping) {
+            break;
+        }
+        decision = a->decision;
+        pthread_mutex_unlock(&a->lock);
+        run_search(t);
+        pthread_mutex_lock(&a->lock);
+        if (--a->searching == 0) {
+            pthread_cond_signal(&a->done);
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+ai *ai_create(ai_config config, uint64_t seed) {
+    config.threads = config.threads < 1 ? 1 : config.threads;
+    config.max_depth = config.max_depth < 1 ? 1 : config.max_depth > AI_MAX_DEPTH ? AI_MAX_DEPTH : config.max_depth;
+    ai *a = calloc(1, sizeof(ai) + config.threads * sizeof(ai_search));
+    if (a == NULL) {
+        return NULL;
+    }
+    a->config = config;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->start, NULL);
+    pthread_cond_init(&a->done, NULL);
+    for (int i = 0; i < config.threads; i++) {
+        ai_search *t = &a->searches[i];
+        t->owner = a;
+        t->nodes = calloc(AI_TABLE_SIZE, sizeof(ai_node));
+        if (t->nodes == NULL) {
+            ai_destroy(a);
+            return NULL;
+        }
+        rng_seed(&t->policy, seed + i);
+    }
+    // The calling thread runs the first search, a helper that could not start only leaves its search out
+    for (int i = 1; i < config.threads; i++) {
+        ai_search *t = &a->searches[i];
+        t->running = pthread_create(&t->thread, NULL, run_helper, t) == 0;
+        a->helpers += t->running;
+    }
+    return a;
+}
+
+void ai_destroy(ai *a) {
+    if (a == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&a->lock);
+    a->stopping = true;
+    pthread_cond_broadcast(&a->start);
+    pthread_mutex_unlock(&a->lock);
+    for (int i = 0; i < a->config.threads; i++) {
+        if (a->searches[i].running) {
+            pthread_join(a->searches[i].thread, NULL);
+        }
+        free(a->searches[i].nodes);
+    }
+    pthread_cond_destroy(&a->done);
+    pthread_cond_destroy(&a->start);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+}
+
+sim_action ai_choose_action(ai *a, const sim_state *s, const rng *r, int player, const uint8_t *map,
+                            const int8_t (*distances)[MAP_CELL_COUNT]) {
+    sim_action actions[AI_MAX_ACTIONS];
+    int count = legal_actions(s, player, map, distances, actions);
+    if (count == 1) {
+        a->last_iterations = 0;
+        return actions[0];
+    }
+
+    a->root = s;
+    a->root_rng = r;
+    a->player = player;
+    a->map = map;
+    a->distances = distances;
+    // 5% of the budget is left for the bookkeeping around the searches and the scheduler
+    a->deadline_ns = ai_now_ns() + (uint64_t)a->config.budget_ms * 950000;
+    // Root parallelism, the calling thread runs the first search
+    pthread_mutex_lock(&a->lock);
+    a->decision++;
+    a->searching = a->helpers;
+    pthread_cond_broadcast(&a->start);
+    pthread_mutex_unlock(&a->lock);
+    run_search(&a->searches[0]);
+    pthread_mutex_lock(&a->lock);
+    while (a->searching > 0) {
+        pthread_cond_wait(&a->done, &a->lock);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    // Most visited action over every search
+    uint64_t visits[AI_MAX_ACTIONS] = {0};
+    double values[AI_MAX_ACTIONS] = {0};
+    a->last_iterations = 0;
+    for (int i = 0; i < a->config.threads; i++) {
+        ai_search *t = &a->searches[i];
+        a->last_iterations += t->iterations;
+        for (int j = 0; j < count && t->root != NULL; j++) {
+            visits[j] += t->root->count[j];
+            values[j] += t->root->value[j];
+        }
+    }
+    int best = 0;
+    for (int i = 1; i < count; i++) {
+        if (visits[i] > visits[best] || (visits[i] == visits[best] && values[i] > values[best])) {
+            best = i;
+        }
+    }
+    return actions[best];
+}
+
+int ai_last_iterations(const ai *a) {
+    return a->last_iterations;
+}
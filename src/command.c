@@ -1,11 +1,13 @@
 #include "command.h"
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "net_protocol.h"
 
 bool load_editor(const char *filename);
 
-const char *all_commands = "update, clear, help, editor";
+const char *all_commands = "update, clear, help, editor, rooms, room, match, spectate";
 
 #define GETTOKI(X)                                                                                               \
     const char *X##str = strtok(NULL, " ");                                                                      \
@@ -29,6 +31,15 @@ static bool streq(const char *a, const char *b) {
     return strcmp(a, b) == 0;
 }
 
+// The packet is sent and freed by the caller
+static command_result packet_result(net_packet p) {
+    net_packet *packet = malloc(sizeof(net_packet));
+    if (packet != NULL) {
+        *packet = p;
+    }
+    return (command_result){.valid = true, .has_packet = true, .type = p.type, .content = packet};
+}
+
 command_type get_command_type(char *str) {
     char *tok = strtok(str, " ");
     if (streq(tok, "update")) {
@@ -39,6 +50,14 @@ command_type get_command_type(char *str) {
         return CT_HELP;
     } else if (streq(tok, "editor")) {
         return CT_LOAD_EDITOR;
+    } else if (streq(tok, "rooms")) {
+        return CT_ROOM_LIST;
+    } else if (streq(tok, "room")) {
+        return CT_ROOM;
+    } else if (streq(tok, "match")) {
+        return CT_MATCH;
+    } else if (streq(tok, "spectate")) {
+        return CT_SPECTATE;
     } else {
         return CT_UNKNOWN;
     }
@@ -56,6 +75,14 @@ const char *command_usage(command_type command) {
             return "help (command)";
         case CT_LOAD_EDITOR:
             return "editor <map_name>";
+        case CT_ROOM_LIST:
+            return "rooms";
+        case CT_ROOM:
+            return "room create | room join <room_id>";
+        case CT_MATCH:
+            return "match | match cancel";
+        case CT_SPECTATE:
+            return "spectate <room_id>";
     }
     return "Unknown command";
 }
@@ -95,6 +122,39 @@ command_result handle_command(char *str) {
             load_editor(filename);
         }
         return (command_result){.valid = true};
+    } else if (command == CT_ROOM_LIST) {
+        return packet_result(pkt_room_list_request());
+    } else if (command == CT_ROOM) {
+        GETTOKS(action);
+        if (streq(action, "create")) {
+            return packet_result(pkt_room_create());
+        } else if (streq(action, "join")) {
+            GETTOKS(idstr);
+            // Room ids do not fit in strtoint
+            char *end = NULL;
+            unsigned long id = strtoul(idstr, &end, 10);
+            if (*end != '\0') {
+                return (command_result){.valid = false, .content = (void *)command_usage(command)};
+            }
+            return packet_result(pkt_room_join(id));
+        }
+        return (command_result){.valid = false, .content = (void *)command_usage(command)};
+    } else if (command == CT_MATCH) {
+        const char *action = strtok(NULL, " ");
+        if (action == NULL) {
+            return packet_result(pkt_matchmake(1));
+        } else if (streq(action, "cancel")) {
+            return packet_result(pkt_matchmake(0));
+        }
+        return (command_result){.valid = false, .content = (void *)command_usage(command)};
+    } else if (command == CT_SPECTATE) {
+        GETTOKS(idstr);
+        char *end = NULL;
+        unsigned long id = strtoul(idstr, &end, 10);
+        if (*end != '\0') {
+            return (command_result){.valid = false, .content = (void *)command_usage(command)};
+        }
+        return packet_result(pkt_spectate(id));
     } else {
         return (command_result){.valid = false, .has_packet = false};
     }
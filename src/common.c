@@ -1,13 +1,22 @@
+#define _GNU_SOURCE
 #include "common.h"
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#ifndef WINDOWS_BUILD
+#include <sys/mman.h>
+#endif
 
 #ifdef WINDOWS_BUILD
 char *strchrnul(char *s, int c) {
@@ -21,67 +30,224 @@ char *strchrnul(char *s, int c) {
 }
 #endif
 
-#define MAX_LOG_HISTORY 8192
+// Log lines go through a ring of fixed-size records. Any thread formats its line straight into
+// a free record, without allocating or locking, and a background thread writes the records out
+// in order. Written records stay in the ring as the history the console reads.
+#define LOG_RING_SIZE 8192  // Power of two
+#define LOG_LINE_SIZE 256
+// Sequence of a record while its line is being formatted
+#define LOG_RECORD_BUSY UINT64_MAX
 
-char *log_history[MAX_LOG_HISTORY] = {0};
-log_level log_levels[MAX_LOG_HISTORY] = {0};
-int log_history_ptr = 0;
+// Bounded MPSC queue after Dmitry Vyukov's: seq is the index of the record while it is free,
+// index + 1 once its line is written and index + LOG_RING_SIZE once it is out, free for the next lap
+typedef struct {
+    _Atomic uint64_t seq;
+    log_level level;
+    char text[LOG_LINE_SIZE];
+} log_record;
 
-void LOG_(log_level level, const char *fmt, va_list args) {
-#ifndef DEBUG
-    if (level == LL_DEBUG) {
-        return;
+log_record log_ring[LOG_RING_SIZE];
+_Atomic uint64_t log_head = 0;     // Next index to claim
+uint64_t log_tail = 0;             // Next index to write out, guarded by log_flush_lock
+_Atomic uint64_t log_cleared = 0;  // First index shown by the console
+_Atomic uint64_t log_dropped = 0;  // Lines lost because the writer fell a whole ring behind
+uint32_t log_mask = LL_ALL;
+
+pthread_once_t log_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+// The writer sleeps on log_wake, loggers only signal it when it says it is idle
+pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+atomic_bool log_writer_idle = false;
+bool log_inline = false;  // No writer thread, loggers write their lines themselves
+int log_pid = 0;
+
+// Writes out the complete records at the tail, returns how many. Called with log_flush_lock held.
+int log_write_out() {
+    int written = 0;
+    while (1) {
+        log_record *r = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load(&r->seq) != log_tail + 1) {
+            break;
+        }
+        printf("[%s(%d)]%s\n", LOG_PREFIX, log_pid, r->text);
+        atomic_store(&r->seq, log_tail + LOG_RING_SIZE);
+        log_tail++;
+        written++;
     }
-#endif
-    char formatted[1024] = {0};
-    int len = vsnprintf(formatted, sizeof(formatted), fmt, args);
-    int prefix = snprintf(NULL, 0, "[%s(%d)]", LOG_PREFIX, getpid());
-    log_history[log_history_ptr] = malloc(len + prefix + 1);
-    snprintf(log_history[log_history_ptr], len + prefix + 1, "[%s(%d)]%s", LOG_PREFIX, getpid(), formatted);
-    log_levels[log_history_ptr] = level;
+    uint64_t dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped > 0) {
+        printf("[%s(%d)]%llu log lines dropped\n", LOG_PREFIX, log_pid, (unsigned long long)dropped);
+    }
+    if (written > 0 || dropped > 0) {
+        fflush(stdout);
+    }
+    return written;
+}
 
-    printf("%s\n", log_history[log_history_ptr]);
-    log_history_ptr++;
-    if (log_history_ptr == MAX_LOG_HISTORY) {
-        // TODO: Free previous log
-        log_history_ptr = 0;
+void flush_logs() {
+    pthread_mutex_lock(&log_flush_lock);
+    log_write_out();
+    pthread_mutex_unlock(&log_flush_lock);
+}
+
+void *log_writer_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&log_flush_lock);
+        int written = log_write_out();
+        pthread_mutex_unlock(&log_flush_lock);
+        if (written > 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&log_wake_lock);
+        atomic_store(&log_writer_idle, true);
+        // A line finished before the flag was seen would not signal, the timeout covers the rest
+        log_record *next = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load(&next->seq) != log_tail + 1) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&log_wake, &log_wake_lock, &deadline);
+        }
+        atomic_store(&log_writer_idle, false);
+        pthread_mutex_unlock(&log_wake_lock);
     }
+    return NULL;
 }
 
-void LOG(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    LOG_(LL_INFO, fmt, args);
-    va_end(args);
+void log_init() {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&log_ring[i].seq, i);
+    }
+    log_pid = getpid();
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, log_writer_main, NULL) == 0) {
+        pthread_detach(writer);
+    } else {
+        log_inline = true;
+    }
+    // Lines logged right before exit(1) are usually the interesting ones
+    atexit(flush_logs);
 }
 
-void LOGL(log_level level, const char *fmt, ...) {
+void log_write(log_level level, const char *fmt, ...) {
+    pthread_once(&log_once, log_init);
+    uint64_t index = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_record *r = NULL;
+    while (1) {
+        r = &log_ring[index & (LOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - index);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &index, index + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0 || seq == LOG_RECORD_BUSY) {
+            // Logging never waits for the writer
+            atomic_fetch_add(&log_dropped, 1);
+            return;
+        } else {
+            index = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    // Tells the console the previous line of this record is going away, before it does
+    atomic_store(&r->seq, LOG_RECORD_BUSY);
+    r->level = level;
     va_list args;
     va_start(args, fmt);
-    LOG_(level, fmt, args);
+    vsnprintf(r->text, sizeof(r->text), fmt, args);
     va_end(args);
+    atomic_store(&r->seq, index + 1);
+
+    if (log_inline) {
+        flush_logs();
+    } else if (atomic_load(&log_writer_idle)) {
+        pthread_mutex_lock(&log_wake_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
 }
 
-const char *get_log(int idx) {
-    if (idx < log_history_ptr && idx >= 0) {
-        return log_history[idx];
+bool set_log_levels(const char *levels) {
+    const char *names[] = {[LL_INFO] = "info", [LL_WARNING] = "warning", [LL_DEBUG] = "debug", [LL_ERROR] = "error"};
+    uint32_t mask = 0;
+    while (*levels != '\0') {
+        const char *end = strchrnul(levels, ',');
+        bool found = false;
+        for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+            if ((size_t)(end - levels) == strlen(names[i]) && strncmp(levels, names[i], end - levels) == 0) {
+                mask |= LL_BIT(i);
+                found = true;
+            }
+        }
+        if (found == false) {
+            return false;
+        }
+        levels = *end == ',' ? end + 1 : end;
     }
-    return NULL;
+    log_mask = mask;
+    return true;
 }
 
-log_level get_level(int idx) {
-    if (idx < log_history_ptr && idx >= 0) {
-        return log_levels[idx];
+// Console
+
+// Oldest index of the history, the ring only holds its last lap
+uint64_t log_first(uint64_t head) {
+    uint64_t first = head > LOG_RING_SIZE ? head - LOG_RING_SIZE : 0;
+    uint64_t cleared = atomic_load(&log_cleared);
+    return cleared > first ? cleared : first;
+}
+
+// Copies the record out, NULL if it is not written yet or was overwritten while being read
+const log_record *read_log(int idx) {
+    static __thread log_record copy;
+    pthread_once(&log_once, log_init);
+    uint64_t head = atomic_load(&log_head);
+    uint64_t first = log_first(head);
+    if (idx < 0 || (uint64_t)idx >= head - first) {
+        return NULL;
+    }
+    uint64_t index = first + idx;
+    log_record *r = &log_ring[index & (LOG_RING_SIZE - 1)];
+    uint64_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+    if (seq != index + 1 && seq != index + LOG_RING_SIZE) {
+        return NULL;
     }
-    return LL_INFO;
+    copy.level = r->level;
+    memcpy(copy.text, r->text, sizeof(copy.text));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&r->seq, memory_order_relaxed) != seq) {
+        return NULL;
+    }
+    copy.text[LOG_LINE_SIZE - 1] = '\0';
+    return &copy;
+}
+
+const char *get_log(int idx) {
+    const log_record *r = read_log(idx);
+    return r != NULL ? r->text : NULL;
+}
+
+log_level get_level(int idx) {
+    const log_record *r = read_log(idx);
+    return r != NULL ? r->level : LL_INFO;
 }
 
 int get_log_count() {
-    return log_history_ptr;
+    uint64_t head = atomic_load(&log_head);
+    return head - log_first(head);
 }
 
 void clear_logs() {
-    log_history_ptr = 0;
+    atomic_store(&log_cleared, atomic_load(&log_head));
 }
 
 int strtoint(const char *str, int *out) {
@@ -423,32 +589,428 @@ int get_spell_damage(player_info *info, const spell *s) {
     return s->damage_value + info->stats[STAT_STRENGTH].value / 4;
 }
 
+// Status effects
+// One handler per spell_effect, spells without an entry (dodge, revert) have no lasting effect
+
+void cleanse_effect(player_info *p, const spell *s) {
+    (void)s;
+    for (int i = 0; i < SE_COUNT; i++) {
+        p->effect[i] = false;
+        p->effect_round_left[i] = 0;
+        p->spell_effect[i] = NULL;
+    }
+}
+
+void focus_effect(player_info *p, const spell *s) {
+    (void)s;
+    p->turn_effect = SE_FOCUS;
+    p->turn_effect_duration_left = 1;
+}
+
+void block_effect(player_info *p, const spell *s) {
+    (void)s;
+    p->turn_effect = SE_BLOCK;
+    p->turn_effect_duration_left = 0;
+}
+
+void banish_effect(player_info *p, const spell *s) {
+    (void)s;
+    // Bans are indexed by build slot, not by spell id
+    for (int i = 0; i < MAX_SPELL_COUNT && p->last_spell != NO_SPELL; i++) {
+        if (p->spells[i] == p->last_spell) {
+            p->banned[i] = true;
+        }
+    }
+}
+
+// Lasts effect_duration turns, sim_effect_tick applies it at the end of each
+void timed_effect(player_info *p, const spell *s) {
+    p->effect[s->effect] = true;
+    p->effect_round_left[s->effect] = s->effect_duration;
+    p->spell_effect[s->effect] = s;
+}
+
+typedef void (*effect_handler)(player_info *p, const spell *s);
+
+const effect_handler effect_handlers[SE_REVERT + 1] = {
+    [SE_NONE] = timed_effect,       [SE_STUN] = timed_effect,   [SE_BURN] = timed_effect,
+    [SE_POISON] = timed_effect,     [SE_SLOW] = timed_effect,   [SE_CLEANSE] = cleanse_effect,
+    [SE_FOCUS] = focus_effect,      [SE_BLOCK] = block_effect,  [SE_BANISH] = banish_effect,
+};
+
 void apply_effect(player_info *p, const spell *s) {
-    if (s->effect == SE_CLEANSE) {
+    if (s->effect <= SE_REVERT && effect_handlers[s->effect] != NULL) {
+        effect_handlers[s->effect](p, s);
+    }
+}
+
+// Turn rules
+// Runs millions of times in the simulator, so nothing below allocates or logs on the normal path
+
+void rng_seed(rng *r, uint64_t seed) {
+    // splitmix64 so close seeds still give unrelated sequences
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    // xorshift gets stuck on 0
+    r->state = z != 0 ? z : 0x9E3779B97F4A7C15ull;
+}
+
+uint64_t rng_next(rng *r) {
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return r->state * 0x2545F4914F6CDD1Dull;
+}
+
+int rng_range(rng *r, int n) {
+    return (int)((rng_next(r) >> 32) * n >> 32);
+}
+
+// The client resolves spells outside of sim_step with no state, nothing is recorded then
+void sim_event(sim_state *s, turn_event_type type, int player, int kind, int x, int y, int value) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->event_count == SIM_MAX_TURN_EVENTS) {
+        LOGL(LL_WARNING, "Too many events this turn");
+        return;
+    }
+    s->events[s->event_count++] = (turn_event){
+        .type = type, .player = player, .kind = kind, .x = x, .y = y, .value = fmin(fmax(value, 0), 255)};
+}
+
+void sim_reset_player(player_info *p, int x, int y) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+        p->stats[i].max = p->stats[i].base;
+        p->stats[i].value = p->stats[i].base;
+    }
+    p->x = x;
+    p->y = y;
+    for (int i = 0; i < SE_COUNT; i++) {
+        p->effect[i] = false;
+        p->effect_round_left[i] = 0;
+        p->spell_effect[i] = NULL;
+    }
+    p->turn_effect = SE_NONE;
+    p->turn_effect_duration_left = 0;
+    p->last_spell = NO_SPELL;
+    p->spell = NO_SPELL;
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        p->banned[i] = false;
+        p->cooldowns[i] = 0;
+    }
+}
+
+player_info *sim_player_on_cell(sim_state *s, int x, int y) {
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        player_info *p = &s->players[i];
+        if (p->connected && p->x == x && p->y == y) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+void sim_update_stats(player_info *p, const spell *s) {
+    if (s->stat_max) {
+        p->stats[s->stat].max = fmin(p->stats[s->stat].max + s->stat_value, 200);
+        p->stats[s->stat].value = fmin(p->stats[s->stat].value + s->stat_value, 200);
+    } else {
+        p->stats[s->stat].value = fmin(fmax(p->stats[s->stat].value + s->stat_value, 0), p->stats[s->stat].max);
+    }
+}
+
+void sim_effect_player(sim_state *state, player_info *p, const spell *s) {
+    apply_effect(p, s);
+    if (s->effect < SE_COUNT) {
+        sim_event(state, TE_EFFECT, p->id, s->effect, p->x, p->y, p->effect_round_left[s->effect]);
+    }
+}
+
+// Spell hits, one handler per cast_type
+
+void cast_hit(sim_state *state, player_info *from, player_info *to, const spell *s) {
+    int damage = get_spell_damage(from, s);
+    to->stats[STAT_HEALTH].value = fmin(fmax(to->stats[STAT_HEALTH].value - damage, 0), to->stats[STAT_HEALTH].max);
+    sim_event(state, TE_DAMAGE, to->id, from->id, to->x, to->y, damage);
+    if (s->effect != SE_NONE) {
+        sim_effect_player(state, to, s);
+    }
+    if (s->stat_value != 0) {
+        sim_update_stats(to, s);
+    }
+}
+
+void effect_hit(sim_state *state, player_info *from, player_info *to, const spell *s) {
+    (void)from;
+    sim_effect_player(state, to, s);
+}
+
+typedef void (*hit_handler)(sim_state *state, player_info *from, player_info *to, const spell *s);
+
+const hit_handler hit_handlers[CT_CAST_EFFECT + 1] = {
+    [CT_CAST] = cast_hit,
+    [CT_EFFECT] = effect_hit,
+    [CT_CAST_EFFECT] = cast_hit,
+};
+
+void sim_spell_hit_native(sim_state *state, player_info *from, player_info *to, const spell *s) {
+    hit_handlers[s->cast_type](state, from, to, s);
+}
+
+void sim_block_stun(player_info *p) {
+    p->effect[SE_STUN] = true;
+    p->effect_round_left[SE_STUN] = 2;
+    p->spell_effect[SE_STUN] = &all_spells[6];  // TODO: Should not be hardcoded
+}
+
+int sim_effect_tick(player_info *p, int effect) {
+    const spell *s = p->spell_effect[effect];
+    if (p->effect[effect] == false || s == NULL || s->cast_type == CT_CAST) {
+        return -1;
+    }
+    int damage = get_spell_damage(p, s);
+    p->stats[STAT_HEALTH].value = fmax(p->stats[STAT_HEALTH].value - damage, 0);
+    return damage;
+}
+
+// Spell casts, one handler per spell_type
+
+void cast_move(sim_state *state, player_info *player, const spell *s, int build_spell_index) {
+    (void)build_spell_index;
+    if (s->effect == SE_DODGE) {
+        player->turn_effect = SE_DODGE;
+        player->turn_effect_duration_left = 0;
+    } else if (sim_player_on_cell(state, player->ax, player->ay) == NULL) {
+        player->x = player->ax;
+        player->y = player->ay;
+    }
+}
+
+// Returns true when other avoids the attack of player by dodging or blocking it
+bool sim_defend(sim_state *state, player_info *player, player_info *other) {
+    if (other->turn_effect == SE_DODGE) {
+        if (sim_player_on_cell(state, other->ax, other->ay) == NULL) {
+            other->x = other->ax;
+            other->y = other->ay;
+        }
+        return true;
+    } else if (other->turn_effect == SE_BLOCK) {
+        sim_block_stun(player);
+        return true;
+    }
+    return false;
+}
+
+void cast_target(sim_state *state, player_info *player, const spell *s, int build_spell_index) {
+    if (s->effect == SE_BANISH) {
+        player->banned[build_spell_index] = true;
+    }
+    player_info *other = sim_player_on_cell(state, player->ax, player->ay);
+    if (other != NULL && sim_defend(state, player, other) == false) {
+        sim_spell_hit(state, player, other, s);
+    }
+}
+
+// The program picks who is hit with OP_AROUND, it starts on the caster
+void cast_around(sim_state *state, player_info *player, const spell *s, int build_spell_index) {
+    (void)build_spell_index;
+    sim_spell_hit(state, player, player, s);
+}
+
+typedef void (*cast_handler)(sim_state *state, player_info *player, const spell *s, int build_spell_index);
+
+// Zone spells are not playable yet, casting one only uses the turn
+const cast_handler cast_handlers[ST_AROUND + 1] = {
+    [ST_MOVE] = cast_move,
+    [ST_TARGET] = cast_target,
+    [ST_AROUND] = cast_around,
+};
+
+void sim_play_action(sim_state *state, player_info *player) {
+    if (player->action == PA_STUNNED) {
+        sim_event(state, TE_ACTION, player->id, player->action, player->x, player->y, 0);
+        return;
+    } else if (player->action != PA_SPELL) {
+        // A bad packet from one player must not take down every other room
+        LOGL(LL_ERROR, "Unsupported player action %d from %s", player->action, player->name);
+        return;
+    }
+
+    int build_spell_index = -1;
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        if (player->spell == player->spells[i] && player->spell < spell_count) {
+            build_spell_index = i;
+        }
+    }
+    // Stunned players, spells out of the build and banned spells all skip the turn
+    if (player->effect[SE_STUN] || build_spell_index == -1 || player->banned[build_spell_index]) {
+        sim_event(state, TE_ACTION, player->id, PA_STUNNED, player->x, player->y, 0);
+        return;
+    }
+
+    const spell *s = &all_spells[player->spell];
+    sim_event(state, TE_ACTION, player->id, player->action, player->ax, player->ay, player->spell);
+    player->last_spell = player->spell;
+    if (s->type <= ST_AROUND && cast_handlers[s->type] != NULL) {
+        cast_handlers[s->type](state, player, s, build_spell_index);
+    }
+}
+
+int action_speed(player_info *p) {
+    int speed = p->stats[STAT_SPEED].value;
+    if (p->action == PA_SPELL && p->spell < spell_count) {
+        speed += all_spells[p->spell].speed;
+    }
+    return speed;
+}
+
+// Fastest action first. Ties go to the smallest draw of the turn, then to the smallest id,
+// so the order only depends on the state and the rng whatever the sort
+bool acts_before(player_info *a, uint64_t a_draw, player_info *b, uint64_t b_draw) {
+    int a_speed = action_speed(a), b_speed = action_speed(b);
+    if (a_speed != b_speed) {
+        return a_speed > b_speed;
+    }
+    if (a_draw != b_draw) {
+        return a_draw < b_draw;
+    }
+    return a->id < b->id;
+}
+
+turn_outcome sim_step(sim_state *s, const sim_action actions[MAX_PLAYER_COUNT], rng *r, uint8_t *winner_id) {
+    bool was_alive[MAX_PLAYER_COUNT] = {0};
+    uint64_t draws[MAX_PLAYER_COUNT] = {0};
+    int order[MAX_PLAYER_COUNT];
+    int count = 0;
+    s->event_count = 0;
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        player_info *p = &s->players[i];
+        if (p->connected == false) {
+            continue;
+        }
+        p->action = actions[i].action;
+        p->ax = actions[i].x;
+        p->ay = actions[i].y;
+        p->spell = actions[i].spell;
+        was_alive[i] = p->stats[STAT_HEALTH].value > 0;
+        // One draw per player and turn
+        draws[i] = rng_next(r);
+
+        int j = count++;
+        while (j > 0 && acts_before(p, draws[i], &s->players[order[j - 1]], draws[order[j - 1]])) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    for (int i = 0; i < count; i++) {
+        sim_play_action(s, &s->players[order[i]]);
+    }
+
+    // Effect tick
+    for (int k = 0; k < MAX_PLAYER_COUNT; k++) {
+        player_info *player = &s->players[k];
+        if (player->connected == false) {
+            continue;
+        }
         for (int i = 0; i < SE_COUNT; i++) {
-            p->effect[i] = false;
-            p->effect_round_left[i] = 0;
-            p->spell_effect[i] = NULL;
-        }
-    } else if (s->effect == SE_FOCUS) {
-        p->turn_effect = SE_FOCUS;
-        p->turn_effect_duration_left = 1;
-    } else if (s->effect == SE_BLOCK) {
-        p->turn_effect = SE_BLOCK;
-        p->turn_effect_duration_left = 0;
-    } else if (s->effect == SE_BANISH) {
-        LOG("Banning %s from %s", all_spells[p->last_spell].name, p->name);
-        if (p->last_spell != NO_SPELL) {
-            p->banned[p->last_spell] = true;
+            int damage = sim_effect_tick(player, i);
+            if (damage >= 0) {
+                sim_event(s, TE_DAMAGE, player->id, player->id, player->x, player->y, damage);
+            }
+
+            if (player->effect_round_left[i] > 0) {
+                player->effect_round_left[i]--;
+                if (player->effect_round_left[i] == 0) {
+                    // Slow effect is not permanant
+                    if (i == SE_SLOW) {
+                        player->stats[STAT_SPEED].value = player->stats[STAT_SPEED].max;
+                    }
+                    player->effect[i] = false;
+                }
+            }
+        }
+
+        if (player->turn_effect_duration_left == 0) {
+            player->turn_effect = SE_NONE;
         } else {
-            LOG("No spells to ban for %s", p->name);
+            player->turn_effect_duration_left--;
         }
-    } else {
-        LOG("Applying effect %d to %s", s->effect, p->name);
-        p->effect[s->effect] = true;
-        p->effect_round_left[s->effect] = s->effect_duration;
-        p->spell_effect[s->effect] = s;
     }
+
+    int alive_count = 0;
+    *winner_id = GAME_TIE;
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        player_info *p = &s->players[i];
+        if (p->connected == false) {
+            continue;
+        }
+        if (p->stats[STAT_HEALTH].value > 0) {
+            alive_count++;
+            *winner_id = i;
+        } else if (was_alive[i]) {
+            sim_event(s, TE_DEATH, i, 0, p->x, p->y, 0);
+        }
+    }
+    if (alive_count >= 2) {
+        *winner_id = GAME_TIE;
+        return TO_CONTINUE;
+    }
+    return TO_ROUND_END;
+}
+
+uint8_t spell_index(const spell *s) {
+    return s == NULL ? NO_SPELL : s - all_spells;
+}
+
+const spell *spell_from_index(uint8_t index) {
+    return index < spell_count ? &all_spells[index] : NULL;
+}
+
+uint64_t hash_bytes(uint64_t h, const uint8_t *data, int size) {
+    for (int i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+uint64_t sim_hash(const sim_state *s, const rng *r) {
+    uint8_t buf[8 + (9 + STAT_COUNT * 3 + SE_COUNT * 3 + MAX_SPELL_COUNT * 2) * MAX_PLAYER_COUNT];
+    int size = 0;
+    for (int i = 0; i < 8; i++) {
+        buf[size++] = r->state >> (i * 8);
+    }
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        const player_info *p = &s->players[i];
+        if (p->connected == false) {
+            continue;
+        }
+        buf[size++] = p->id;
+        buf[size++] = p->x;
+        buf[size++] = p->y;
+        for (int j = 0; j < STAT_COUNT; j++) {
+            buf[size++] = p->stats[j].base;
+            buf[size++] = p->stats[j].max;
+            buf[size++] = p->stats[j].value;
+        }
+        for (int j = 0; j < SE_COUNT; j++) {
+            buf[size++] = p->effect[j];
+            buf[size++] = p->effect_round_left[j];
+            buf[size++] = spell_index(p->spell_effect[j]);
+        }
+        for (int j = 0; j < MAX_SPELL_COUNT; j++) {
+            buf[size++] = p->spells[j];
+            buf[size++] = p->banned[j];
+        }
+        buf[size++] = p->last_spell;
+        buf[size++] = p->turn_effect;
+        buf[size++] = p->turn_effect_duration_left;
+    }
+    return hash_bytes(0xcbf29ce484222325ull, buf, size);
 }
 
 void init_queue(queue *q, size_t elem_size) {
@@ -494,24 +1056,32 @@ void reset_queue(queue *q) {
 
 typedef enum { MLS_NONE, MLS_HEADER, MLS_SPAWN, MLS_MAP, MLS_PROPS } map_loading_stage;
 
-map_loading_stage loading_stage = MLS_NONE;
-int spawn_point_index = 0;
+// Where the text parser is in a map, every load has its own so maps load concurrently
+typedef struct {
+    map_loading_stage stage;
+    int spawn_count;
+} map_parser;
 
 char *strip(char *line) {
     while (isspace(*line)) {
         line++;
     }
-    char *end = line + strlen(line) - 1;
-    while (isspace(*end) && end > line) {
-        *end = '\0';
+    char *end = line + strlen(line);
+    while (end > line && isspace(end[-1])) {
         end--;
     }
+    *end = '\0';
     return line;
 }
 
 map_header parse_header_line(char *line) {
-    char *key = strip(strtok(line, ":"));
-    char *value = strip(strtok(NULL, "\0"));
+    char *separator = strchr(line, ':');
+    if (separator == NULL) {
+        return (map_header){MAP_HEADER_UNKNOWN, NULL};
+    }
+    *separator = '\0';
+    char *key = strip(line);
+    char *value = strip(separator + 1);
 
     if (strcmp(key, "name") == 0) {
         return (map_header){MAP_HEADER_NAME, strdup(value)};
@@ -520,68 +1090,227 @@ map_header parse_header_line(char *line) {
     }
 }
 
-// TODO: Add some checks on ssccanf inside @SPAWN, @MAP and @PROPS to ensure validity
-bool handle_map_line(char *line, map_data *map) {
+// A layer is a single line of count bytes separated by spaces
+bool parse_layer_line(const char *line, uint8_t *cells, int count) {
+    int idx = 0;
+    while (true) {
+        while (*line == ' ') {
+            line++;
+        }
+        if (*line == '\0') {
+            break;
+        }
+        char *end = NULL;
+        unsigned long value = strtoul(line, &end, 10);
+        if (end == line || value > UINT8_MAX || idx == count) {
+            return false;
+        }
+        cells[idx++] = value;
+        line = end;
+    }
+    return idx == count;
+}
+
+bool handle_map_line(char *line, map_data *map, map_parser *parser) {
     if (strcmp(line, "@HEADER") == 0) {
-        loading_stage = MLS_HEADER;
+        parser->stage = MLS_HEADER;
     } else if (strcmp(line, "@SPAWN") == 0) {
-        loading_stage = MLS_SPAWN;
-    } else if (strcmp(line, "@SPAWN") == 0) {
-        loading_stage = MLS_SPAWN;
+        parser->stage = MLS_SPAWN;
     } else if (strcmp(line, "@MAP") == 0) {
-        loading_stage = MLS_MAP;
+        parser->stage = MLS_MAP;
     } else if (strcmp(line, "@PROPS") == 0) {
-        loading_stage = MLS_PROPS;
+        parser->stage = MLS_PROPS;
     } else if (strcmp(line, "@END") == 0) {
-        loading_stage = MLS_NONE;
+        parser->stage = MLS_NONE;
+    } else if (parser->stage == MLS_HEADER) {
+        map_header header = parse_header_line(line);
+        if (header.key != MAP_HEADER_UNKNOWN) {
+            free((void *)map->headers[header.key].value);
+            map->headers[header.key].value = header.value;
+        }
+    } else if (parser->stage == MLS_SPAWN) {
+        unsigned int x = 0, y = 0;
+        if (parser->spawn_count == MAX_PLAYER_COUNT || sscanf(line, "%u %u", &x, &y) != 2 || x >= MAP_WIDTH ||
+            y >= MAP_HEIGHT) {
+            return false;
+        }
+        map->spawn_positions[parser->spawn_count][0] = x;
+        map->spawn_positions[parser->spawn_count][1] = y;
+        parser->spawn_count++;
+    } else if (parser->stage == MLS_MAP) {
+        return parse_layer_line(line, map->map, MAP_CELL_COUNT);
+    } else if (parser->stage == MLS_PROPS) {
+        return parse_layer_line(line, map->props, MAP_CELL_COUNT);
     } else {
-        if (loading_stage == MLS_HEADER) {
-            map_header header = parse_header_line(line);
-            if (header.key != MAP_HEADER_UNKNOWN) {
-                map->headers[header.key].value = header.value;
-            }
-        } else if (loading_stage == MLS_SPAWN) {
-            assert(spawn_point_index < MAX_PLAYER_COUNT);
-            sscanf(line, "%hhu %hhu", &map->spawn_positions[spawn_point_index][0],
-                   &map->spawn_positions[spawn_point_index][1]);
-            spawn_point_index++;
-        } else if (loading_stage == MLS_MAP) {
-            int idx = 0;
-            while (*line != '\0') {
-                if (*line != ' ') {
-                    sscanf(line, "%hhu", &map->map[idx++]);
-                }
-                line++;
+        return false;
+    }
+    return true;
+}
+
+// Maps are named by their file in maps/ without its extension
+void map_file_path(char fullpath[256], const char *filepath, const char *extension) {
+    snprintf(fullpath, 256, "maps/%.*s%s", (int)(256 - strlen("maps/") - strlen(extension) - 1), filepath,
+             extension);
+}
+
+// Walking distance from a cell to every other one, -1 when out of reach. Same as the client's spell range.
+void walk_distances(const uint8_t *map, int x, int y, int8_t distances[MAP_CELL_COUNT]) {
+    memset(distances, -1, MAP_CELL_COUNT);
+    uint8_t queue[MAP_CELL_COUNT];
+    int head = 0, tail = 0;
+    distances[y * MAP_WIDTH + x] = 0;
+    queue[tail++] = y * MAP_WIDTH + x;
+    while (head < tail) {
+        int cell = queue[head++];
+        int cx = cell % MAP_WIDTH, cy = cell / MAP_WIDTH;
+        const int dx[] = {-1, 1, 0, 0}, dy[] = {0, 0, -1, 1};
+        for (int i = 0; i < 4; i++) {
+            int nx = cx + dx[i], ny = cy + dy[i];
+            int next = ny * MAP_WIDTH + nx;
+            if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT || distances[next] != -1 ||
+                (map != NULL && map[next] != 0)) {
+                continue;
             }
-            assert(idx == MAP_WIDTH * MAP_HEIGHT);
-        } else if (loading_stage == MLS_PROPS) {
-            int idx = 0;
-            while (*line != '\0') {
-                if (*line != ' ') {
-                    sscanf(line, "%hhu", &map->props[idx++]);
-                }
-                line++;
+            distances[next] = distances[cell] + 1;
+            queue[tail++] = next;
+        }
+    }
+}
+
+void compile_map(const map_data *map, mapb *out) {
+    memset(out, 0, sizeof(mapb));
+    out->magic = MAPB_MAGIC;
+    out->version = MAPB_VERSION;
+    out->hash = map_layers_hash(MAP_WIDTH, MAP_HEIGHT, map->map, map->props);
+    out->width = MAP_WIDTH;
+    out->height = MAP_HEIGHT;
+    const char *name = map->headers[MAP_HEADER_NAME].value;
+    if (name != NULL) {
+        memcpy(out->name, name, strnlen(name, sizeof(out->name)));
+    }
+    memcpy(out->spawn_positions, map->spawn_positions, sizeof(out->spawn_positions));
+    memcpy(out->map, map->map, sizeof(out->map));
+    memcpy(out->props, map->props, sizeof(out->props));
+    for (int cell = 0; cell < MAP_CELL_COUNT; cell++) {
+        walk_distances(map->map, cell % MAP_WIDTH, cell / MAP_WIDTH, out->distances[cell]);
+    }
+}
+
+// Returns NULL when the compiled map can be used, else what is wrong with it
+const char *check_mapb(const mapb *b) {
+    if (b->magic != MAPB_MAGIC) {
+        return "not a compiled map";
+    } else if (b->version != MAPB_VERSION) {
+        return "compiled by another version of mapc";
+    } else if (b->width != MAP_WIDTH || b->height != MAP_HEIGHT) {
+        return "unsupported map size";
+    }
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        if (b->spawn_positions[i][0] >= MAP_WIDTH || b->spawn_positions[i][1] >= MAP_HEIGHT) {
+            return "spawn point outside of the map";
+        }
+    }
+    if (map_layers_hash(b->width, b->height, b->map, b->props) != b->hash) {
+        return "layers do not match their hash";
+    }
+    return NULL;
+}
+
+void map_from_mapb(const mapb *b, map_data *map) {
+    memset(map, 0, sizeof(map_data));
+    map->headers[MAP_HEADER_NAME].value = strndup(b->name, sizeof(b->name));
+    memcpy(map->spawn_positions, b->spawn_positions, sizeof(map->spawn_positions));
+    memcpy(map->map, b->map, sizeof(map->map));
+    memcpy(map->props, b->props, sizeof(map->props));
+}
+
+#ifndef WINDOWS_BUILD
+const mapb *open_mapb(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    const mapb *b = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(mapb)) {
+        void *mapped = mmap(NULL, sizeof(mapb), PROT_READ, MAP_SHARED, fd, 0);
+        b = mapped == MAP_FAILED ? NULL : mapped;
+    }
+    close(fd);
+    const char *error = b != NULL ? check_mapb(b) : "unexpected file size";
+    if (error != NULL) {
+        LOGL(LL_WARNING, "Ignoring compiled map %s: %s", path, error);
+        close_mapb(b);
+        return NULL;
+    }
+    return b;
+}
+
+void close_mapb(const mapb *b) {
+    if (b != NULL) {
+        munmap((void *)b, sizeof(mapb));
+    }
+}
+
+// The compiled map stands for the text one unless the text was edited since
+const mapb *open_compiled_map(const char *filepath) {
+    char text_path[256], compiled_path[256];
+    map_file_path(text_path, filepath, ".map");
+    map_file_path(compiled_path, filepath, ".mapb");
+    struct stat text, compiled;
+    if (stat(compiled_path, &compiled) != 0 ||
+        (stat(text_path, &text) == 0 && text.st_mtime > compiled.st_mtime)) {
+        return NULL;
+    }
+    return open_mapb(compiled_path);
+}
+#endif
+
+// Only reads the @HEADER section, returns the name of the map or NULL when it has none
+char *load_map_name(const char *filepath) {
+#ifndef WINDOWS_BUILD
+    const mapb *b = open_compiled_map(filepath);
+    if (b != NULL) {
+        char *name = strndup(b->name, sizeof(b->name));
+        close_mapb(b);
+        return name;
+    }
+#endif
+    char fullpath[256] = {0};
+    map_file_path(fullpath, filepath, ".map");
+    FILE *f = fopen(fullpath, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    char buf[256];
+    char *name = NULL;
+    bool in_header = false;
+    while (name == NULL && fgets(buf, sizeof(buf), f) != NULL) {
+        char *line = strip(buf);
+        if (strcmp(line, "@HEADER") == 0) {
+            in_header = true;
+        } else if (in_header && strcmp(line, "@END") == 0) {
+            break;
+        } else if (in_header) {
+            map_header header = parse_header_line(line);
+            if (header.key == MAP_HEADER_NAME) {
+                name = (char *)header.value;
             }
-            assert(idx == MAP_WIDTH * MAP_HEIGHT);
-        } else {
-            return false;
         }
     }
-    return true;
+    fclose(f);
+    return name;
 }
 
-bool load_map(const char *filepath, map_data *map) {
+bool load_map_text(const char *filepath, map_data *map) {
     char fullpath[256] = {0};
-    strcat(fullpath, "maps/");
-    strncat(fullpath, filepath, 256 - strlen("maps/") - strlen(".map"));
-    strcat(fullpath, ".map");
+    map_file_path(fullpath, filepath, ".map");
     LOG("Loading map '%s'", fullpath);
     FILE *f = fopen(fullpath, "r");
     if (f == NULL) {
         return false;
     }
 
-    spawn_point_index = 0;
     for (int i = 0; i < MAP_HEIGHT * MAP_WIDTH; i++) {
         map->map[i] = 0;
         map->props[i] = 0;
@@ -597,8 +1326,10 @@ bool load_map(const char *filepath, map_data *map) {
         return false;
     }
     fread(string, file_size, 1, f);
+    string[file_size] = '\0';
     fclose(f);
 
+    map_parser parser = {0};
     char *line = string;
     do {
         char *next = strchrnul(line, '\n');
@@ -606,7 +1337,8 @@ bool load_map(const char *filepath, map_data *map) {
             break;
         }
         *next = '\0';
-        if (handle_map_line(line, map) == false) {
+        if (handle_map_line(line, map, &parser) == false) {
+            LOGL(LL_ERROR, "Invalid line in map '%s': %s", fullpath, line);
             free(string);
             return false;
         }
@@ -621,54 +1353,50 @@ bool load_map(const char *filepath, map_data *map) {
     return true;
 }
 
-void write_string(FILE *f, const char *str) {
-    size_t len = strlen(str);
-    fwrite(str, len, 1, f);
+// A compiled map stays mapped in map->compiled, its tables are read from there
+bool load_map(const char *filepath, map_data *map) {
+#ifndef WINDOWS_BUILD
+    const mapb *b = open_compiled_map(filepath);
+    if (b != NULL) {
+        map_from_mapb(b, map);
+        map->compiled = b;
+        return true;
+    }
+#endif
+    return load_map_text(filepath, map);
 }
 
 bool save_map(const char *filepath, map_data *map) {
     char fullpath[256] = {0};
-    strcat(fullpath, "maps/");
-    strncat(fullpath, filepath, 256 - strlen("maps/") - strlen(".map"));
-    strcat(fullpath, ".map");
+    map_file_path(fullpath, filepath, ".map");
     LOG("Saving map at %s", fullpath);
     FILE *f = fopen(fullpath, "w");
     if (f == NULL) {
         return false;
     }
 
-    write_string(f, "@HEADER\n");
-    write_string(f, "name: ");
-    write_string(f, map->headers[MAP_HEADER_NAME].value);
-    write_string(f, "\n");
-    write_string(f, "@END\n");
-
-    write_string(f, "@SPAWN\n");
+    // At most 4 characters per cell, the whole file is written at once
+    char buf[256 + MAX_PLAYER_COUNT * 8 + 2 * (MAP_CELL_COUNT * 4 + 16)];
+    int len = snprintf(buf, sizeof(buf), "@HEADER\nname: %.128s\n@END\n@SPAWN\n", map->headers[MAP_HEADER_NAME].value);
     for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-        write_string(f, inttostr(map->spawn_positions[i][0]));
-        write_string(f, " ");
-        write_string(f, inttostr(map->spawn_positions[i][1]));
-        write_string(f, "\n");
+        len += snprintf(buf + len, sizeof(buf) - len, "%d %d\n", map->spawn_positions[i][0],
+                        map->spawn_positions[i][1]);
     }
-    write_string(f, "@END\n");
-
-    write_string(f, "@MAP\n");
-    for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT; i++) {
-        write_string(f, inttostr(map->map[i]));
-        write_string(f, " ");
+    const uint8_t *layers[] = {map->map, map->props};
+    const char *sections[] = {"@MAP", "@PROPS"};
+    for (int l = 0; l < 2; l++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "@END\n%s\n", sections[l]);
+        for (int i = 0; i < MAP_CELL_COUNT; i++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%d ", layers[l][i]);
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "\n");
     }
-    write_string(f, "\n");
-    write_string(f, "@END\n");
+    len += snprintf(buf + len, sizeof(buf) - len, "@END\n");
 
-    write_string(f, "@PROPS\n");
-    for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT; i++) {
-        write_string(f, inttostr(map->props[i]));
-        write_string(f, " ");
+    bool written = fwrite(buf, 1, len, f) == (size_t)len;
+    if (fclose(f) != 0 || written == false) {
+        return false;
     }
-    write_string(f, "\n");
-    write_string(f, "@END\n");
-
-    fclose(f);
     LOG("Map saved!");
     return true;
 }
@@ -677,6 +1405,18 @@ void free_map_data(map_data *map) {
     for (int i = 0; i < MAP_HEADER_COUNT; i++) {
         free((void *)map->headers[i].value);
     }
+#ifndef WINDOWS_BUILD
+    close_mapb(map->compiled);
+#endif
+    map->compiled = NULL;
+}
+
+// Names a map by what clients get of it, the same layers always give the same hash
+uint64_t map_layers_hash(uint8_t width, uint8_t height, const uint8_t *map, const uint8_t *props) {
+    uint8_t size[2] = {width, height};
+    uint64_t h = hash_bytes(0xcbf29ce484222325ull, size, sizeof(size));
+    h = hash_bytes(h, map, width * height);
+    return hash_bytes(h, props, width * height);
 }
 
 bool create_map(const char *filename) {
@@ -690,3 +1430,256 @@ bool create_map(const char *filename) {
     }
     return result;
 }
+
+// Spell programs
+// What a spell does to the players it lands on is a small program compiled from a .spells file.
+// The compiled blob is the spell count, the u16 offset of each program, then the code.
+// Servers send it to clients as is (PKT_SPELL_PROGRAMS), so every check happens in set_spell_programs.
+
+typedef enum {
+    OP_END,
+    OP_DAMAGE,  // Spell damage from the caster, with strength and focus
+    OP_EFFECT,  // Spell effect
+    OP_STAT,    // Spell stat change
+    OP_SELF,    // The next ops hit the caster
+    OP_KILL,
+    OP_PUSH,    // cells: moves the target away from the caster, stunned if something is in the way
+    OP_AROUND,  // size: runs the next size bytes, up to OP_NEXT, on each player in range
+    OP_NEXT,
+    OP_COUNT,
+} spell_op;
+
+const char *spell_op_names[OP_COUNT] = {"end", "damage", "effect", "stat", "self", "kill", "push", "around", "next"};
+const uint8_t spell_op_operands[OP_COUNT] = {[OP_PUSH] = 1, [OP_AROUND] = 1};
+
+// Every spell has an entry, so sim_spell_hit never checks the blob
+const uint8_t no_program[] = {OP_END};
+const uint8_t *spell_entries[256] = {0};
+uint8_t spell_programs[SPELL_PROGRAMS_MAX_SIZE] = {0};
+int spell_programs_size = 0;
+uint32_t spell_programs_hash = 0;
+
+bool check_spell_program(const uint8_t *blob, int size, int pc) {
+    int around_end = -1;
+    while (pc < size) {
+        uint8_t op = blob[pc++];
+        if (op >= OP_COUNT || pc + spell_op_operands[op] > size) {
+            return false;
+        }
+        if (op == OP_END) {
+            return around_end == -1;
+        } else if (op == OP_AROUND) {
+            if (around_end != -1) {
+                return false;  // No nesting
+            }
+            around_end = pc + 1 + blob[pc];
+        } else if (op == OP_NEXT) {
+            if (pc != around_end) {
+                return false;
+            }
+            around_end = -1;
+        }
+        pc += spell_op_operands[op];
+    }
+    return false;
+}
+
+bool set_spell_programs(const uint8_t *blob, int size) {
+    if (size < 1 || size > SPELL_PROGRAMS_MAX_SIZE || blob[0] > spell_count || size < 1 + blob[0] * 2) {
+        return false;
+    }
+    for (int i = 0; i < blob[0]; i++) {
+        int offset = blob[1 + i * 2] | blob[2 + i * 2] << 8;
+        if (offset < 1 + blob[0] * 2 || check_spell_program(blob, size, offset) == false) {
+            LOGL(LL_ERROR, "Invalid program for spell %s", all_spells[i].name);
+            return false;
+        }
+    }
+    memcpy(spell_programs, blob, size);
+    for (int i = 0; i < spell_count; i++) {
+        spell_entries[i] = i < blob[0] ? spell_programs + (blob[1 + i * 2] | blob[2 + i * 2] << 8) : no_program;
+    }
+    spell_programs_size = size;
+    spell_programs_hash = hash_bytes(0xcbf29ce484222325ull, blob, size);
+    return true;
+}
+
+const uint8_t *get_spell_programs(int *size, uint32_t *hash) {
+    *size = spell_programs_size;
+    *hash = spell_programs_hash;
+    return spell_programs;
+}
+
+// One line per spell, "<spell name>: <op> <op> ...", lines starting with # are comments
+bool compile_spell_programs(char *text) {
+    uint8_t blob[SPELL_PROGRAMS_MAX_SIZE] = {0};
+    int size = 1 + spell_count * 2;
+    blob[0] = spell_count;
+    // Spells without a program point to an empty one
+    int empty = size;
+    blob[size++] = OP_END;
+    for (int i = 0; i < spell_count; i++) {
+        blob[1 + i * 2] = empty & 0xff;
+        blob[2 + i * 2] = empty >> 8;
+    }
+
+    int line_number = 0;
+    char *lines = NULL;
+    for (char *line = strtok_r(text, "\n", &lines); line != NULL; line = strtok_r(NULL, "\n", &lines)) {
+        line_number++;
+        line = strip(line);
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+        char *ops = strchr(line, ':');
+        if (ops == NULL) {
+            LOGL(LL_ERROR, "Line %d: expected '<spell>: <ops>'", line_number);
+            return false;
+        }
+        *ops++ = '\0';
+        line = strip(line);
+        int index = 0;
+        while (index < spell_count && strcmp(all_spells[index].name, line) != 0) {
+            index++;
+        }
+        if (index == spell_count) {
+            LOGL(LL_ERROR, "Line %d: unknown spell '%s'", line_number, line);
+            return false;
+        }
+        blob[1 + index * 2] = size & 0xff;
+        blob[2 + index * 2] = size >> 8;
+
+        int around = -1;
+        char *save = NULL;
+        for (char *word = strtok_r(ops, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+            int op = 0;
+            while (op < OP_COUNT && strcmp(spell_op_names[op], word) != 0) {
+                op++;
+            }
+            if (op == OP_COUNT || op == OP_END || size + 2 + spell_op_operands[op] > SPELL_PROGRAMS_MAX_SIZE) {
+                LOGL(LL_ERROR, "Line %d: unknown op '%s' or program too long", line_number, word);
+                return false;
+            }
+            blob[size++] = op;
+            if (op == OP_PUSH) {
+                int cells = 0;
+                char *value = strtok_r(NULL, " \t", &save);
+                if (value == NULL || !strtoint(value, &cells) || cells < 0 || cells > 255) {
+                    LOGL(LL_ERROR, "Line %d: push expects a cell count", line_number);
+                    return false;
+                }
+                blob[size++] = cells;
+            } else if (op == OP_AROUND) {
+                around = size++;
+            } else if (op == OP_NEXT && around != -1) {
+                blob[around] = size - around - 1;
+                around = -1;
+            }
+        }
+        blob[size++] = OP_END;
+    }
+    return set_spell_programs(blob, size);
+}
+
+bool load_spell_programs(const char *filepath) {
+    FILE *f = fopen(filepath, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char text[SPELL_PROGRAMS_MAX_SIZE * 8] = {0};
+    size_t read = fread(text, 1, sizeof(text) - 1, f);
+    bool too_long = !feof(f);
+    fclose(f);
+    if (too_long) {
+        LOGL(LL_ERROR, "%s is too long", filepath);
+        return false;
+    }
+    text[read] = '\0';
+    if (compile_spell_programs(text) == false) {
+        return false;
+    }
+    LOG("Loaded spell programs from %s (%d bytes, hash %08x)", filepath, spell_programs_size, spell_programs_hash);
+    return true;
+}
+
+// Token threaded, each op jumps straight to the next one.
+// Flattened as gcc will not inline the helpers into a function this big on its own.
+__attribute__((flatten)) void sim_spell_hit(sim_state *state, player_info *from, player_info *to, const spell *s) {
+    static const void *dispatch[OP_COUNT] = {&&op_end,  &&op_damage, &&op_effect, &&op_stat,  &&op_self,
+                                             &&op_kill, &&op_push,   &&op_around, &&op_next};
+    const uint8_t *pc = spell_entries[s - all_spells];
+    if (pc == NULL) {
+        return;  // Not loaded yet
+    }
+    const uint8_t *around_start = NULL, *around_end = NULL;
+    int around_index = 0;
+    player_info *target = to;
+
+#define NEXT_OP() goto *dispatch[*pc++]
+    NEXT_OP();
+
+op_damage: {
+    int damage = get_spell_damage(from, s);
+    // Integer clamp, the float one of the native rules costs two libm calls per hit
+    int health = target->stats[STAT_HEALTH].value - damage;
+    int max = target->stats[STAT_HEALTH].max;
+    target->stats[STAT_HEALTH].value = health < 0 ? 0 : health > max ? max : health;
+    sim_event(state, TE_DAMAGE, target->id, from->id, target->x, target->y, damage);
+    NEXT_OP();
+}
+op_effect:
+    sim_effect_player(state, target, s);
+    NEXT_OP();
+op_stat:
+    sim_update_stats(target, s);
+    NEXT_OP();
+op_self:
+    target = from;
+    NEXT_OP();
+op_kill:
+    sim_event(state, TE_DAMAGE, target->id, from->id, target->x, target->y, target->stats[STAT_HEALTH].value);
+    target->stats[STAT_HEALTH].value = 0;
+    NEXT_OP();
+op_push: {
+    int cells = *pc++;
+    int dx = (target->x > from->x) - (target->x < from->x);
+    int dy = (target->y > from->y) - (target->y < from->y);
+    for (int i = 0; i < cells && state != NULL && (dx != 0 || dy != 0); i++) {
+        int x = target->x + dx, y = target->y + dy;
+        if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT || sim_player_on_cell(state, x, y) != NULL ||
+            (state->map != NULL && state->map[y * MAP_WIDTH + x] != 0)) {
+            // Same stun as hitting a block
+            sim_block_stun(target);
+            break;
+        }
+        target->x = x;
+        target->y = y;
+    }
+    NEXT_OP();
+}
+op_around:
+    around_start = pc + 1;
+    around_end = pc + 1 + *pc;
+    around_index = 0;
+    // fallthrough
+op_next:
+    target = NULL;
+    while (state != NULL && around_index < MAX_PLAYER_COUNT) {
+        player_info *p = &state->players[around_index++];
+        if (p->connected && p != from && abs(p->x - from->x) + abs(p->y - from->y) <= s->range &&
+            sim_defend(state, from, p) == false) {
+            target = p;
+            break;
+        }
+    }
+    if (target == NULL) {
+        target = from;
+        pc = around_end;
+    } else {
+        pc = around_start;
+    }
+    NEXT_OP();
+#undef NEXT_OP
+op_end:
+    return;
+}
@@ -0,0 +1,721 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "ai.h"
+#include "common.h"
+#include "net.h"
+#include "net_protocol.h"
+#include "version.h"
+
+// Headless bots playing against a server, reports latencies and throughput.
+// Usage: loadgen [--host 127.0.0.1] [--port 3000] [--bots 100] [--room-size 2]
+//                [--think 100] [--duration 30] [--pass password] [--ai-ms 0] [--matchmake 1] [--spectators 0]
+// With --ai-ms, bots search their actions with the AI for that long instead of playing at random.
+// With --matchmake, bots leave the lobby they are put in to queue for a match, and queue again after each game.
+// With --spectators, that many more connections watch the rooms of the bots and predict their turns too.
+
+extern const spell all_spells[];
+extern const int spell_count;
+
+#define MAX_EPOLL_EVENTS 256
+#define PING_INTERVAL_MS 1000
+
+typedef enum {
+    BOT_CONNECTING,
+    BOT_WAITING,  // A spectator waiting for its bot to be in a game
+    BOT_JOINING,
+    BOT_LOBBY,
+    BOT_QUEUED,
+    BOT_PLAYING,
+    BOT_ROUND_ENDED,
+    BOT_WATCHING,
+    BOT_CLOSED,
+} bot_state;
+
+// Requests whose answer we time, named after the packet that answers them
+typedef enum {
+    RQ_JOIN,         // PKT_JOIN -> PKT_CONNECTED
+    RQ_BUILD,        // PKT_PLAYER_BUILD -> our PKT_PLAYER_BUILD broadcast
+    RQ_GAME_START,   // PKT_REQUEST_GAME_START -> PKT_GAME_START
+    RQ_TURN_RESULT,  // PKT_PLAYER_ACTION -> PKT_TURN_RESULT, includes the other players' think time
+    RQ_ROUND_START,  // PKT_PLAYER_READY -> PKT_ROUND_START
+    RQ_PING,         // PKT_PING -> PKT_PING
+    RQ_MATCH,        // PKT_MATCHMAKE -> PKT_CONNECTED of the matched room
+    RQ_SPECTATE,     // PKT_SPECTATE -> PKT_SPECTATE_START
+    RQ_COUNT,
+} request_type;
+
+const char *request_names[RQ_COUNT] = {"join",        "build", "game_start", "turn_result",
+                                       "round_start", "ping",  "match",      "spectate"};
+
+typedef struct {
+    int fd;
+    bot_state state;
+    recv_buffer *in;
+    send_queue *out;
+
+    int id;  // -1 for spectators
+    int master;
+    bool spectator;
+    uint32_t room_id;
+    uint8_t spells[MAX_SPELL_COUNT];
+    bool has_build[MAX_PLAYER_COUNT];
+    uint8_t player_states[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE];
+    // Turns are predicted like the game client does
+    sim_state game;
+    rng rng;
+    uint8_t map[MAP_WIDTH * MAP_HEIGHT];  // Background layer, for the AI
+    uint64_t map_fetched;  // Hash of the map whose layers were requested, 0 when none
+
+    uint64_t next_action_ms;  // 0 when no action is waiting
+    uint64_t next_ping_ms;
+    uint64_t pending[RQ_COUNT];  // Send time in microseconds, 0 when not waiting
+} bot;
+
+typedef struct {
+    uint32_t *samples;  // Microseconds
+    int count;
+    int capacity;
+} latency_samples;
+
+bot *bots = NULL;
+int bot_count = 100;
+int spectator_count = 0;  // Their bots come after the players
+int room_size = 2;
+int think_ms = 100;
+const char *password = "";
+ai *bot_ai = NULL;  // Shared by every bot, they all run on the main thread
+bool matchmake = false;
+latency_samples latencies[RQ_COUNT] = {0};
+
+int turns = 0;
+int connection_failures = 0;
+int closed_connections = 0;
+int server_errors = 0;
+int mispredictions = 0;
+int watched_turns = 0;
+int spectator_mispredictions = 0;
+
+// Bots share their map cache, as if they all had played these maps before
+#define MAP_CACHE_SIZE 16
+typedef struct {
+    uint64_t hash;
+    uint8_t map[MAP_WIDTH * MAP_HEIGHT];
+} cached_map;
+
+cached_map map_cache[MAP_CACHE_SIZE];
+int map_cache_count = 0;
+int map_hits = 0;
+int map_fetches = 0;
+
+cached_map *find_cached_map(uint64_t hash) {
+    for (int i = 0; i < map_cache_count; i++) {
+        if (map_cache[i].hash == hash) {
+            return &map_cache[i];
+        }
+    }
+    return NULL;
+}
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t now_ms() {
+    return now_us() / 1000;
+}
+
+void start_request(bot *b, request_type type) {
+    b->pending[type] = now_us();
+}
+
+void end_request(bot *b, request_type type) {
+    if (b->pending[type] == 0) {
+        return;
+    }
+    latency_samples *l = &latencies[type];
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity == 0 ? 1024 : l->capacity * 2;
+        l->samples = realloc(l->samples, l->capacity * sizeof(uint32_t));
+    }
+    l->samples[l->count++] = now_us() - b->pending[type];
+    b->pending[type] = 0;
+}
+
+void bot_send(bot *b, net_packet p) {
+    net_frame *f = frame_encode(&p);
+    if (f == NULL) {
+        return;
+    }
+    if (send_queue_push(b->out, f) == false) {
+        LOGL(LL_WARNING, "Bot %d send queue is full", b->fd);
+    }
+    frame_release(f);
+}
+
+void close_bot(bot *b, bool failure) {
+    if (b->state == BOT_CLOSED) {
+        return;
+    }
+    if (failure) {
+        connection_failures++;
+    } else {
+        closed_connections++;
+    }
+    b->state = BOT_CLOSED;
+    close(b->fd);
+    free(b->in);
+    send_queue_clear(b->out);
+    free(b->out);
+    b->in = NULL;
+    b->out = NULL;
+}
+
+// Bots
+
+void queue_for_match(bot *b) {
+    b->state = BOT_QUEUED;
+    b->next_action_ms = 0;
+    b->pending[RQ_TURN_RESULT] = 0;
+    start_request(b, RQ_MATCH);
+    bot_send(b, pkt_matchmake(1));
+}
+
+void send_build(bot *b) {
+    // Ten different spells picked at random
+    int picked = 0;
+    while (picked < MAX_SPELL_COUNT && picked < spell_count) {
+        uint8_t s = rand() % spell_count;
+        bool taken = false;
+        for (int i = 0; i < picked; i++) {
+            taken |= b->spells[i] == s;
+        }
+        if (taken == false) {
+            b->spells[picked++] = s;
+        }
+    }
+    start_request(b, RQ_BUILD);
+    bot_send(b, pkt_player_build(b->id, 100, b->spells, 20, 100));
+}
+
+void try_start_game(bot *b) {
+    if (b->id != b->master || b->state != BOT_LOBBY || b->pending[RQ_GAME_START] != 0) {
+        return;
+    }
+    int ready = 0;
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        ready += b->game.players[i].connected && b->has_build[i];
+    }
+    if (ready >= room_size) {
+        start_request(b, RQ_GAME_START);
+        bot_send(b, pkt_request_game_start(0, 3));
+    }
+}
+
+// A spell of the build that is not banned, aimed at an opponent or at a free cell in range
+void play_action(bot *b) {
+    player_info *me = &b->game.players[b->id];
+    if (bot_ai != NULL) {
+        sim_action a = ai_choose_action(bot_ai, &b->game, &b->rng, b->id, b->map, NULL);
+        ai_start_cooldown(me, a);
+        start_request(b, RQ_TURN_RESULT);
+        bot_send(b, pkt_player_action(b->id, a.action, a.x, a.y, a.spell));
+        return;
+    }
+    for (int attempt = 0; attempt < MAX_SPELL_COUNT * 2; attempt++) {
+        int index = rand() % MAX_SPELL_COUNT;
+        if (me->banned[index]) {
+            continue;
+        }
+        const spell *s = &all_spells[b->spells[index]];
+        if (s->type == ST_TARGET) {
+            for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+                player_info *other = &b->game.players[i];
+                int distance = abs(other->x - me->x) + abs(other->y - me->y);
+                if (i != b->id && other->connected && distance >= s->min_range && distance <= s->range) {
+                    start_request(b, RQ_TURN_RESULT);
+                    bot_send(b, pkt_player_action(b->id, PA_SPELL, other->x, other->y, b->spells[index]));
+                    return;
+                }
+            }
+        } else if (s->type == ST_AROUND) {
+            start_request(b, RQ_TURN_RESULT);
+            bot_send(b, pkt_player_action(b->id, PA_SPELL, me->x, me->y, b->spells[index]));
+            return;
+        } else if (s->type == ST_MOVE) {
+            int dx = rand() % (2 * s->range + 1) - s->range;
+            int dy = rand() % (2 * s->range + 1) - s->range;
+            int x = me->x + dx, y = me->y + dy;
+            int distance = abs(dx) + abs(dy);
+            if (x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT && distance >= s->min_range &&
+                distance <= s->range && sim_player_on_cell(&b->game, x, y) == NULL) {
+                start_request(b, RQ_TURN_RESULT);
+                bot_send(b, pkt_player_action(b->id, PA_SPELL, x, y, b->spells[index]));
+                return;
+            }
+        }
+    }
+    // Nothing usable, skipping the turn is always legal
+    start_request(b, RQ_TURN_RESULT);
+    bot_send(b, pkt_player_action(b->id, PA_STUNNED, me->x, me->y, 0));
+}
+
+void schedule_action(bot *b) {
+    b->next_action_ms = now_ms() + (think_ms > 0 ? think_ms / 2 + rand() % think_ms : 0) + 1;
+}
+
+// Resyncs pass a scratch baseline, their keyframes do not replace the room's one
+bool read_player_states(bot *b, uint8_t *buf, uint8_t *end, int count,
+                        uint8_t baseline[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE]) {
+    for (int i = 0; i < count; i++) {
+        uint8_t id = 0;
+        buf = unpack_player_state(buf, end, baseline, &id);
+        if (buf == NULL) {
+            return false;
+        }
+        net_packet_player_update u = {0};
+        unpackstruct(PKT_PLAYER_UPDATE, baseline[id], (uint8_t *)&u);
+        player_info_from_update(&b->game.players[id], &u);
+    }
+    return true;
+}
+
+void play_turn_result(bot *b, net_packet_turn_result *t) {
+    sim_action actions[MAX_PLAYER_COUNT] = {0};
+    uint8_t *a = t->actions;
+    for (int i = 0; i < t->action_count; i++, a += NET_TURN_ACTION_SIZE) {
+        if (a[0] < MAX_PLAYER_COUNT) {
+            actions[a[0]] = (sim_action){.action = a[1], .x = a[2], .y = a[3], .spell = a[4]};
+        }
+    }
+    uint8_t winner_id = GAME_TIE;
+    b->game.map = b->map;
+    sim_step(&b->game, actions, &b->rng, &winner_id);
+    if (b->spectator) {
+        // Relays do not answer, a spectator out of sync stays so
+        watched_turns++;
+        spectator_mispredictions += (uint32_t)sim_hash(&b->game, &b->rng) != t->state_hash;
+        return;
+    }
+    ai_tick_cooldowns(&b->game.players[b->id]);
+    if ((uint32_t)sim_hash(&b->game, &b->rng) != t->state_hash) {
+        mispredictions++;
+        bot_send(b, pkt_resync_request());
+    }
+}
+
+void handle_packet(bot *b, net_packet *p) {
+    if (p->type == PKT_PING) {
+        end_request(b, RQ_PING);
+    } else if (p->type == PKT_HEARTBEAT) {
+        bot_send(b, pkt_heartbeat());
+    } else if (p->type == PKT_SPECTATE_START) {
+        end_request(b, RQ_SPECTATE);
+        memset(b->has_build, 0, sizeof(b->has_build));
+        memset(b->player_states, 0, sizeof(b->player_states));
+        memset(&b->game, 0, sizeof(b->game));
+        b->state = BOT_WATCHING;
+    } else if (p->type == PKT_CONNECTED) {
+        net_packet_connected *c = (net_packet_connected *)p->content;
+        if (b->spectator) {
+            // The lobby it is put in until its PKT_SPECTATE is handled
+            end_request(b, RQ_JOIN);
+            return;
+        }
+        if (matchmake && b->state == BOT_JOINING) {
+            end_request(b, RQ_JOIN);
+            queue_for_match(b);
+            return;
+        }
+        end_request(b, RQ_JOIN);
+        end_request(b, RQ_MATCH);
+        memset(b->has_build, 0, sizeof(b->has_build));
+        memset(&b->game, 0, sizeof(b->game));
+        b->id = c->id;
+        b->room_id = c->room_id;
+        b->master = c->master;
+        b->state = BOT_LOBBY;
+        send_build(b);
+    } else if (p->type == PKT_PLAYER_JOINED) {
+        net_packet_player_joined *j = (net_packet_player_joined *)p->content;
+        b->game.players[j->id].connected = true;
+        try_start_game(b);
+    } else if (p->type == PKT_DISCONNECT) {
+        net_packet_disconnect *d = (net_packet_disconnect *)p->content;
+        if (b->state == BOT_QUEUED) {
+            // From the room left to queue
+            return;
+        }
+        b->game.players[d->id].connected = false;
+        b->has_build[d->id] = false;
+        b->master = d->new_master;
+        if (b->spectator) {
+            return;
+        }
+        // The server puts the room back in the lobby
+        b->state = BOT_LOBBY;
+        b->next_action_ms = 0;
+        b->pending[RQ_TURN_RESULT] = 0;
+        try_start_game(b);
+    } else if (p->type == PKT_PLAYER_BUILD) {
+        net_packet_player_build *pb = (net_packet_player_build *)p->content;
+        // Players without a build yet are announced with no health
+        b->has_build[pb->id] = pb->health > 0;
+        memcpy(b->game.players[pb->id].spells, pb->spells, MAX_SPELL_COUNT);
+        if (pb->id == b->id && b->has_build[pb->id]) {
+            end_request(b, RQ_BUILD);
+        }
+        try_start_game(b);
+    } else if (p->type == PKT_PLAYER_STATE) {
+        net_packet_player_state *s = (net_packet_player_state *)p->content;
+        if (read_player_states(b, s->state, s->state + s->size, 1, b->player_states) == false) {
+            LOGL(LL_ERROR, "Bot %d got an invalid player state", b->fd);
+        }
+        free(s->state);
+    } else if (p->type == PKT_RESYNC) {
+        net_packet_resync *r = (net_packet_resync *)p->content;
+        uint8_t scratch[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE] = {0};
+        if (read_player_states(b, r->states, r->states + r->states_size, r->state_count, scratch) == false) {
+            LOGL(LL_ERROR, "Bot %d got an invalid resync", b->fd);
+        }
+        b->rng.state = r->rng_state;
+        free(r->states);
+    } else if (p->type == PKT_GAME_START) {
+        rng_seed(&b->rng, ((net_packet_game_start *)p->content)->seed);
+        if (b->spectator) {
+            return;
+        }
+        end_request(b, RQ_GAME_START);
+        b->state = BOT_PLAYING;
+        schedule_action(b);
+    } else if (p->type == PKT_ROUND_START && b->spectator == false) {
+        end_request(b, RQ_ROUND_START);
+        b->state = BOT_PLAYING;
+        schedule_action(b);
+    } else if (p->type == PKT_TURN_RESULT) {
+        net_packet_turn_result *t = (net_packet_turn_result *)p->content;
+        if (b->spectator) {
+            if (b->state == BOT_WATCHING) {
+                play_turn_result(b, t);
+            }
+            free(t->actions);
+            return;
+        }
+        end_request(b, RQ_TURN_RESULT);
+        play_turn_result(b, t);
+        free(t->actions);
+        // Every player of the room gets it, only one of them counts it
+        if (b->id == b->master) {
+            turns++;
+        }
+        if (t->outcome == TO_CONTINUE) {
+            schedule_action(b);
+        } else if (t->outcome == TO_ROUND_END) {
+            b->state = BOT_ROUND_ENDED;
+            start_request(b, RQ_ROUND_START);
+            bot_send(b, pkt_player_ready());
+        } else if (matchmake) {
+            queue_for_match(b);
+        } else {
+            b->state = BOT_LOBBY;
+            try_start_game(b);
+        }
+    } else if (p->type == PKT_SPELL_PROGRAMS) {
+        net_packet_spell_programs *sp = (net_packet_spell_programs *)p->content;
+        int size = 0;
+        uint32_t hash = 0;
+        get_spell_programs(&size, &hash);
+        if (sp->hash != hash && set_spell_programs(sp->programs, sp->size) == false) {
+            LOGL(LL_ERROR, "Bot %d got invalid spell programs", b->fd);
+        }
+        free(sp->programs);
+    } else if (p->type == PKT_MAP_HASH) {
+        net_packet_map_hash *h = (net_packet_map_hash *)p->content;
+        cached_map *cached = find_cached_map(h->hash);
+        if (cached != NULL) {
+            memcpy(b->map, cached->map, sizeof(b->map));
+            map_hits++;
+        } else {
+            b->map_fetched = h->hash;
+            map_fetches++;
+            bot_send(b, pkt_map_request(h->hash));
+        }
+    } else if (p->type == PKT_MAP) {
+        net_packet_map *m = (net_packet_map *)p->content;
+        if (m->type == MLT_BACKGROUND && m->width * m->height == MAP_WIDTH * MAP_HEIGHT) {
+            memcpy(b->map, m->content, sizeof(b->map));
+            if (b->map_fetched != 0 && find_cached_map(b->map_fetched) == NULL && map_cache_count < MAP_CACHE_SIZE) {
+                cached_map *cached = &map_cache[map_cache_count++];
+                cached->hash = b->map_fetched;
+                memcpy(cached->map, m->content, sizeof(cached->map));
+            }
+            b->map_fetched = 0;
+        }
+        free(m->content);
+    } else if (p->type == PKT_SERVER_MAP_LIST) {
+        free(((net_packet_server_map_list *)p->content)->map_names);
+    } else if (p->type == PKT_ROOM_LIST) {
+        free(((net_packet_room_list *)p->content)->rooms);
+    } else if (p->type == PKT_SERVER_MESSAGE) {
+        net_packet_server_message *m = (net_packet_server_message *)p->content;
+        if (m->level == LL_ERROR) {
+            server_errors++;
+            LOGL(LL_WARNING, "Bot %d: %.*s", b->fd, (int)sizeof(m->message), m->message);
+        }
+    }
+}
+
+// Network
+
+bool connect_bot(bot *b, int epoll_fd, struct sockaddr_in *addr) {
+    b->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (b->fd < 0) {
+        LOGL(LL_ERROR, "Could not create socket %s", strerror(errno));
+        return false;
+    }
+    b->in = calloc(1, sizeof(recv_buffer));
+    b->out = calloc(1, sizeof(send_queue));
+    b->state = BOT_CONNECTING;
+    if (connect(b->fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        LOGL(LL_ERROR, "Could not connect %s", strerror(errno));
+        close_bot(b, true);
+        return false;
+    }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = b};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, b->fd, &event) < 0) {
+        close_bot(b, true);
+        return false;
+    }
+    return true;
+}
+
+void handle_readable(bot *b) {
+    // Strings of the packet being handled point inside its frame body
+    uint8_t body[MAX_PACKET_SIZE] = {0};
+    int status = 0;
+    do {
+        status = recv_buffer_fill(b->in, b->fd);
+        net_packet p = {0};
+        int parsed = 0;
+        while ((parsed = packet_parse(b->in, &p, body)) > 0) {
+            handle_packet(b, &p);
+        }
+        if (parsed < 0) {
+            status = -1;
+        }
+    } while (status > 0);
+
+    if (status < 0) {
+        // Spectators are let go when their room closes
+        close_bot(b, b->state != BOT_CLOSED && b->state != BOT_WATCHING);
+    }
+}
+
+void handle_event(bot *b, uint32_t events) {
+    if (b->state == BOT_CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            LOGL(LL_ERROR, "Bot could not connect: %s", strerror(error));
+            close_bot(b, true);
+            return;
+        }
+        b->state = BOT_JOINING;
+        start_request(b, RQ_JOIN);
+        // Distinct names so every bot has its own rating
+        char name[32];
+        snprintf(name, sizeof(name), "bot%d", (int)(b - bots));
+        bot_send(b, pkt_join(NET_PROTOCOL_VERSION, GIT_VERSION, name, password));
+        if (b->spectator) {
+            start_request(b, RQ_SPECTATE);
+            bot_send(b, pkt_spectate(b->room_id));
+        }
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        handle_readable(b);
+    }
+    if (b->state != BOT_CLOSED && (events & (EPOLLHUP | EPOLLERR))) {
+        close_bot(b, true);
+    }
+}
+
+// Report
+
+int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(latency_samples *l, double p) {
+    int index = (int)ceil(p * l->count) - 1;
+    return l->samples[index < 0 ? 0 : index] / 1000.0;
+}
+
+void print_report(double seconds) {
+    int alive = 0;
+    int watching = 0;
+    for (int i = 0; i < bot_count; i++) {
+        alive += bots[i].state != BOT_CLOSED;
+    }
+    for (int i = bot_count; i < bot_count + spectator_count; i++) {
+        watching += bots[i].state == BOT_WATCHING;
+    }
+    printf("\n%d bots for %.1fs, %d still connected\n", bot_count, seconds, alive);
+    printf("turns: %d (%.1f/s)\n", turns, turns / seconds);
+    printf("connection failures: %d, closed by server: %d, server errors: %d\n", connection_failures,
+           closed_connections, server_errors);
+    printf("mispredicted turns: %d\n", mispredictions);
+    printf("maps: %d fetched, %d from cache\n", map_fetches, map_hits);
+    if (spectator_count > 0) {
+        printf("spectators: %d/%d watching, %d turns followed, %d mispredicted\n", watching, spectator_count,
+               watched_turns, spectator_mispredictions);
+    }
+    printf("\n%-12s %8s %9s %9s %9s %9s\n", "latency (ms)", "count", "p50", "p90", "p99", "max");
+    for (int i = 0; i < RQ_COUNT; i++) {
+        latency_samples *l = &latencies[i];
+        if (l->count == 0) {
+            printf("%-12s %8d\n", request_names[i], 0);
+            continue;
+        }
+        qsort(l->samples, l->count, sizeof(uint32_t), compare_samples);
+        printf("%-12s %8d %9.2f %9.2f %9.2f %9.2f\n", request_names[i], l->count, percentile(l, 0.5),
+               percentile(l, 0.9), percentile(l, 0.99), l->samples[l->count - 1] / 1000.0);
+    }
+}
+
+// Main
+
+int parse_positive(const char *arg, const char *value, int *out) {
+    if (value == NULL || !strtoint(value, out) || *out < 0) {
+        LOG("Invalid value for %s '%s'", arg, value == NULL ? "" : value);
+        exit(1);
+    }
+    return *out;
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = 3000;
+    int duration = 30;
+    int ai_ms = 0;
+    POPARG(argc, argv);
+    while (argc > 0) {
+        const char *arg = POPARG(argc, argv);
+        const char *value = argc > 0 ? POPARG(argc, argv) : NULL;
+        if (strcmp(arg, "--host") == 0 && value != NULL) {
+            host = value;
+        } else if (strcmp(arg, "--port") == 0) {
+            parse_positive(arg, value, &port);
+        } else if (strcmp(arg, "--bots") == 0) {
+            parse_positive(arg, value, &bot_count);
+        } else if (strcmp(arg, "--room-size") == 0) {
+            parse_positive(arg, value, &room_size);
+            if (room_size < 2 || room_size > MAX_PLAYER_COUNT) {
+                LOG("Room size must be between 2 and %d", MAX_PLAYER_COUNT);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--think") == 0) {
+            parse_positive(arg, value, &think_ms);
+        } else if (strcmp(arg, "--duration") == 0) {
+            parse_positive(arg, value, &duration);
+        } else if (strcmp(arg, "--pass") == 0 && value != NULL) {
+            password = value;
+        } else if (strcmp(arg, "--matchmake") == 0) {
+            int enabled = 0;
+            matchmake = parse_positive(arg, value, &enabled) != 0;
+        } else if (strcmp(arg, "--ai-ms") == 0) {
+            parse_positive(arg, value, &ai_ms);
+        } else if (strcmp(arg, "--spectators") == 0) {
+            parse_positive(arg, value, &spectator_count);
+        } else {
+            LOG("Unknown arg : '%s'", arg);
+            exit(1);
+        }
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        LOG("Invalid host '%s'", host);
+        exit(1);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    bots = calloc(bot_count + spectator_count, sizeof(bot));
+    if (epoll_fd < 0 || bots == NULL) {
+        LOGL(LL_ERROR, "Could not set up %d bots", bot_count);
+        exit(1);
+    }
+    srand(time(NULL));
+    if (ai_ms > 0) {
+        ai_config config = {.budget_ms = ai_ms, .threads = 1, .max_depth = AI_DEFAULT_MAX_DEPTH};
+        bot_ai = ai_create(config, time(NULL));
+        if (bot_ai == NULL) {
+            LOGL(LL_ERROR, "Could not allocate the AI");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < bot_count; i++) {
+        connect_bot(&bots[i], epoll_fd, &addr);
+    }
+    for (int i = bot_count; i < bot_count + spectator_count; i++) {
+        bots[i].spectator = true;
+        bots[i].id = -1;
+        bots[i].state = BOT_WAITING;
+    }
+    LOG("Started %d bots against %s:%d for %ds", bot_count, host, port, duration);
+
+    uint64_t start = now_ms();
+    uint64_t end = start + duration * 1000ull;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (now_ms() < end) {
+        int event_count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 5);
+        for (int i = 0; i < event_count; i++) {
+            handle_event(events[i].data.ptr, events[i].events);
+        }
+
+        uint64_t now = now_ms();
+        for (int i = 0; i < bot_count + spectator_count; i++) {
+            bot *b = &bots[i];
+            // Spectators spread over the rooms of the players, once these are playing
+            if (b->state == BOT_WAITING && bot_count > 0 && bots[(i - bot_count) % bot_count].state == BOT_PLAYING) {
+                b->room_id = bots[(i - bot_count) % bot_count].room_id;
+                connect_bot(b, epoll_fd, &addr);
+            }
+            if (b->state == BOT_CLOSED || b->state == BOT_CONNECTING || b->state == BOT_WAITING) {
+                continue;
+            }
+            if (b->next_action_ms != 0 && now >= b->next_action_ms) {
+                b->next_action_ms = 0;
+                if (b->state == BOT_PLAYING) {
+                    play_action(b);
+                }
+            }
+            // Relays do not answer pings
+            if (b->spectator == false && now >= b->next_ping_ms) {
+                b->next_ping_ms = now + PING_INTERVAL_MS;
+                start_request(b, RQ_PING);
+                bot_send(b, pkt_ping(now, 0));
+            }
+            if (send_queue_flush(b->out, b->fd) < 0) {
+                close_bot(b, true);
+            }
+        }
+    }
+
+    // The report comes after the last warnings of the run
+    flush_logs();
+    print_report((now_ms() - start) / 1000.0);
+    return 0;
+}
@@ -46,14 +46,17 @@ typedef struct tagMSG *LPMSG;
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #endif
 #include <limits.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "assets.h"
@@ -79,7 +82,9 @@ typedef struct tagMSG *LPMSG;
 #define MAIN_MENU_INPUT_COUNT (int)(sizeof(inputs) / sizeof(inputs[0]))
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
-#define MAX_PACKET_QUEUE_SIZE 128
+#define PACKET_RING_SIZE (MAX_PACKET_SIZE * 64)
+#define PACKET_DRAIN_BUDGET 0.004
+#define OUTBOX_SIZE (MAX_PACKET_SIZE * 32)
 
 #define FOREACH_PLAYER(IT, P)                                                    \
     for (int IT = 0; IT < MAX_PLAYER_COUNT; IT++)                                \
@@ -91,9 +96,10 @@ typedef struct tagMSG *LPMSG;
         (x), (y) \
     }
 
-#define send_serv(PACKET_FUNC)               \
-    do {                                     \
-        send_packet(PACKET_FUNC, server_fd); \
+#define send_serv(PACKET_FUNC)                  \
+    do {                                        \
+        net_packet p##__LINE__ = (PACKET_FUNC); \
+        outbox_push(&p##__LINE__);              \
     } while (0)
 
 #define NSTR(STRUCT) TextFormat("%.*s", STRUCT.len, STRUCT.str)
@@ -112,7 +118,43 @@ int fd_count;
 struct timeval timeout;
 pthread_t t_network;
 
-queue pkt_queue;
+// Frames are read by the network thread straight into a single producer single consumer ring and
+// decoded in place by the main thread, the strings of a packet point inside its record
+typedef struct {
+    uint32_t len;  // 0 once the connection is lost, PACKET_RECORD_WRAP to continue at the start
+    double recieve_time;
+    uint8_t body[];
+} packet_record;
+
+#define PACKET_RECORD_WRAP UINT32_MAX
+#define PACKET_RECORD_SIZE(LEN) ((sizeof(packet_record) + (LEN) + sizeof(packet_record) - 1) & ~(sizeof(packet_record) - 1))
+
+// head and tail count bytes since the connection started, each is written by one side only
+struct {
+    _Alignas(64) atomic_uint_fast64_t head;
+    _Alignas(64) atomic_uint_fast64_t tail;
+    _Alignas(64) atomic_bool producer_waiting;
+    _Alignas(64) uint8_t data[PACKET_RING_SIZE];
+} packet_ring;
+
+pthread_mutex_t packet_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t packet_ring_wake = PTHREAD_COND_INITIALIZER;
+
+// Frames are packed by the main thread into the outbox, the send thread swaps it with the other buffer
+// and writes the whole batch at once so the main thread never waits on the socket
+typedef struct {
+    char data[OUTBOX_SIZE];
+    uint32_t len;
+} outbox_buffer;
+
+outbox_buffer outboxes[2];
+outbox_buffer *outbox = &outboxes[0];
+bool outbox_closed = false;
+pthread_mutex_t outbox_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t outbox_wake = PTHREAD_COND_INITIALIZER;
+pthread_t t_send;
+
+void outbox_push(net_packet *p);
 
 // Console
 bool console_open = false;
@@ -294,6 +336,10 @@ typedef struct {
 player players[MAX_PLAYER_COUNT] = {0};
 int current_player = -1;
 int master_player = 0;
+// Seeded by the server at game start, draws that must match on every client come from it
+rng match_rng = {0};
+// Floor variants draw from their own copy so a map coming after the seed does not shift match_rng
+rng variant_rng = {0};
 uint8_t my_spells[MAX_SPELL_COUNT] = {0, 1, 2, 3};
 
 typedef struct {
@@ -345,6 +391,10 @@ typedef struct {
 } player_turn_update;
 
 player_turn_update updates[MAX_PLAYER_COUNT] = {0};
+// Last packed state received for each player, the server sends deltas against it
+uint8_t player_states[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE] = {0};
+// Copy of the server's game, turns are played on it as soon as their actions arrive
+sim_state predicted = {0};
 
 // Round
 time_t round_timer = 0;
@@ -539,14 +589,14 @@ void update_console() {
             if (result.content == NULL) {
                 LOGL(LL_ERROR, "Unknown command `%s`", input);
             } else if (result.content != NULL) {
-                LOGL(LL_ERROR, "%s", result.content);
+                LOGL(LL_ERROR, "%s", (const char *)result.content);
             }
         } else {
             if (result.has_packet) {
                 if (result.content == NULL) {
                     LOGL(LL_ERROR, "Error creating packet");
                 } else {
-                    // send_serv(result.type, result.content, server_fd);
+                    outbox_push((net_packet *)result.content);
                 }
                 free(result.content);
             }
@@ -791,8 +841,8 @@ void compute_map_variants() {
     for (int y = 0; y < game_map.height; y++) {
         for (int x = 0; x < game_map.width; x++) {
             if (get_map(&game_map, x, y) == 0) {
-                if (rand() % 100 > 90) {  // 10% of chance to have a random floor cell texture
-                    set_map(&variants, x, y, (rand() % FLOOR_TEXTURE_COUNT - 1) + 1);
+                if (rng_range(&variant_rng, 100) > 90) {  // 10% of chance to have a random floor cell texture
+                    set_map(&variants, x, y, rng_range(&variant_rng, FLOOR_TEXTURE_COUNT - 1) + 1);
                 } else {
                     set_map(&variants, x, y, 0);
                 }
@@ -1118,7 +1168,7 @@ int player_cast_spell(player *p, Vector2 origin) {
     if (s->type == ST_MOVE || s->type == ST_TARGET) {
         return can_player_move(p, origin);
     } else {
-        LOGL(LL_ERROR, "not implemented type", s->type);
+        LOGL(LL_ERROR, "not implemented type %d", s->type);
     }
     return false;
 }
@@ -1489,31 +1539,20 @@ bool execute_spell(player *p, const spell *s, Vector2 cell, player *target) {
                 PlaySound(move_sound);
                 return false;
             } else if (target->info.turn_effect == SE_BLOCK) {
-                p->info.effect[SE_STUN] = true;
-                p->info.effect_round_left[SE_STUN] = 2;
-                p->info.spell_effect[SE_STUN] = &all_spells[6];  // TODO: Should not be hardcoded
+                sim_block_stun(&p->info);
                 return false;
             } else {
-                int damage = get_spell_damage(&p->info, s);
-                if (damage != 0) {
-                    target->info.stats[STAT_HEALTH].value = fmax(target->info.stats[STAT_HEALTH].value - damage, 0);
+                int health = target->info.stats[STAT_HEALTH].value;
+                sim_spell_hit(NULL, &p->info, &target->info, s);
+                if (target->info.stats[STAT_HEALTH].value < health) {
                     LOG("Player %s now has %d HP", target->info.name, target->info.stats[STAT_HEALTH].value);
                     target->action_animation = new_animation(AT_ONESHOT, 0.3f, 1);
                     target->animation_state = PAS_DAMAGE;
                 }
-                if (s->stat_value != 0) {
-                    if (s->stat_max) {
-                        target->info.stats[s->stat].max = fmin(target->info.stats[s->stat].max + s->stat_value, 200);
-                        target->info.stats[s->stat].value =
-                            fmin(target->info.stats[s->stat].value + s->stat_value, 200);
-                    } else {
-                        target->info.stats[s->stat].value =
-                            fmin(target->info.stats[s->stat].value + s->damage_value, target->info.stats[s->stat].max);
-                    }
-                }
             }
         }
-    } else {
+    } else if (s->type != ST_AROUND) {
+        // Around spells only exist in the prediction, their results come with the end of the turn
         LOGL(LL_ERROR, "Unknown spell type %d from %s", s->type, s->name);
     }
     return true;
@@ -1663,11 +1702,197 @@ int connect_to_server(const char *ip, uint16_t port) {
 }
 
 void player_join(const char *username) {
-    send_serv(pkt_join(username, input_to_text(&password_buf)));
+    send_serv(pkt_join(NET_PROTOCOL_VERSION, GIT_VERSION, username, input_to_text(&password_buf)));
 }
 
 void update_lobby_player_list();
 
+// Unpacks the player state entry at buf into u, returns the next entry or NULL if it is invalid
+uint8_t *read_player_state(uint8_t *buf, uint8_t *end, net_packet_player_update *u) {
+    uint8_t id = 0;
+    buf = unpack_player_state(buf, end, player_states, &id);
+    if (buf != NULL) {
+        unpackstruct(PKT_PLAYER_UPDATE, player_states[id], (uint8_t *)u);
+    }
+    return buf;
+}
+
+net_packet_player_update player_update_from_info(player_info *p) {
+    net_packet_player_update u = {.id = p->id, .x = p->x, .y = p->y};
+    for (int i = 0; i < STAT_COUNT; i++) {
+        u.stats[i] = p->stats[i];
+    }
+    for (int i = 0; i < SE_COUNT; i++) {
+        u.effect[i] = p->effect[i];
+        u.effect_round_left[i] = p->effect_round_left[i];
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        u.banned_spells[i] = p->banned[i];
+    }
+    return u;
+}
+
+void apply_player_update(player *player, net_packet_player_update *u) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+        player->info.stats[i] = u->stats[i];
+    }
+    player->info.x = u->x;
+    player->info.y = u->y;
+    for (int i = 0; i < SE_COUNT; i++) {
+        player->info.effect[i] = u->effect[i];
+        player->info.effect_round_left[i] = u->effect_round_left[i];
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        player->info.banned[i] = u->banned_spells[i];
+    }
+}
+
+// The state will be applied at the end of the turn
+void stage_player_update(net_packet_player_update *u) {
+    updates[u->id].position = (Vector2){u->x, u->y};
+    for (int i = 0; i < STAT_COUNT; i++) {
+        updates[u->id].stats[i] = u->stats[i];
+    }
+    for (int j = 0; j < SE_COUNT; j++) {
+        updates[u->id].effect[j] = u->effect[j];
+        updates[u->id].effect_round_left[j] = u->effect_round_left[j];
+    }
+    for (int j = 0; j < MAX_SPELL_COUNT; j++) {
+        updates[u->id].banned_spells[j] = u->banned_spells[j];
+    }
+}
+
+// Map cache, maps are kept under the hash the server names them with (PKT_MAP_HASH)
+#define MAP_CACHE_DIR "map_cache"
+#define MAP_CACHE_SIZE 16
+
+typedef struct {
+    uint64_t hash;
+    uint8_t width;
+    uint8_t height;
+    uint8_t *layers[2];  // Indexed by map_layer_type, NULL when the entry is free
+} cached_map;
+
+cached_map map_cache[MAP_CACHE_SIZE] = {0};
+int map_cache_next = 0;    // Entries are replaced in the order they were filled
+uint64_t map_fetched = 0;  // Hash of the map whose layers were requested, 0 when none
+bool map_layer_fetched[2] = {0};
+
+void set_map_layer(map_layer_type type, int width, int height, uint8_t *content) {
+    if (type == MLT_BACKGROUND) {
+        init_map(&game_map, width, height, content);
+        init_map(&players[current_player].action_range, game_map.width, game_map.height, NULL);
+        base_x_offset = (WIDTH - (CELL_SIZE * game_map.width)) / 2;
+        base_y_offset = (HEIGHT - (CELL_SIZE * game_map.height)) / 2;
+    } else {
+        init_map(&props, width, height, content);
+        set_props_animations();
+    }
+}
+
+cached_map *find_cached_map(uint64_t hash) {
+    for (int i = 0; i < MAP_CACHE_SIZE; i++) {
+        if (map_cache[i].layers[MLT_BACKGROUND] != NULL && map_cache[i].hash == hash) {
+            return &map_cache[i];
+        }
+    }
+    return NULL;
+}
+
+void free_cached_map(cached_map *c) {
+    free(c->layers[MLT_BACKGROUND]);
+    free(c->layers[MLT_PROPS]);
+    c->layers[MLT_BACKGROUND] = NULL;
+    c->layers[MLT_PROPS] = NULL;
+}
+
+// Takes the oldest entry, its layers are left for the caller to fill
+cached_map *new_cached_map(uint64_t hash, uint8_t width, uint8_t height) {
+    cached_map *c = &map_cache[map_cache_next];
+    map_cache_next = (map_cache_next + 1) % MAP_CACHE_SIZE;
+    free_cached_map(c);
+    c->hash = hash;
+    c->width = width;
+    c->height = height;
+    c->layers[MLT_BACKGROUND] = malloc(width * height);
+    c->layers[MLT_PROPS] = malloc(width * height);
+    if (c->layers[MLT_BACKGROUND] == NULL || c->layers[MLT_PROPS] == NULL) {
+        free_cached_map(c);
+        return NULL;
+    }
+    return c;
+}
+
+const char *cached_map_path(uint64_t hash) {
+    return TextFormat(MAP_CACHE_DIR "/%016" PRIx64 ".bin", hash);
+}
+
+// A file holds the width and height then both layers. It is named after its hash, which is checked on read.
+cached_map *read_cached_map(uint64_t hash) {
+    FILE *f = fopen(cached_map_path(hash), "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint8_t size[2] = {0};
+    cached_map *c = NULL;
+    if (fread(size, 1, sizeof(size), f) == sizeof(size)) {
+        c = new_cached_map(hash, size[0], size[1]);
+    }
+    if (c != NULL) {
+        int layer_size = c->width * c->height;
+        bool complete = (int)fread(c->layers[MLT_BACKGROUND], 1, layer_size, f) == layer_size &&
+                        (int)fread(c->layers[MLT_PROPS], 1, layer_size, f) == layer_size;
+        if (complete == false || map_layers_hash(c->width, c->height, c->layers[MLT_BACKGROUND],
+                                                 c->layers[MLT_PROPS]) != hash) {
+            LOGL(LL_WARNING, "Ignoring corrupted cached map %s", cached_map_path(hash));
+            free_cached_map(c);
+            c = NULL;
+        }
+    }
+    fclose(f);
+    return c;
+}
+
+void write_cached_map(cached_map *c) {
+#ifdef WINDOWS_BUILD
+    mkdir(MAP_CACHE_DIR);
+#else
+    mkdir(MAP_CACHE_DIR, 0755);
+#endif
+    const char *path = cached_map_path(c->hash);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        LOGL(LL_WARNING, "Could not cache map in %s", path);
+        return;
+    }
+    uint8_t size[2] = {c->width, c->height};
+    fwrite(size, 1, sizeof(size), f);
+    fwrite(c->layers[MLT_BACKGROUND], 1, c->width * c->height, f);
+    fwrite(c->layers[MLT_PROPS], 1, c->width * c->height, f);
+    fclose(f);
+}
+
+// The layers of a requested map are only kept once both came and they match the hash
+void cache_fetched_map() {
+    uint64_t hash = map_fetched;
+    map_fetched = 0;
+    if (game_map.width != props.width || game_map.height != props.height ||
+        map_layers_hash(game_map.width, game_map.height, game_map.content, props.content) != hash) {
+        LOGL(LL_WARNING, "Map layers do not match the hash of the map");
+    } else {
+        cached_map *c = new_cached_map(hash, game_map.width, game_map.height);
+        if (c != NULL) {
+            memcpy(c->layers[MLT_BACKGROUND], game_map.content, c->width * c->height);
+            memcpy(c->layers[MLT_PROPS], props.content, c->width * c->height);
+            write_cached_map(c);
+        }
+    }
+    // The game may have started while the layers were on their way
+    if (gs == GS_STARTED) {
+        compute_map_variants();
+    }
+}
+
 void handle_packet(net_packet *p) {
     if (p->type == PKT_PING) {
         net_packet_ping *ping = (net_packet_ping *)p->content;
@@ -1677,11 +1902,17 @@ void handle_packet(net_packet *p) {
         LOG("Joined: %s with ID=%d", NSTR(join->username), join->id);
         memcpy(players[join->id].info.name, join->username.str, join->username.len);
         players[join->id].info.connected = true;
+        predicted.players[join->id].connected = true;
         update_lobby_player_list();
     } else if (p->type == PKT_CONNECTED) {
         net_packet_connected *c = (net_packet_connected *)p->content;
         set_scene(SCENE_LOBBY);
-        LOG("My ID is %d", c->id);
+        LOG("My ID is %d in room %u", c->id, c->room_id);
+        // We may come from another room, its players will be sent again by the server
+        for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+            players[i].info.connected = false;
+        }
+        memset(&predicted, 0, sizeof(predicted));
         current_player = c->id;
         master_player = c->master;
 
@@ -1693,6 +1924,34 @@ void handle_packet(net_packet *p) {
         send_serv(pkt_player_build(current_player, base_health, players[current_player].info.spells, strength, speed));
         connected = true;
         update_lobby_player_list();
+    } else if (p->type == PKT_ROOM_LIST) {
+        net_packet_room_list *l = (net_packet_room_list *)p->content;
+        LOG("%d room(s) available", l->room_count);
+        uint8_t *entry = l->rooms;
+        for (int i = 0; i < l->room_count; i++) {
+            uint32_t id = unpacku32(&entry);
+            uint8_t count = *entry++;
+            entry++;  // Game state, only joinable rooms are listed
+            LOG("  room %u: %d/%d players", id, count, MAX_PLAYER_COUNT);
+        }
+        free(l->rooms);
+    } else if (p->type == PKT_MATCHMAKE_STATUS) {
+        net_packet_matchmake_status *m = (net_packet_matchmake_status *)p->content;
+        if (m->queued) {
+            LOG("Looking for a match with rating %u, %u player(s) waiting", m->rating, m->waiting);
+        } else {
+            LOG("Left the matchmaking queue");
+        }
+    } else if (p->type == PKT_SPECTATE_START) {
+        // The room's players and state follow as the usual packets
+        net_packet_spectate_start *start = (net_packet_spectate_start *)p->content;
+        LOG("Watching room %u", start->room_id);
+        set_scene(SCENE_LOBBY);
+        for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+            players[i].info.connected = false;
+        }
+        memset(&predicted, 0, sizeof(predicted));
+        master_player = start->master;
     } else if (p->type == PKT_UPDATE_SERVER_CONFIGURATION) {
         net_packet_update_server_configuration *u = (net_packet_update_server_configuration *)p->content;
         map_picker.selected_option = u->map_index;
@@ -1701,6 +1960,7 @@ void handle_packet(net_packet *p) {
         net_packet_disconnect *d = (net_packet_disconnect *)p->content;
         LOG("Player %d disconnected", d->id);
         players[d->id].info.connected = false;
+        predicted.players[d->id].connected = false;
         master_player = d->new_master;
         set_scene(SCENE_LOBBY);
         gs = GS_WAITING;
@@ -1708,12 +1968,18 @@ void handle_packet(net_packet *p) {
         update_lobby_player_list();
     } else if (p->type == PKT_SERVER_MAP_LIST) {
         net_packet_server_map_list *list = (net_packet_server_map_list *)p->content;
-        clear_picker(&map_picker);
-        for (int i = 0; i < list->map_count; i++) {
-            char str[33] = {0};
-            memcpy(str, list->map_names + 32 * i, 32);
-            picker_add_option(&map_picker, str);
+        if (list->first == 0) {
+            clear_picker(&map_picker);
         }
+        // Options are indexed by map id, a page that does not follow the previous one is dropped
+        if (list->first == (uint32_t)map_picker.option_count) {
+            for (int i = 0; i < list->map_count; i++) {
+                char str[33] = {0};
+                memcpy(str, list->map_names + 32 * i, 32);
+                picker_add_option(&map_picker, str);
+            }
+        }
+        free(list->map_names);
     } else if (p->type == PKT_PLAYER_BUILD) {
         net_packet_player_build *b = (net_packet_player_build *)p->content;
         player *player = &players[b->id];
@@ -1731,97 +1997,171 @@ void handle_packet(net_packet *p) {
         for (int i = 0; i < MAX_SPELL_COUNT; i++) {
             player->info.spells[i] = b->spells[i];
         }
+        memcpy(predicted.players[b->id].spells, b->spells, MAX_SPELL_COUNT);
         update_lobby_player_list();
+    } else if (p->type == PKT_MAP_HASH) {
+        net_packet_map_hash *h = (net_packet_map_hash *)p->content;
+        cached_map *c = find_cached_map(h->hash);
+        if (c == NULL) {
+            c = read_cached_map(h->hash);
+        }
+        if (c != NULL) {
+            map_fetched = 0;
+            set_map_layer(MLT_BACKGROUND, c->width, c->height, c->layers[MLT_BACKGROUND]);
+            set_map_layer(MLT_PROPS, c->width, c->height, c->layers[MLT_PROPS]);
+            LOG("Map %016" PRIx64 " loaded from the cache", h->hash);
+        } else {
+            map_fetched = h->hash;
+            map_layer_fetched[MLT_BACKGROUND] = false;
+            map_layer_fetched[MLT_PROPS] = false;
+            send_serv(pkt_map_request(h->hash));
+        }
     } else if (p->type == PKT_MAP) {
         net_packet_map *m = (net_packet_map *)p->content;
         LOG("Map is %d/%d", m->width, m->height);
-        if (m->type == MLT_BACKGROUND) {
-            init_map(&game_map, m->width, m->height, m->content);
-            init_map(&players[current_player].action_range, game_map.width, game_map.height, NULL);
-            compute_map_variants();
-            base_x_offset = (WIDTH - (CELL_SIZE * game_map.width)) / 2;
-            base_y_offset = (HEIGHT - (CELL_SIZE * game_map.height)) / 2;
-        } else if (m->type == MLT_PROPS) {
-            init_map(&props, m->width, m->height, m->content);
-            set_props_animations();
-        } else {
+        if (m->type != MLT_BACKGROUND && m->type != MLT_PROPS) {
             LOG("Unknown map layer");
             exit(1);
         }
+        set_map_layer(m->type, m->width, m->height, m->content);
+        free(m->content);
+        if (map_fetched != 0) {
+            map_layer_fetched[m->type] = true;
+            if (map_layer_fetched[MLT_BACKGROUND] && map_layer_fetched[MLT_PROPS]) {
+                cache_fetched_map();
+            }
+        }
         LOG("Map loaded");
     } else if (p->type == PKT_GAME_START) {
+        net_packet_game_start *g = (net_packet_game_start *)p->content;
         LOG("Starting Game !!");
+        rng_seed(&match_rng, g->seed);
+        rng_seed(&variant_rng, g->seed);
+        // A map still being fetched gets its variants once its layers are there
+        if (map_fetched == 0) {
+            compute_map_variants();
+        }
         set_scene(SCENE_IN_GAME);
         gs = GS_STARTED;
         set_selected_spell(&players[current_player], 0);
         init_in_game_ui();
-    } else if (p->type == PKT_PLAYER_UPDATE) {
-        net_packet_player_update *u = (net_packet_player_update *)p->content;
+    } else if (p->type == PKT_PLAYER_STATE) {
+        net_packet_player_state *ps = (net_packet_player_state *)p->content;
+        net_packet_player_update update = {0}, *u = &update;
+        uint8_t *end = read_player_state(ps->state, ps->state + ps->size, u);
+        free(ps->state);
+        if (end == NULL) {
+            LOGL(LL_ERROR, "Invalid player state");
+            return;
+        }
         LOG("Player Update %d %d %d H=%d STR=%d (%d immediate)", u->id, u->x, u->y, u->stats[STAT_HEALTH].value,
-            u->stats[STAT_STRENGTH].value, u->immediate);
-        player *player = &players[u->id];
+            u->stats[STAT_STRENGTH].value, ps->immediate);
+        player_info_from_update(&predicted.players[u->id], u);
 
-        if (gs == GS_WAITING || u->immediate) {
-            for (int i = 0; i < STAT_COUNT; i++) {
-                player->info.stats[i] = u->stats[i];
-            }
-            player->info.x = u->x;
-            player->info.y = u->y;
-            for (int i = 0; i < SE_COUNT; i++) {
-                player->info.effect[i] = u->effect[i];
-                player->info.effect_round_left[i] = u->effect_round_left[i];
-                player->info.banned[i] = u->banned_spells[i];
-            }
+        if (gs == GS_WAITING || ps->immediate) {
+            apply_player_update(&players[u->id], u);
         } else {
-            updates[u->id].position = (Vector2){u->x, u->y};
-            for (int i = 0; i < STAT_COUNT; i++) {
-                updates[u->id].stats[i] = u->stats[i];
-            }
-            for (int j = 0; j < SE_COUNT; j++) {
-                updates[u->id].effect[j] = u->effect[j];
-                updates[u->id].effect_round_left[j] = u->effect_round_left[j];
-            }
-            for (int j = 0; j < MAX_SPELL_COUNT; j++) {
-                updates[u->id].banned_spells[j] = u->banned_spells[j];
-            }
-        }
-    } else if (p->type == PKT_PLAYER_ACTION) {
-        net_packet_player_action *a = (net_packet_player_action *)p->content;
-        LOG("New action: %d %d", a->id, a->spell);
-        player_turn_action *action = &actions[action_count];
-        action->player = a->id;
-        action->action = a->action;
-        action->target = (Vector2){a->x, a->y};
-        action->spell = a->spell;
-        action_count++;
-    } else if (p->type == PKT_TURN_END) {
-        state = RS_PLAYING_TURN;
-    } else if (p->type == PKT_ROUND_START) {
-        gs = GS_STARTED;
-    } else if (p->type == PKT_ROUND_END) {
-        update_lobby_player_list();
-        net_packet_round_end *e = (net_packet_round_end *)p->content;
-        LOG("Round ended");
-        state = RS_PLAYING_TURN;
-        winner_id = e->winner_id;
-        gs = GS_ROUND_ENDING;
+            stage_player_update(u);
+        }
+    } else if (p->type == PKT_TURN_RESULT) {
+        net_packet_turn_result *t = (net_packet_turn_result *)p->content;
+        sim_action turn_actions[MAX_PLAYER_COUNT] = {0};
+        uint8_t *a = t->actions;
+        for (int i = 0; i < t->action_count; i++, a += NET_TURN_ACTION_SIZE) {
+            if (a[0] < MAX_PLAYER_COUNT) {
+                turn_actions[a[0]] = (sim_action){.action = a[1], .x = a[2], .y = a[3], .spell = a[4]};
+            }
+        }
+        free(t->actions);
+
+        // The turn is played right away, the server only confirms it with its hash
+        uint8_t predicted_winner = GAME_TIE;
+        // Pushes stop on walls, a map that did not come yet only costs a resync
+        bool has_map = game_map.width == MAP_WIDTH && game_map.height == MAP_HEIGHT;
+        predicted.map = has_map ? game_map.content : NULL;
+        sim_step(&predicted, turn_actions, &match_rng, &predicted_winner);
+        if ((uint32_t)sim_hash(&predicted, &match_rng) != t->state_hash) {
+            LOGL(LL_WARNING, "Mispredicted the turn, asking the server for its state");
+            send_serv(pkt_resync_request());
+        }
+        LOG("Turn result: %d events, outcome %d", predicted.event_count, t->outcome);
+        for (int i = 0; i < predicted.event_count; i++) {
+            turn_event *e = &predicted.events[i];
+            uint8_t type = e->type, id = e->player, kind = e->kind, x = e->x, y = e->y, value = e->value;
+            if (type == TE_ACTION && action_count < MAX_PLAYER_ROUND_ACTION_COUNT) {
+                player_turn_action *action = &actions[action_count];
+                action->player = id;
+                action->action = kind;
+                action->target = (Vector2){x, y};
+                action->spell = value;
+                action_count++;
+            } else if (type == TE_DAMAGE) {
+                LOGL(LL_DEBUG, "%s took %d damage from %s", players[id].info.name, value, players[kind].info.name);
+            } else if (type == TE_EFFECT) {
+                LOGL(LL_DEBUG, "%s got effect %d for %d rounds", players[id].info.name, kind, value);
+            } else if (type == TE_DEATH) {
+                LOGL(LL_DEBUG, "%s died", players[id].info.name);
+            }
+        }
+
+        // Final states are applied once every action has been animated, see end_turn
         FOREACH_PLAYER(i, player) {
-            futures_scores[i] = e->player_scores[i];
+            net_packet_player_update u = player_update_from_info(&predicted.players[i]);
+            stage_player_update(&u);
         }
-    } else if (p->type == PKT_GAME_END) {
-        net_packet_round_end *e = (net_packet_round_end *)p->content;
-        LOG("Game ended");
-        winner_id = e->winner_id;
-        gs = GS_GAME_ENDING;
-        FOREACH_PLAYER(i, player) {
-            futures_scores[i] = e->player_scores[i];
+
+        if (t->outcome != TO_CONTINUE) {
+            update_lobby_player_list();
+            LOG(t->outcome == TO_GAME_END ? "Game ended" : "Round ended");
+            winner_id = t->winner_id;
+            gs = t->outcome == TO_GAME_END ? GS_GAME_ENDING : GS_ROUND_ENDING;
+            FOREACH_PLAYER(i, player) {
+                futures_scores[i] = t->player_scores[i];
+            }
+        }
+        state = RS_PLAYING_TURN;
+    } else if (p->type == PKT_RESYNC) {
+        net_packet_resync *r = (net_packet_resync *)p->content;
+        // Keyframes only, they must not move the baseline of the next deltas
+        uint8_t scratch[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE] = {0};
+        uint8_t *packed_state = r->states;
+        for (int i = 0; i < r->state_count && packed_state != NULL; i++) {
+            uint8_t id = 0;
+            packed_state = unpack_player_state(packed_state, r->states + r->states_size, scratch, &id);
+            if (packed_state == NULL) {
+                LOGL(LL_ERROR, "Invalid player state in resync");
+                break;
+            }
+            net_packet_player_update u = {0};
+            unpackstruct(PKT_PLAYER_UPDATE, scratch[id], (uint8_t *)&u);
+            player_info_from_update(&predicted.players[id], &u);
+            if (state == RS_PLAYING) {
+                apply_player_update(&players[id], &u);
+            } else {
+                stage_player_update(&u);
+            }
+        }
+        free(r->states);
+        match_rng.state = r->rng_state;
+    } else if (p->type == PKT_SPELL_PROGRAMS) {
+        net_packet_spell_programs *sp = (net_packet_spell_programs *)p->content;
+        int size = 0;
+        uint32_t hash = 0;
+        get_spell_programs(&size, &hash);
+        if (sp->hash != hash && set_spell_programs(sp->programs, sp->size) == false) {
+            LOGL(LL_ERROR, "The server sent invalid spell programs");
         }
+        free(sp->programs);
+    } else if (p->type == PKT_ROUND_START) {
+        gs = GS_STARTED;
     } else if (p->type == PKT_GAME_RESET) {
         LOG("Client: game reset");
         reset_game();
     } else if (p->type == PKT_GAME_STATS) {
         net_packet_game_stats *s = (net_packet_game_stats *)p->content;
         round_timer = s->round_timer;
+    } else if (p->type == PKT_HEARTBEAT) {
+        send_serv(pkt_heartbeat());
     } else if (p->type == PKT_SERVER_MESSAGE) {
         net_packet_server_message *msg = (net_packet_server_message *)p->content;
         LOGL(msg->level, "From server: %s", msg->message);
@@ -1831,26 +2171,138 @@ void handle_packet(net_packet *p) {
     }
 }
 
-// TODO: It should also send queued packets from the client
+// Blocks the network thread until a frame of any size fits without crossing the end of the ring
+packet_record *packet_ring_reserve(void) {
+    uint64_t tail = atomic_load_explicit(&packet_ring.tail, memory_order_relaxed);
+    uint64_t left = PACKET_RING_SIZE - tail % PACKET_RING_SIZE;
+    uint64_t skip = left < PACKET_RECORD_SIZE(MAX_PACKET_SIZE) ? left : 0;
+    uint64_t end = tail + skip + PACKET_RECORD_SIZE(MAX_PACKET_SIZE);
+    while (end - atomic_load(&packet_ring.head) > PACKET_RING_SIZE) {
+        pthread_mutex_lock(&packet_ring_lock);
+        atomic_store(&packet_ring.producer_waiting, true);
+        if (end - atomic_load(&packet_ring.head) > PACKET_RING_SIZE) {
+            pthread_cond_wait(&packet_ring_wake, &packet_ring_lock);
+        }
+        atomic_store(&packet_ring.producer_waiting, false);
+        pthread_mutex_unlock(&packet_ring_lock);
+    }
+    if (skip > 0) {
+        ((packet_record *)&packet_ring.data[tail % PACKET_RING_SIZE])->len = PACKET_RECORD_WRAP;
+        tail += skip;
+        atomic_store_explicit(&packet_ring.tail, tail, memory_order_release);
+    }
+    return (packet_record *)&packet_ring.data[tail % PACKET_RING_SIZE];
+}
+
+void packet_ring_commit(packet_record *r, uint32_t len) {
+    r->len = len;
+    uint64_t tail = atomic_load_explicit(&packet_ring.tail, memory_order_relaxed);
+    atomic_store_explicit(&packet_ring.tail, tail + PACKET_RECORD_SIZE(len), memory_order_release);
+}
+
+packet_record *packet_ring_peek(void) {
+    uint64_t head = atomic_load_explicit(&packet_ring.head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&packet_ring.tail, memory_order_acquire)) {
+        return NULL;
+    }
+    packet_record *r = (packet_record *)&packet_ring.data[head % PACKET_RING_SIZE];
+    if (r->len != PACKET_RECORD_WRAP) {
+        return r;
+    }
+    // The producer publishes the wrap on its own, the record after it may not be there yet
+    atomic_store(&packet_ring.head, head + PACKET_RING_SIZE - head % PACKET_RING_SIZE);
+    return packet_ring_peek();
+}
+
+void packet_ring_release(packet_record *r) {
+    uint64_t head = atomic_load_explicit(&packet_ring.head, memory_order_relaxed);
+    atomic_store(&packet_ring.head, head + PACKET_RECORD_SIZE(r->len));
+    if (atomic_load(&packet_ring.producer_waiting)) {
+        pthread_mutex_lock(&packet_ring_lock);
+        pthread_cond_signal(&packet_ring_wake);
+        pthread_mutex_unlock(&packet_ring_lock);
+    }
+}
+
+void outbox_push(net_packet *p) {
+    if (!accepted) {
+        LOGL(LL_ERROR, "Can't send packet when not connected");
+        return;
+    }
+    uint32_t size = frame_size(p);
+    if (size > MAX_PACKET_SIZE) {
+        LOGL(LL_ERROR, "Packet is too big (%u / %d)", size, MAX_PACKET_SIZE);
+        return;
+    }
+    pthread_mutex_lock(&outbox_lock);
+    bool full = outbox->len + size > OUTBOX_SIZE;
+    if (!full) {
+        pack_frame(outbox->data + outbox->len, p);
+        outbox->len += size;
+        pthread_cond_signal(&outbox_wake);
+    }
+    pthread_mutex_unlock(&outbox_lock);
+    if (full) {
+        LOGL(LL_WARNING, "Dropping packet of type %d, the server is not reading", p->type);
+    }
+}
+
+void *send_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&outbox_lock);
+    while (true) {
+        while (outbox->len == 0 && !outbox_closed) {
+            pthread_cond_wait(&outbox_wake, &outbox_lock);
+        }
+        if (outbox_closed) {
+            break;
+        }
+        outbox_buffer *batch = outbox;
+        outbox = batch == &outboxes[0] ? &outboxes[1] : &outboxes[0];
+        pthread_mutex_unlock(&outbox_lock);
+
+        char *b = batch->data;
+        int n = 0;
+        while (batch->len > 0 && (n = send_data(server_fd, b, batch->len)) > 0) {
+            batch->len -= n;
+            b += n;
+        }
+        // The network thread notices the broken connection on its next read
+        if (n < 0) {
+            LOGL(LL_ERROR, "Error sending to server %s", strerror(errno));
+        }
+        batch->len = 0;
+
+        pthread_mutex_lock(&outbox_lock);
+    }
+    pthread_mutex_unlock(&outbox_lock);
+    return NULL;
+}
+
+void close_connection(void) {
+    pthread_mutex_lock(&outbox_lock);
+    outbox_closed = true;
+    pthread_cond_signal(&outbox_wake);
+    pthread_mutex_unlock(&outbox_lock);
+    pthread_join(t_send, NULL);
+    pthread_join(t_network, NULL);
+    close(server_fd);
+    server_fd = 0;
+    connected = false;
+    accepted = false;
+}
+
 void *network_thread(void *arg) {
     (void)arg;
-    // Read incoming packets and push it to a queue
     while (true) {
-        if (accepted) {
-            net_packet p = {0};
-            if (packet_read(&p, server_fd) < 0) {
-                close(server_fd);
-                connected = false;
-                accepted = false;
-                set_scene(SCENE_MAIN_MENU);
-                break;
-            }
-            // Special case. We want to set the recieve time right now and not wait until we are handling the packet.
-            if (p.type == PKT_PING) {
-                net_packet_ping *ping = (net_packet_ping *)p.content;
-                ping->recieve_time = GetTime() * 1000;
-            }
-            queue_push(&pkt_queue, &p);
+        packet_record *r = packet_ring_reserve();
+        int len = frame_read(r->body, server_fd);
+        // We want the recieve time of pings right now and not once we are handling the packet
+        r->recieve_time = GetTime() * 1000;
+        // The main thread owns the connection state, it learns about the disconnection from an empty record
+        packet_ring_commit(r, len < 0 ? 0 : len);
+        if (len < 0) {
+            break;
         }
     }
     return NULL;
@@ -1861,10 +2313,19 @@ bool join_game(const char *ip, int port, const char *username) {
         LOGL(LL_ERROR, "Could not connect to server");
         return false;
     }
+    // Turn actions are tiny, Nagle would hold them back until the previous write is acknowledged
+    int nodelay = 1;
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
     accepted = true;
+    atomic_store(&packet_ring.head, 0);
+    atomic_store(&packet_ring.tail, 0);
+    outboxes[0].len = 0;
+    outboxes[1].len = 0;
+    outbox_closed = false;
 
     LOG("Connected to server !");
     pthread_create(&t_network, NULL, network_thread, NULL);
+    pthread_create(&t_send, NULL, send_thread, NULL);
 
     reset_game();
     player_join(username);
@@ -2331,15 +2792,7 @@ void update_scene_in_game() {
                 current_spell_animation = NO_ANIMATION;
                 const spell *s = current_animation.spell;
                 LOG("%s is casting %s", current_animation.caster->info.name, s->name);
-                if (s->cast_type == CT_CAST || s->cast_type == CT_CAST_EFFECT) {
-                    bool success = execute_spell(current_animation.caster, s, current_animation.target_cell,
-                                                 current_animation.target);
-                    if (success && s->effect != SE_NONE && current_animation.target != NULL) {
-                        apply_effect(&current_animation.target->info, s);
-                    }
-                } else if (s->cast_type == CT_EFFECT && current_animation.target != NULL) {
-                    apply_effect(&current_animation.target->info, s);
-                }
+                execute_spell(current_animation.caster, s, current_animation.target_cell, current_animation.target);
             }
 
             if (current_spell_animation == NO_ANIMATION && !queue_empty(&spell_animation_queue)) {
@@ -2359,9 +2812,9 @@ void update_scene_in_game() {
             if (current_spell_animation != NO_ANIMATION && anim_finished(current_spell_animation)) {
                 current_spell_animation = NO_ANIMATION;
                 player *player = &players[effect_player_turn];
-                if (player->dead == false) {
-                    const spell *s = current_animation.spell;
-                    execute_spell(player, s, V(player->info.x, player->info.y), player);
+                if (player->dead == false && sim_effect_tick(&player->info, current_animation.spell->effect) > 0) {
+                    player->action_animation = new_animation(AT_ONESHOT, 0.3f, 1);
+                    player->animation_state = PAS_DAMAGE;
                 }
             }
             if (current_spell_animation == NO_ANIMATION && !queue_empty(&spell_animation_queue)) {
@@ -2710,7 +3163,6 @@ int main(int argc, char **argv) {
     init_scene_in_game();
     init_scene_experimentations();
 
-    init_queue(&pkt_queue, sizeof(net_packet));
     init_queue(&map_queue, sizeof(map_node));
     init_queue(&spell_animation_queue, sizeof(animation_request));
 
@@ -2743,9 +3195,24 @@ int main(int argc, char **argv) {
             error_time_remaining -= GetFrameTime();
         }
 
-        net_packet p = {0};
-        if (queue_pop(&pkt_queue, &p)) {
+        double drain_start = GetTime();
+        for (packet_record *r; (r = packet_ring_peek()) != NULL;) {
+            if (r->len == 0) {
+                packet_ring_release(r);
+                close_connection();
+                set_scene(SCENE_MAIN_MENU);
+                break;
+            }
+            net_packet p = {0};
+            unpack_frame(r->body, r->len, &p);
+            if (p.type == PKT_PING) {
+                ((net_packet_ping *)p.content)->recieve_time = r->recieve_time;
+            }
             handle_packet(&p);
+            packet_ring_release(r);
+            if (GetTime() - drain_start > PACKET_DRAIN_BUDGET) {
+                break;
+            }
         }
 
         // Update
@@ -0,0 +1,136 @@
+#include <assert.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+
+// Compiles text maps (maps/NAME.map) to the binary format the loaders map (maps/NAME.mapb).
+// Usage: mapc [--check] [NAME...]
+// Every map of maps/ is compiled when no NAME is given. Maps whose spawn points are inside a wall,
+// shared, or cut from each other are rejected. --check validates the compiled maps and that they
+// are up to date with their text instead of writing them.
+
+// Returns NULL when the spawn points of the map are usable
+const char *check_spawns(const mapb *b) {
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        int cell = b->spawn_positions[i][1] * MAP_WIDTH + b->spawn_positions[i][0];
+        if (b->map[cell] != 0) {
+            return "spawn point inside a wall";
+        }
+        for (int j = 0; j < i; j++) {
+            int other = b->spawn_positions[j][1] * MAP_WIDTH + b->spawn_positions[j][0];
+            if (other == cell) {
+                return "two players share a spawn point";
+            } else if (b->distances[cell][other] < 0) {
+                return "spawn points cannot reach each other";
+            }
+        }
+    }
+    return NULL;
+}
+
+bool compile(const char *name, mapb *out) {
+    map_data map = {0};
+    if (load_map_text(name, &map) == false) {
+        printf("%s: cannot read the text map\n", name);
+        free_map_data(&map);
+        return false;
+    }
+    compile_map(&map, out);
+    free_map_data(&map);
+    const char *error = check_spawns(out);
+    if (error != NULL) {
+        printf("%s: %s\n", name, error);
+        return false;
+    }
+    return true;
+}
+
+bool write_compiled(const char *name) {
+    static mapb compiled;
+    if (compile(name, &compiled) == false) {
+        return false;
+    }
+    // Servers may have the previous file mapped, it is replaced rather than written over
+    char path[256], tmp_path[256];
+    map_file_path(path, name, ".mapb");
+    map_file_path(tmp_path, name, ".mapb.tmp");
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        printf("%s: cannot write %s\n", name, tmp_path);
+        return false;
+    }
+    bool written = fwrite(&compiled, sizeof(compiled), 1, f) == 1;
+    if (fclose(f) != 0 || written == false || rename(tmp_path, path) != 0) {
+        printf("%s: cannot write %s\n", name, path);
+        remove(tmp_path);
+        return false;
+    }
+    printf("%s: compiled to %s (%016" PRIx64 ")\n", name, path, compiled.hash);
+    return true;
+}
+
+bool check_compiled(const char *name) {
+    static mapb expected;
+    char path[256], text_path[256];
+    map_file_path(path, name, ".mapb");
+    map_file_path(text_path, name, ".map");
+    const mapb *b = open_mapb(path);
+    if (b == NULL) {
+        printf("%s: no valid compiled map\n", name);
+        return false;
+    }
+    const char *error = check_spawns(b);
+    if (error == NULL && access(text_path, F_OK) == 0) {
+        if (compile(name, &expected) == false) {
+            error = "the text map is invalid";
+        } else if (memcmp(b, &expected, sizeof(expected)) != 0) {
+            error = "out of date, run mapc again";
+        }
+    }
+    close_mapb(b);
+    if (error != NULL) {
+        printf("%s: %s\n", name, error);
+        return false;
+    }
+    printf("%s: ok\n", name);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool check = false;
+    int failures = 0, count = 0;
+    POPARG(argc, argv);
+    if (argc > 0 && strcmp(argv[0], "--check") == 0) {
+        check = true;
+        POPARG(argc, argv);
+    }
+    set_log_levels("warning,error");
+
+    if (argc > 0) {
+        for (; argc > 0; count++) {
+            const char *name = POPARG(argc, argv);
+            failures += (check ? check_compiled(name) : write_compiled(name)) == false;
+        }
+    } else {
+        DIR *d = opendir("maps");
+        struct dirent *dir;
+        while (d != NULL && (dir = readdir(d)) != NULL) {
+            char *extension = strrchr(dir->d_name, '.');
+            if (dir->d_type != DT_REG || extension == NULL || strcmp(extension, check ? ".mapb" : ".map") != 0) {
+                continue;
+            }
+            *extension = '\0';
+            failures += (check ? check_compiled(dir->d_name) : write_compiled(dir->d_name)) == false;
+            count++;
+        }
+        if (d != NULL) {
+            closedir(d);
+        }
+    }
+    printf("%d maps, %d failed\n", count, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,411 @@
+#include "matchmaking.h"
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Queue
+
+void mm_init(mm_queue *q, uint64_t seed) {
+    memset(q, 0, sizeof(*q));
+    rng_seed(&q->rng, seed);
+}
+
+// Ratings first, the oldest ticket goes first among equal ones
+int mm_compare(const mm_entry *a, const mm_entry *b) {
+    if (a->rating != b->rating) {
+        return a->rating < b->rating ? -1 : 1;
+    }
+    return (a->ticket > b->ticket) - (a->ticket < b->ticket);
+}
+
+mm_entry *mm_insert(mm_entry *node, mm_entry *e) {
+    if (node == NULL) {
+        return e;
+    }
+    if (mm_compare(e, node) < 0) {
+        node->left = mm_insert(node->left, e);
+        if (node->left->priority > node->priority) {
+            mm_entry *top = node->left;
+            node->left = top->right;
+            top->right = node;
+            return top;
+        }
+    } else {
+        node->right = mm_insert(node->right, e);
+        if (node->right->priority > node->priority) {
+            mm_entry *top = node->right;
+            node->right = top->left;
+            top->left = node;
+            return top;
+        }
+    }
+    return node;
+}
+
+// Every entry of a is before the ones of b
+mm_entry *mm_merge(mm_entry *a, mm_entry *b) {
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+    if (a->priority > b->priority) {
+        a->right = mm_merge(a->right, b);
+        return a;
+    }
+    b->left = mm_merge(a, b->left);
+    return b;
+}
+
+mm_entry *mm_erase(mm_entry *node, mm_entry *e) {
+    if (node == NULL) {
+        return NULL;
+    }
+    if (node == e) {
+        return mm_merge(node->left, node->right);
+    }
+    if (mm_compare(e, node) < 0) {
+        node->left = mm_erase(node->left, e);
+    } else {
+        node->right = mm_erase(node->right, e);
+    }
+    return node;
+}
+
+void mm_unlink(mm_entry *e) {
+    mm_list *l = e->list;
+    if (l == NULL) {
+        return;
+    }
+    *(e->prev != NULL ? &e->prev->next : &l->head) = e->next;
+    *(e->next != NULL ? &e->next->prev : &l->tail) = e->prev;
+    e->next = e->prev = NULL;
+    e->list = NULL;
+}
+
+void mm_append(mm_list *l, mm_entry *e) {
+    mm_unlink(e);
+    e->prev = l->tail;
+    e->list = l;
+    *(l->tail != NULL ? &l->tail->next : &l->head) = e;
+    l->tail = e;
+}
+
+// Closest entry before or after e in rating order, e does not have to be queued
+mm_entry *mm_neighbour(const mm_queue *q, const mm_entry *e, bool after) {
+    mm_entry *found = NULL;
+    for (mm_entry *node = q->root; node != NULL;) {
+        int order = mm_compare(node, e);
+        if (after ? order > 0 : order < 0) {
+            found = node;
+            node = after ? node->left : node->right;
+        } else {
+            node = after ? node->right : node->left;
+        }
+    }
+    return found;
+}
+
+int mm_window(const mm_entry *e, uint64_t now_ms) {
+    uint64_t waited_s = now_ms > e->enqueued_ms ? (now_ms - e->enqueued_ms) / 1000 : 0;
+    uint64_t window = MM_BASE_WINDOW + MM_WINDOW_PER_SECOND * waited_s;
+    return window > MM_MAX_WINDOW ? MM_MAX_WINDOW : (int)window;
+}
+
+mm_list *mm_phase(mm_queue *q, const mm_entry *e) {
+    return &q->phases[(e->enqueued_ms % 1000) * MM_PHASE_SLOTS / 1000];
+}
+
+uint64_t mm_push(mm_queue *q, mm_entry *e, int rating, uint64_t now_ms) {
+    *e = (mm_entry){.priority = (uint32_t)rng_next(&q->rng),
+                    .rating = rating,
+                    .ticket = ++q->tickets,
+                    .enqueued_ms = now_ms,
+                    .queued = true};
+    q->root = mm_insert(q->root, e);
+    q->count++;
+    mm_append(&q->dirty, e);
+    return e->ticket;
+}
+
+// The entries around e become neighbours, they may fit together now
+void mm_remove(mm_queue *q, mm_entry *e) {
+    if (e->queued == false) {
+        return;
+    }
+    q->root = mm_erase(q->root, e);
+    e->left = e->right = NULL;
+    e->queued = false;
+    q->count--;
+    mm_unlink(e);
+    mm_entry *before = mm_neighbour(q, e, false), *after = mm_neighbour(q, e, true);
+    if (before != NULL) {
+        mm_append(&q->dirty, before);
+    }
+    if (after != NULL) {
+        mm_append(&q->dirty, after);
+    }
+}
+
+// Groups e with the neighbours whose ratings are the closest, when their windows allow it
+bool mm_match_around(mm_queue *q, mm_entry *e, int group_size, uint64_t now_ms, mm_group_callback callback,
+                     void *ctx) {
+    // The group_size - 1 entries on each side of e, in rating order
+    mm_entry *lower[MAX_PLAYER_COUNT - 1], *run[2 * MAX_PLAYER_COUNT - 1];
+    int before = 0, count = 0;
+    for (mm_entry *n = e; before < group_size - 1 && (n = mm_neighbour(q, n, false)) != NULL;) {
+        lower[before++] = n;
+    }
+    while (count < before) {
+        run[count] = lower[before - 1 - count];
+        count++;
+    }
+    run[count++] = e;
+    for (mm_entry *n = e; count < before + group_size && (n = mm_neighbour(q, n, true)) != NULL;) {
+        run[count++] = n;
+    }
+
+    int best = -1, best_spread = INT_MAX;
+    for (int i = 0; i + group_size <= count; i++) {
+        int window = MM_MAX_WINDOW;
+        for (int j = i; j < i + group_size; j++) {
+            int w = mm_window(run[j], now_ms);
+            window = w < window ? w : window;
+        }
+        int spread = run[i + group_size - 1]->rating - run[i]->rating;
+        if (spread <= window && spread < best_spread) {
+            best = i;
+            best_spread = spread;
+        }
+    }
+    if (best == -1) {
+        return false;
+    }
+    mm_entry **group = &run[best];
+    for (int j = 0; j < group_size; j++) {
+        mm_remove(q, group[j]);
+    }
+    callback(group, group_size, ctx);
+    return true;
+}
+
+int mm_match(mm_queue *q, int group_size, uint64_t now_ms, mm_group_callback callback, void *ctx) {
+    // Every phase slot passed since the last tick, a widening may be right on either end
+    uint64_t first = q->matched_ms * MM_PHASE_SLOTS / 1000, last = now_ms * MM_PHASE_SLOTS / 1000;
+    if (last - first >= MM_PHASE_SLOTS) {
+        first = last - MM_PHASE_SLOTS + 1;
+    }
+    for (uint64_t slot = first; slot <= last; slot++) {
+        mm_entry *next = NULL;
+        for (mm_entry *e = q->phases[slot % MM_PHASE_SLOTS].head; e != NULL; e = next) {
+            next = e->next;
+            if (mm_window(e, now_ms) != e->window) {
+                mm_append(&q->dirty, e);
+            }
+        }
+    }
+    q->matched_ms = now_ms;
+
+    // Taken as a whole, the entries made dirty while matching wait for the next tick
+    mm_list checking = q->dirty;
+    q->dirty = (mm_list){0};
+    for (mm_entry *e = checking.head; e != NULL; e = e->next) {
+        e->list = &checking;
+    }
+    int groups = 0;
+    while (checking.head != NULL) {
+        mm_entry *e = checking.head;
+        mm_unlink(e);
+        e->window = mm_window(e, now_ms);
+        if (e->window < MM_MAX_WINDOW) {
+            mm_append(mm_phase(q, e), e);
+        }
+        if (q->count >= group_size && mm_match_around(q, e, group_size, now_ms, callback, ctx)) {
+            groups++;
+        }
+    }
+    return groups;
+}
+
+// Ratings
+
+typedef struct {
+    char *name;  // NULL for a free slot
+    int rating;
+} rating_entry;
+
+struct rating_store {
+    pthread_mutex_t lock;
+    rating_entry *entries;
+    int capacity;  // Power of two
+    int count;
+    FILE *log;
+};
+
+rating_entry *ratings_slot(rating_store *s, const char *name) {
+    uint64_t h = hash_bytes(0xcbf29ce484222325ull, (const uint8_t *)name, strlen(name));
+    for (int i = 0;; i++) {
+        rating_entry *e = &s->entries[(h + i) & (s->capacity - 1)];
+        if (e->name == NULL || strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+}
+
+bool ratings_set(rating_store *s, const char *name, int rating) {
+    if ((s->count + 1) * 10 > s->capacity * 7) {
+        rating_entry *old = s->entries;
+        int old_capacity = s->capacity;
+        rating_entry *entries = calloc(old_capacity * 2, sizeof(rating_entry));
+        if (entries == NULL) {
+            return false;
+        }
+        s->entries = entries;
+        s->capacity = old_capacity * 2;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].name != NULL) {
+                *ratings_slot(s, old[i].name) = old[i];
+            }
+        }
+        free(old);
+    }
+    rating_entry *e = ratings_slot(s, name);
+    if (e->name == NULL) {
+        e->name = strdup(name);
+        if (e->name == NULL) {
+            return false;
+        }
+        s->count++;
+    }
+    e->rating = rating;
+    return true;
+}
+
+// Rewrites the log with one line per name, then keeps it open to append the next changes
+bool ratings_compact(rating_store *s, const char *path) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        return false;
+    }
+    for (int i = 0; i < s->capacity; i++) {
+        if (s->entries[i].name != NULL) {
+            fprintf(f, "%d %s\n", s->entries[i].rating, s->entries[i].name);
+        }
+    }
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        return false;
+    }
+    s->log = fopen(path, "a");
+    return s->log != NULL;
+}
+
+rating_store *ratings_open(const char *path) {
+    rating_store *s = calloc(1, sizeof(rating_store));
+    if (s == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    s->capacity = 1024;
+    s->entries = calloc(s->capacity, sizeof(rating_entry));
+    if (s->entries == NULL) {
+        ratings_close(s);
+        return NULL;
+    }
+    if (path == NULL) {
+        return s;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        char line[512];
+        int loaded = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char *name = strchr(line, ' ');
+            char *end = strchr(line, '\n');
+            if (name == NULL || end == NULL) {
+                continue;
+            }
+            *name++ = '\0';
+            *end = '\0';
+            int rating = 0;
+            if (strtoint(line, &rating) && *name != '\0' && ratings_set(s, name, rating)) {
+                loaded++;
+            }
+        }
+        fclose(f);
+        LOG("Loaded %d ratings from %s (%d lines)", s->count, path, loaded);
+    }
+    if (ratings_compact(s, path) == false) {
+        LOGL(LL_ERROR, "Could not write ratings to %s", path);
+        ratings_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+void ratings_close(rating_store *s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->log != NULL) {
+        fclose(s->log);
+    }
+    for (int i = 0; i < s->capacity && s->entries != NULL; i++) {
+        free(s->entries[i].name);
+    }
+    free(s->entries);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+int ratings_get(rating_store *s, const char *name) {
+    pthread_mutex_lock(&s->lock);
+    rating_entry *e = ratings_slot(s, name);
+    int rating = e->name != NULL ? e->rating : MM_DEFAULT_RATING;
+    pthread_mutex_unlock(&s->lock);
+    return rating;
+}
+
+void ratings_update(rating_store *s, const char **names, int count, int winner) {
+    if (count < 2) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    int before[MAX_PLAYER_COUNT];
+    double delta[MAX_PLAYER_COUNT] = {0};
+    count = count > MAX_PLAYER_COUNT ? MAX_PLAYER_COUNT : count;
+    for (int i = 0; i < count; i++) {
+        rating_entry *e = ratings_slot(s, names[i]);
+        before[i] = e->name != NULL ? e->rating : MM_DEFAULT_RATING;
+    }
+    // Every pair counts as one game, a free-for-all moves ratings as much as a duel
+    double k = (double)MM_ELO_K / (count - 1);
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            if (winner != -1 && winner != i && winner != j) {
+                continue;
+            }
+            double expected = 1 / (1 + pow(10, (before[j] - before[i]) / 400.0));
+            double score = winner == i ? 1 : winner == j ? 0 : 0.5;
+            delta[i] += k * (score - expected);
+            delta[j] -= k * (score - expected);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int rating = before[i] + (int)lround(delta[i]);
+        // Names with a line break would corrupt the log, they are only rated in memory
+        if (ratings_set(s, names[i], rating) && s->log != NULL && strchr(names[i], '\n') == NULL) {
+            fprintf(s->log, "%d %s\n", rating, names[i]);
+        }
+    }
+    if (s->log != NULL) {
+        fflush(s->log);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
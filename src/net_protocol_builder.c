@@ -6,11 +6,16 @@
 #define STB_C_LEXER_IMPLEMENTATION
 #include "stb_c_lexer.h"
 
+// Bump when the framing or the way fields are packed changes, the structures
+// themselves are already covered by the hash of net_protocol_base.h
+#define WIRE_FORMAT_VERSION 2
+
 typedef enum {
     TYPE_UINT8,
     TYPE_UINT8_PTR,
     TYPE_UINT8_ARRAY,
     TYPE_CHAR_ARRAY,
+    TYPE_UINT32,
     TYPE_UINT64,
     TYPE_STRING,
     TYPE_CUSTOM,
@@ -46,8 +51,8 @@ int get_field_size(struct_field *f) {
         return 0;
     } else if (f->type == TYPE_UINT8_ARRAY) {
         return 0;
-    } else if (f->type == TYPE_UINT64) {
-        return sizeof(uint64_t);
+    } else if (f->type == TYPE_UINT32 || f->type == TYPE_UINT64) {
+        return 0;
     } else if (f->type == TYPE_CUSTOM) {
         for (int i = 0; i < structs_count; i++) {
             if (strcmp(f->name, structs[i].name) == 0) {
@@ -191,10 +196,16 @@ void parse_struct(stb_lexer *l) {
                 expect_next_token(l, CLEX_id);
                 expect_next_token_char(l, ']');
             }
-        } else if (strcmp(l->string, "uint64_t") == 0) {
-            f->type = TYPE_UINT64;
+        } else if (strcmp(l->string, "uint32_t") == 0 || strcmp(l->string, "uint64_t") == 0) {
+            // Integers are sent as varints
+            f->type = strcmp(l->string, "uint32_t") == 0 ? TYPE_UINT32 : TYPE_UINT64;
             expect_next_token(l, CLEX_id);
             f->name = strdup(l->string);
+            s->variable_size = 1;
+            f->size = calloc(100, 1);
+            strcat((char *)f->size, "varint_size(s->");
+            strcat((char *)f->size, f->name);
+            strcat((char *)f->size, ")");
         } else {
             int exists = 0;
             for (int i = 0; i < structs_count; i++) {
@@ -243,7 +254,7 @@ void parse_struct(stb_lexer *l) {
         s->field_count++;
     }
     expect_next_token(l, CLEX_id);
-    if (strcmp(l->string, "net_packet") == 0 || strcmp(l->string, "network_string") == 0) {
+    if (strcmp(l->string, "net_packet") == 0) {
         fprintf(stderr, "skipping %s\n", l->string);
         s->field_count = 0;
         return;
@@ -273,6 +284,12 @@ int main(void) {
 
     string[fsize] = 0;
 
+    // FNV-1a of the protocol description, peers built from different ones can't talk to each other
+    uint32_t protocol_version = 2166136261u ^ WIRE_FORMAT_VERSION;
+    for (long i = 0; i < fsize; i++) {
+        protocol_version = (protocol_version ^ (uint8_t)string[i]) * 16777619u;
+    }
+
     stb_c_lexer_init(&l, string, string + fsize, store, 2048);
     stb_c_lexer_get_token(&l);
     while (l.token != CLEX_eof) {
@@ -288,6 +305,7 @@ int main(void) {
     printf("// This file was auto-generated by %s\n", __FILE__);
 
     printf("%s\n", string);
+    printf("#define NET_PROTOCOL_VERSION 0x%08xu\n", protocol_version);
 
     // Enum
     printf("typedef enum {\n");
@@ -312,6 +330,8 @@ int main(void) {
                 printf("uint8_t *%s", f->name);
             } else if (f->type == TYPE_CHAR_ARRAY) {
                 printf("const char *%s", f->name);
+            } else if (f->type == TYPE_UINT32) {
+                printf("uint32_t %s", f->name);
             } else if (f->type == TYPE_UINT64) {
                 printf("uint64_t %s", f->name);
             } else if (f->type == TYPE_CUSTOM) {
@@ -331,6 +351,7 @@ int main(void) {
     }
 
     printf("#ifdef NET_PROTOCOL_IMPLEMENTATION\n");
+    printf("int varint_size(uint64_t u);\n");
 
     // Size
     printf("uint64_t get_packet_length(net_packet_type_enum type, void *p) {\n");
@@ -372,6 +393,8 @@ int main(void) {
                 printf("uint8_t *%s", f->name);
             } else if (f->type == TYPE_CHAR_ARRAY) {
                 printf("const char *%s", f->name);
+            } else if (f->type == TYPE_UINT32) {
+                printf("uint32_t %s", f->name);
             } else if (f->type == TYPE_UINT64) {
                 printf("uint64_t %s", f->name);
             } else if (f->type == TYPE_CUSTOM) {
@@ -399,7 +422,7 @@ int main(void) {
             } else if (f->type == TYPE_CHAR_ARRAY) {
                 // TODO: Use strcpy ?
                 printf("    memcpy(s.%s, %s, %d);\n", f->name, f->name, f->array_size);
-            } else if (f->type == TYPE_UINT64) {
+            } else if (f->type == TYPE_UINT32 || f->type == TYPE_UINT64) {
                 printf("    s.%s = %s;\n", f->name, f->name);
             } else if (f->type == TYPE_CUSTOM) {
                 printf("    for (int i = 0; i < %s; i++) {\n", f->array_size_str);
@@ -407,7 +430,7 @@ int main(void) {
                 printf("    }\n");
             } else if (f->type == TYPE_STRING) {
                 printf("    s.%s.len = strlen(%s);\n", f->name, f->name);
-                printf("    memcpy(s.%s.str, %s, s.%s.len);\n", f->name, f->name, f->name);
+                printf("    s.%s.str = %s;\n", f->name, f->name);
             } else {
                 fprintf(stderr, "Unknown type for %s\n", f->name);
                 exit(1);
@@ -422,8 +445,10 @@ int main(void) {
     }
 
     printf("char *packu8(char *buf, uint8_t u);\n");
+    printf("char *packu32(char *buf, uint32_t u);\n");
     printf("char *packu64(char *buf, uint64_t u);\n");
-    printf("char *packsv(char *buf, char *str, int len);\n");
+    printf("char *packsv(char *buf, const char *str, int len);\n");
+    printf("char *packvarint(char *buf, uint64_t u);\n");
 
     printf("char *packstruct(char *buf, void *content, net_packet_type_enum type) {\n");
     printf("    switch (type) {\n");
@@ -446,8 +471,8 @@ int main(void) {
                     printf("            for (int i = 0; i < %s; i++) {\n", f->size);
                     printf("                buf = packu8(buf, s->%s[i]);\n", f->name);
                     printf("            }\n");
-                } else if (f->type == TYPE_UINT64) {
-                    printf("            buf = packu64(buf, s->%s);\n", f->name);
+                } else if (f->type == TYPE_UINT32 || f->type == TYPE_UINT64) {
+                    printf("            buf = packvarint(buf, s->%s);\n", f->name);
                 } else if (f->type == TYPE_CUSTOM) {
                     if (f->array_size_str != NULL) {
                         printf("            for (int i = 0; i < %s; i++) {\n", f->array_size_str);
@@ -475,8 +500,10 @@ int main(void) {
     printf("}\n");
 
     printf("uint8_t unpacku8(uint8_t **buf);\n");
+    printf("uint32_t unpacku32(uint8_t **buf);\n");
     printf("uint64_t unpacku64(uint8_t **buf);\n");
     printf("void unpacksv(uint8_t **buf, char *dest, uint8_t len);\n");
+    printf("uint64_t unpackvarint(uint8_t **buf);\n");
 
     printf("void *unpackstruct(net_packet_type_enum type, uint8_t *buf, uint8_t *out) {\n");
     printf("    uint8_t **base = &buf;\n");
@@ -504,8 +531,8 @@ int main(void) {
                     printf("            for (int i = 0; i < %s; i++) {\n", f->size);
                     printf("                s->%s[i] = unpacku8(base);\n", f->name);
                     printf("            }\n");
-                } else if (f->type == TYPE_UINT64) {
-                    printf("            s->%s = unpacku64(base);\n", f->name);
+                } else if (f->type == TYPE_UINT32 || f->type == TYPE_UINT64) {
+                    printf("            s->%s = unpackvarint(base);\n", f->name);
                 } else if (f->type == TYPE_CUSTOM) {
                     if (f->array_size_str != NULL) {
                         printf("            for (int i = 0; i < %s; i++) {\n", f->array_size_str);
@@ -517,8 +544,10 @@ int main(void) {
                         exit(1);
                     }
                 } else if (f->type == TYPE_STRING) {
+                    // Points inside the frame, which has to outlive the packet
                     printf("            s->%s.len = unpacku8(base);\n", f->name);
-                    printf("            unpacksv(base, s->%s.str, s->%s.len);\n", f->name, f->name);
+                    printf("            s->%s.str = (const char *)*base;\n", f->name);
+                    printf("            *base += s->%s.len;\n", f->name);
                 } else {
                     fprintf(stderr, "Unknown type to unpack %s\n", f->name);
                     exit(1);
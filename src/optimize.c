@@ -0,0 +1,577 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ai.h"
+#include "common.h"
+
+// Genetic search over builds, scored by headless 1v1 matches played with the server's turn rules.
+// Usage: optimize [--population 64] [--generations 100] [--matches 200] [--threads N] [--seed S]
+//                 [--max-turns 200] [--map default] [--spells spells/default.spells] [--cache-bits 20]
+//                 [--top 10] [--save best.build]
+// Every build of a generation plays --matches matches against every other one, results are cached
+// per pair of builds so the ones surviving several generations are never replayed.
+// Ends with the best builds of the last generation and how each spell did in every build evaluated.
+
+extern const spell all_spells[];
+extern const int spell_count;
+
+#define MAX_THREADS 256
+#define MAX_POPULATION 1024
+#define CACHE_PROBES 8
+// Limits of the build menu, sliders move by STAT_STEP and the speed one goes both ways
+#define STAT_STEP 10
+#define STAT_POINTS 200
+#define HEALTH_SLIDER_MAX 100
+#define STRENGTH_SLIDER_MAX 100
+#define SPEED_SLIDER_MAX 30
+// Win rate gap between builds with and without a spell that gets it flagged
+#define TUNING_THRESHOLD 0.05
+
+typedef struct {
+    uint8_t spells[MAX_SPELL_COUNT];  // Sorted, as the build menu saves them
+    int health, strength, speed;      // Slider values, the base stats are 50 + health, strength and 100 + speed
+    uint64_t key;
+    double fitness;  // Score against the rest of its generation, a tie counts half
+} build;
+
+// Matches between two builds, wins_a belongs to the build with the key a
+typedef struct {
+    uint64_t a, b;
+    uint32_t wins_a, wins_b;
+    uint32_t matches;  // 0 for an empty cache slot
+} pair_result;
+
+typedef struct {
+    pair_result result;
+    const build *a, *b;
+} pair_task;
+
+typedef struct {
+    pthread_t handle;
+    uint64_t turns;
+} eval_thread;
+
+int matches_per_pair = 200;
+int max_turns = 200;
+uint64_t run_seed = 0;
+uint8_t spawns[2][2] = {{0, 0}, {MAP_WIDTH - 1, MAP_HEIGHT - 1}};
+
+pair_result *cache = NULL;
+int cache_bits = 20;
+
+pair_task *tasks = NULL;
+int task_count = 0;
+atomic_int next_task = 0;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Builds
+
+int stat_points(int health, int strength, int speed) {
+    return health + strength + abs(speed);
+}
+
+bool legal_sliders(int health, int strength, int speed) {
+    return health >= 0 && health <= HEALTH_SLIDER_MAX && strength >= 0 && strength <= STRENGTH_SLIDER_MAX &&
+           abs(speed) <= SPEED_SLIDER_MAX && stat_points(health, strength, speed) <= STAT_POINTS;
+}
+
+int compare_spells(const void *a, const void *b) {
+    return *(const uint8_t *)a - *(const uint8_t *)b;
+}
+
+void finish_build(build *b) {
+    qsort(b->spells, MAX_SPELL_COUNT, 1, compare_spells);
+    int8_t sliders[3] = {b->health, b->strength, b->speed};
+    b->key = hash_bytes(0xcbf29ce484222325ull, b->spells, MAX_SPELL_COUNT);
+    b->key = hash_bytes(b->key, (const uint8_t *)sliders, sizeof(sliders));
+    b->fitness = 0;
+}
+
+bool has_spell(const build *b, uint8_t spell) {
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        if (b->spells[i] == spell) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int random_slider(rng *r, int max) {
+    return rng_range(r, max / STAT_STEP + 1) * STAT_STEP;
+}
+
+void random_build(rng *r, build *b) {
+    uint8_t pool[256];
+    for (int i = 0; i < spell_count; i++) {
+        pool[i] = i;
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        int j = i + rng_range(r, spell_count - i);
+        uint8_t tmp = pool[i];
+        pool[i] = pool[j];
+        pool[j] = tmp;
+        b->spells[i] = pool[i];
+    }
+    do {
+        b->health = random_slider(r, HEALTH_SLIDER_MAX);
+        b->strength = random_slider(r, STRENGTH_SLIDER_MAX);
+        b->speed = random_slider(r, 2 * SPEED_SLIDER_MAX) - SPEED_SLIDER_MAX;
+    } while (legal_sliders(b->health, b->strength, b->speed) == false);
+    finish_build(b);
+}
+
+// Swaps a spell for one the build does not have, or moves a slider by one step
+void mutate(rng *r, build *b) {
+    if (rng_range(r, 2) == 0 && spell_count > MAX_SPELL_COUNT) {
+        uint8_t spell;
+        do {
+            spell = rng_range(r, spell_count);
+        } while (has_spell(b, spell));
+        b->spells[rng_range(r, MAX_SPELL_COUNT)] = spell;
+        return;
+    }
+    while (1) {
+        int *slider = rng_range(r, 3) == 0 ? &b->health : rng_range(r, 2) == 0 ? &b->strength : &b->speed;
+        int step = rng_range(r, 2) == 0 ? -STAT_STEP : STAT_STEP;
+        *slider += step;
+        if (legal_sliders(b->health, b->strength, b->speed)) {
+            return;
+        }
+        *slider -= step;
+    }
+}
+
+// Spells are drawn from both parents, each slider comes from one of them
+void crossover(rng *r, const build *a, const build *b, build *child) {
+    uint8_t pool[2 * MAX_SPELL_COUNT];
+    int count = 0;
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        pool[count++] = a->spells[i];
+        if (has_spell(a, b->spells[i]) == false) {
+            pool[count++] = b->spells[i];
+        }
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        int j = i + rng_range(r, count - i);
+        uint8_t tmp = pool[i];
+        pool[i] = pool[j];
+        pool[j] = tmp;
+        child->spells[i] = pool[i];
+    }
+    child->health = rng_range(r, 2) == 0 ? a->health : b->health;
+    child->strength = rng_range(r, 2) == 0 ? a->strength : b->strength;
+    child->speed = rng_range(r, 2) == 0 ? a->speed : b->speed;
+    // Over budget, points are taken back one step at a time
+    while (legal_sliders(child->health, child->strength, child->speed) == false) {
+        int *slider = rng_range(r, 3) == 0 ? &child->health : rng_range(r, 2) == 0 ? &child->strength : &child->speed;
+        if (*slider > 0) {
+            *slider -= STAT_STEP;
+        } else if (*slider < 0) {
+            *slider += STAT_STEP;
+        }
+    }
+}
+
+// Same layout as the builds saved by the game, so the result can be loaded from the build menu
+bool save_build(const char *filepath, const build *b) {
+    uint8_t buf[2 + MAX_SPELL_COUNT + STAT_COUNT + 9 + 1] = {0};
+    buf[0] = MAX_SPELL_COUNT;
+    buf[1] = STAT_COUNT;
+    memcpy(buf + 2, b->spells, MAX_SPELL_COUNT);
+    buf[3 + MAX_SPELL_COUNT] = (uint8_t)b->health;
+    buf[4 + MAX_SPELL_COUNT] = (uint8_t)b->strength;
+    buf[5 + MAX_SPELL_COUNT] = (uint8_t)b->speed;
+    FILE *f = fopen(filepath, "wb");
+    if (f == NULL) {
+        return false;
+    }
+    bool written = fwrite(buf, 1, sizeof(buf), f) == sizeof(buf);
+    return fclose(f) == 0 && written;
+}
+
+// Pair cache, an open addressing table where a full probe sequence evicts its first slot
+
+pair_result *cache_slot(uint64_t a, uint64_t b, bool *found) {
+    uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ull)) >> (64 - cache_bits);
+    pair_result *empty = NULL;
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        pair_result *slot = &cache[(h + i) & ((1u << cache_bits) - 1)];
+        if (slot->matches == (uint32_t)matches_per_pair && slot->a == a && slot->b == b) {
+            *found = true;
+            return slot;
+        }
+        if (empty == NULL && slot->matches == 0) {
+            empty = slot;
+        }
+    }
+    *found = false;
+    return empty != NULL ? empty : &cache[h];
+}
+
+// Matches
+
+void setup_player(player_info *p, const build *b, int id) {
+    memset(p, 0, sizeof(*p));
+    p->id = id;
+    p->connected = true;
+    memcpy(p->spells, b->spells, MAX_SPELL_COUNT);
+    p->stats[STAT_HEALTH].base = 50 + b->health;
+    p->stats[STAT_STRENGTH].base = b->strength;
+    p->stats[STAT_SPEED].base = 100 + b->speed;
+    sim_reset_player(p, spawns[id][0], spawns[id][1]);
+}
+
+// The seed only depends on the pair so a result does not depend on the thread that played it
+uint64_t play_pair(pair_task *t) {
+    rng r;
+    rng_seed(&r, run_seed ^ t->result.a ^ (t->result.b * 0x9e3779b97f4a7c15ull));
+    sim_state s;
+    sim_action actions[MAX_PLAYER_COUNT] = {0};
+    uint64_t turns = 0;
+    for (int m = 0; m < matches_per_pair; m++) {
+        // Sides swap every match so neither build keeps the better spawn
+        bool a_first = m % 2 == 0;
+        memset(&s, 0, sizeof(s));
+        setup_player(&s.players[0], a_first ? t->a : t->b, 0);
+        setup_player(&s.players[1], a_first ? t->b : t->a, 1);
+        turn_outcome outcome = TO_CONTINUE;
+        uint8_t winner_id = GAME_TIE;
+        for (int turn = 0; turn < max_turns && outcome == TO_CONTINUE; turn++) {
+            actions[0] = ai_random_action(&s, &r, 0);
+            actions[1] = ai_random_action(&s, &r, 1);
+            outcome = sim_step(&s, actions, &r, &winner_id);
+            turns++;
+        }
+        if (outcome == TO_CONTINUE || winner_id == GAME_TIE) {
+            continue;
+        }
+        if ((winner_id == 0) == a_first) {
+            t->result.wins_a++;
+        } else {
+            t->result.wins_b++;
+        }
+    }
+    t->result.matches = matches_per_pair;
+    return turns;
+}
+
+void *run_pairs(void *arg) {
+    eval_thread *t = arg;
+    int i;
+    while ((i = atomic_fetch_add(&next_task, 1)) < task_count) {
+        t->turns += play_pair(&tasks[i]);
+    }
+    return NULL;
+}
+
+// Score of a against b, from a pair result in either order
+double pair_score(const pair_result *p, uint64_t a) {
+    double wins = p->a == a ? p->wins_a : p->wins_b;
+    double ties = p->matches - p->wins_a - p->wins_b;
+    return (wins + ties / 2) / p->matches;
+}
+
+// Plays every pair of the population missing from the cache and sets the fitness of each build.
+// Returns the number of turns played.
+uint64_t evaluate_population(build *population, int size, int thread_count, int *played, int *cached) {
+    double *scores = calloc(size * size, sizeof(double));
+    task_count = 0;
+    *cached = 0;
+    for (int i = 0; i < size; i++) {
+        for (int j = i + 1; j < size; j++) {
+            const build *a = &population[i], *b = &population[j];
+            if (a->key > b->key) {
+                const build *tmp = a;
+                a = b;
+                b = tmp;
+            }
+            bool found = false;
+            pair_result *slot = cache_slot(a->key, b->key, &found);
+            if (found) {
+                scores[i * size + j] = pair_score(slot, population[i].key);
+                scores[j * size + i] = pair_score(slot, population[j].key);
+                (*cached)++;
+                continue;
+            }
+            tasks[task_count++] = (pair_task){.result = {.a = a->key, .b = b->key}, .a = a, .b = b};
+        }
+    }
+
+    eval_thread threads[MAX_THREADS] = {0};
+    thread_count = thread_count > task_count ? task_count : thread_count;
+    atomic_store(&next_task, 0);
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i].handle, NULL, run_pairs, &threads[i]);
+    }
+    uint64_t turns = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i].handle, NULL);
+        turns += threads[i].turns;
+    }
+
+    for (int t = 0; t < task_count; t++) {
+        pair_result *p = &tasks[t].result;
+        bool found = false;
+        *cache_slot(p->a, p->b, &found) = *p;
+        int i = tasks[t].a - population, j = tasks[t].b - population;
+        scores[i * size + j] = pair_score(p, population[i].key);
+        scores[j * size + i] = pair_score(p, population[j].key);
+    }
+    for (int i = 0; i < size; i++) {
+        double total = 0;
+        for (int j = 0; j < size; j++) {
+            total += scores[i * size + j];
+        }
+        population[i].fitness = size > 1 ? total / (size - 1) : 0;
+    }
+    free(scores);
+    *played = task_count;
+    return turns;
+}
+
+int compare_fitness(const void *a, const void *b) {
+    double x = ((const build *)a)->fitness, y = ((const build *)b)->fitness;
+    return (x < y) - (x > y);
+}
+
+bool in_population(const build *population, int size, uint64_t key) {
+    for (int i = 0; i < size; i++) {
+        if (population[i].key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The population must be sorted by fitness, the best of three random builds wins
+const build *tournament(rng *r, const build *population, int size) {
+    int best = rng_range(r, size);
+    for (int i = 0; i < 2; i++) {
+        int other = rng_range(r, size);
+        best = other < best ? other : best;
+    }
+    return &population[best];
+}
+
+// The best quarter survives, the rest is replaced by children of tournament winners
+void breed(rng *r, build *population, int size) {
+    int elite = size / 4 > 0 ? size / 4 : 1;
+    build *next = malloc(size * sizeof(build));
+    memcpy(next, population, elite * sizeof(build));
+    for (int i = elite; i < size; i++) {
+        build *child = &next[i];
+        crossover(r, tournament(r, population, size), tournament(r, population, size), child);
+        mutate(r, child);
+        finish_build(child);
+        // Twins would only play themselves, they mutate until they are new
+        for (int attempt = 0; attempt < 16 && in_population(next, i, child->key); attempt++) {
+            mutate(r, child);
+            finish_build(child);
+        }
+    }
+    memcpy(population, next, size * sizeof(build));
+    free(next);
+}
+
+// Report
+
+typedef struct {
+    double with_sum;  // Fitness of every evaluated build having the spell
+    int with_count;
+} spell_record;
+
+void print_build(int rank, const build *b) {
+    printf("#%-3d %5.1f%%  health %3d, strength %3d, speed %3d :", rank, 100 * b->fitness, 50 + b->health, b->strength,
+           100 + b->speed);
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        printf(" %s%s", all_spells[b->spells[i]].name, i < MAX_SPELL_COUNT - 1 ? "," : "\n");
+    }
+}
+
+// Compares builds with and without each spell over every generation, the gap hints at its balance
+void print_spell_report(const spell_record *records, double total_sum, int total_count, const build *population,
+                        int size) {
+    int order[256];
+    double gaps[256];
+    for (int s = 0; s < spell_count; s++) {
+        const spell_record *rec = &records[s];
+        int without_count = total_count - rec->with_count;
+        // Spells in every build or in none can't be compared, they go last
+        gaps[s] = -INFINITY;
+        if (rec->with_count > 0 && without_count > 0) {
+            gaps[s] = rec->with_sum / rec->with_count - (total_sum - rec->with_sum) / without_count;
+        }
+        order[s] = s;
+    }
+    // Insertion sort, largest gap first
+    for (int i = 1; i < spell_count; i++) {
+        int s = order[i], j = i;
+        while (j > 0 && gaps[order[j - 1]] < gaps[s]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = s;
+    }
+
+    printf("\n%-14s %9s %9s %9s %8s %8s\n", "spell", "picked", "with", "without", "gap", "");
+    for (int i = 0; i < spell_count; i++) {
+        int s = order[i];
+        const spell_record *rec = &records[s];
+        int picked = 0;
+        for (int j = 0; j < size; j++) {
+            picked += has_spell(&population[j], s);
+        }
+        int without_count = total_count - rec->with_count;
+        const char *verdict = isinf(gaps[s])               ? "untested"
+                              : gaps[s] >= TUNING_THRESHOLD  ? "over-tuned"
+                              : gaps[s] <= -TUNING_THRESHOLD ? "under-tuned"
+                                                             : "";
+        printf("%-14s %8.1f%% %8.1f%% %8.1f%% %+7.1f %s\n", all_spells[s].name, 100.0 * picked / size,
+               rec->with_count > 0 ? 100 * rec->with_sum / rec->with_count : 0,
+               without_count > 0 ? 100 * (total_sum - rec->with_sum) / without_count : 0,
+               isinf(gaps[s]) ? 0 : 100 * gaps[s], verdict);
+    }
+}
+
+// Main
+
+int parse_int(const char *arg, const char *value, int min, int max) {
+    int out = 0;
+    if (value == NULL || !strtoint(value, &out) || out < min || out > max) {
+        LOG("Invalid value for %s '%s', expected %d to %d", arg, value == NULL ? "" : value, min, max);
+        exit(1);
+    }
+    return out;
+}
+
+int main(int argc, char **argv) {
+    int population_size = 64;
+    int generations = 100;
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int top = 10;
+    const char *spells_path = "spells/default.spells";
+    const char *save_path = NULL;
+    run_seed = time(NULL);
+    POPARG(argc, argv);
+    while (argc > 0) {
+        const char *arg = POPARG(argc, argv);
+        const char *value = argc > 0 ? POPARG(argc, argv) : NULL;
+        if (strcmp(arg, "--population") == 0) {
+            population_size = parse_int(arg, value, 2, MAX_POPULATION);
+        } else if (strcmp(arg, "--generations") == 0) {
+            generations = parse_int(arg, value, 1, INT_MAX);
+        } else if (strcmp(arg, "--matches") == 0) {
+            matches_per_pair = parse_int(arg, value, 1, INT_MAX);
+        } else if (strcmp(arg, "--threads") == 0) {
+            thread_count = parse_int(arg, value, 1, MAX_THREADS);
+        } else if (strcmp(arg, "--seed") == 0) {
+            run_seed = parse_int(arg, value, 0, INT_MAX);
+        } else if (strcmp(arg, "--max-turns") == 0) {
+            max_turns = parse_int(arg, value, 1, INT_MAX);
+        } else if (strcmp(arg, "--cache-bits") == 0) {
+            cache_bits = parse_int(arg, value, 8, 30);
+        } else if (strcmp(arg, "--top") == 0) {
+            top = parse_int(arg, value, 1, MAX_POPULATION);
+        } else if (strcmp(arg, "--map") == 0 && value != NULL) {
+            map_data map = {0};
+            if (load_map(value, &map) == false) {
+                LOG("Could not load map '%s'", value);
+                exit(1);
+            }
+            memcpy(spawns, map.spawn_positions, sizeof(spawns));
+            free_map_data(&map);
+        } else if (strcmp(arg, "--spells") == 0 && value != NULL) {
+            spells_path = value;
+        } else if (strcmp(arg, "--save") == 0 && value != NULL) {
+            save_path = value;
+        } else {
+            LOG("Unknown arg : '%s'", arg);
+            exit(1);
+        }
+    }
+    if (load_spell_programs(spells_path) == false) {
+        LOG("Could not load spell programs from '%s'", spells_path);
+        exit(1);
+    }
+    if (spell_count < MAX_SPELL_COUNT) {
+        LOG("A build needs %d spells, only %d exist", MAX_SPELL_COUNT, spell_count);
+        exit(1);
+    }
+
+    cache = calloc(1u << cache_bits, sizeof(pair_result));
+    tasks = malloc((size_t)population_size * (population_size - 1) / 2 * sizeof(pair_task));
+    build *population = malloc(population_size * sizeof(build));
+    if (cache == NULL || tasks == NULL || population == NULL) {
+        LOG("Could not allocate %d builds and a cache of %d pairs", population_size, 1 << cache_bits);
+        exit(1);
+    }
+    spell_record records[256] = {0};
+    double total_sum = 0;
+    int total_count = 0;
+
+    rng r;
+    rng_seed(&r, run_seed);
+    for (int i = 0; i < population_size; i++) {
+        random_build(&r, &population[i]);
+    }
+    printf("%d builds, %d generations, %d matches per pair on %d threads (seed %" PRIu64 ")\n", population_size,
+           generations, matches_per_pair, thread_count, run_seed);
+
+    uint64_t start = now_ns();
+    uint64_t total_turns = 0, total_matches = 0;
+    for (int g = 0; g < generations; g++) {
+        uint64_t generation_start = now_ns();
+        int played = 0, cached = 0;
+        total_turns += evaluate_population(population, population_size, thread_count, &played, &cached);
+        total_matches += (uint64_t)played * matches_per_pair;
+        qsort(population, population_size, sizeof(build), compare_fitness);
+
+        double average = 0;
+        for (int i = 0; i < population_size; i++) {
+            const build *b = &population[i];
+            average += b->fitness / population_size;
+            total_sum += b->fitness;
+            total_count++;
+            for (int j = 0; j < MAX_SPELL_COUNT; j++) {
+                records[b->spells[j]].with_sum += b->fitness;
+                records[b->spells[j]].with_count++;
+            }
+        }
+        printf("generation %d: best %.1f%%, average %.1f%%, %d pairs played, %d cached, %.2fs\n", g,
+               100 * population[0].fitness, 100 * average, played, cached, (now_ns() - generation_start) / 1e9);
+        fflush(stdout);
+        if (g < generations - 1) {
+            breed(&r, population, population_size);
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    printf("\n%" PRIu64 " matches, %" PRIu64 " turns in %.2fs (%.0f matches/s)\n", total_matches, total_turns,
+           seconds, total_matches / seconds);
+
+    printf("\nBest builds of the last generation, win rate against the others:\n");
+    for (int i = 0; i < top && i < population_size; i++) {
+        print_build(i + 1, &population[i]);
+    }
+    print_spell_report(records, total_sum, total_count, population, population_size);
+
+    if (save_path != NULL) {
+        if (save_build(save_path, &population[0]) == false) {
+            LOG("Could not save the best build to '%s'", save_path);
+            exit(1);
+        }
+        printf("\nBest build saved to %s\n", save_path);
+    }
+    return 0;
+}
@@ -1,49 +1,301 @@
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
+#include "ai.h"
 #include "common.h"
+#include "matchmaking.h"
 #include "net.h"
 #include "net_protocol.h"
+#include "version.h"
 
 void handle_player_disconnect(int fd);
 
-#define FOREACH_PLAYER(P)                                                              \
-    for (int iterator = 0; iterator < MAX_PLAYER_COUNT; iterator++)                    \
-        for (player_info *P = &players[iterator]; P != NULL && P->connected; P = NULL) \
+#define FOREACH_PLAYER(R, P)                                                              \
+    for (int iterator = 0; iterator < MAX_PLAYER_COUNT; iterator++)                       \
+        for (player_info *P = &(R)->game.players[iterator]; P != NULL && P->connected; P = NULL) \
             if (1)
 
 #define NSTR(STRUCT) STRUCT.len, STRUCT.str
 
 extern const spell all_spells[];
 
+#define MAX_EPOLL_EVENTS 64
+#define DEFAULT_MAX_ROOMS 1024
+// Room ids embed the pool slot in their low bits so lookups are O(1)
+#define ROOM_SLOT_BITS 16
+#define MAX_ROOMS (1 << ROOM_SLOT_BITS)
+#define MAX_WORKERS 256
+#define HANDOFF_QUEUE_SIZE 4096
+// Turns waiting for an AI thread, a full queue makes the AI play at random
+#define AI_QUEUE_SIZE 256
+
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define STATS_INTERVAL_MS 1000
+#define DEFAULT_TURN_TIME_MS 60000
+// Idle connections get a PKT_HEARTBEAT, the ones silent for too long are closed
+#define HEARTBEAT_INTERVAL_MS 5000
+#define DEAD_PEER_MS 20000
+// A full player state is sent after this many deltas
+#define KEYFRAME_INTERVAL 16
+#define MATCHMAKING_TICK_MS 250
+#define MAX_RELAYS 64
+// Items waiting for a relay, frames of spectated rooms are dropped past it
+#define RELAY_QUEUE_MAX (1 << 16)
+#define RELAY_NICE 10
+
+struct worker;
+
+struct timer;
+typedef void (*timer_callback)(struct timer *t);
+
+// Embedded in what it belongs to, TIMER_OWNER gets it back in the callback
+typedef struct timer {
+    struct timer *next;
+    struct timer **prev;  // What points to this timer, NULL when it is not armed
+    uint64_t expires;     // In ticks
+    timer_callback callback;
+} timer;
+
+#define TIMER_OWNER(T, TYPE, MEMBER) ((TYPE *)((char *)(T) - offsetof(TYPE, MEMBER)))
+
+// Hierarchical timing wheel: a level l slot spans TIMER_WHEEL_SIZE^l ticks and
+// its timers move down a level when the wheel reaches it
+typedef struct {
+    timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+    uint64_t now;  // Last tick processed
+    int count;
+} timer_wheel;
+
+// Everything that belongs to a single lobby/match
+typedef struct {
+    uint32_t id;
+    bool active;
+    atomic_bool in_game;
+    bool matched;  // Made for a matchmaking group, nobody else can join it
+    bool spectated;  // Its broadcasts are copied to its relay, set by the owner once a spectator came
+    // Only this worker touches the game state, so the room itself needs no lock
+    struct worker *owner;
+    // Players inside the room plus the ones on their way to it, guarded by rooms_lock
+    int seats;
+
+    // Players
+    int clients[MAX_PLAYER_COUNT];
+    sim_state game;
+    bool player_ready[MAX_PLAYER_COUNT];
+    bool ai_player[MAX_PLAYER_COUNT];  // Slots filled by the server, their client is -1
+    int master_player;
+
+    // Game logic
+    game_state gs;
+    sim_action actions[MAX_PLAYER_COUNT];  // Of the turn being played
+    rng rng;
+    uint32_t turn_serial;  // Bumped whenever a turn starts or ends, AI actions of an older one are dropped
+    uint8_t round_scores[MAX_PLAYER_COUNT];
+    uint64_t round_start_ms;
+    uint8_t max_round_count;
+
+    // Map
+    map_data current_map;
+    int selected_map_idx;
+    uint64_t map_hash;
+    net_frame *map_frames[2];  // PKT_MAP of each layer, encoded once when the map is loaded
+
+    // Last state of each player sent to the room. Every client inside got the same
+    // ones in the same order, so the next states only need the bytes that changed
+    uint8_t sent_states[MAX_PLAYER_COUNT][NET_PLAYER_STATE_MAX_SIZE];
+    bool sent_state_valid[MAX_PLAYER_COUNT];
+    int deltas_since_keyframe[MAX_PLAYER_COUNT];
+
+    // Run by the owner's timer wheel
+    timer stats_timer;
+    timer turn_deadline;  // Plays for the players who did not send their action in time
+} room;
+
 // Server management
-fd_set master_set, read_fds;
-int connections[MAX_PLAYER_COUNT] = {0};
-int connection_count = 0;
+typedef struct {
+    bool active;
+    bool joined;  // The connection sent a valid PKT_JOIN
+    char username[256];
+    room *room;
+    int player_id;  // -1 while the connection is not inside a room
+    recv_buffer *in;
+    send_queue *out;
+    bool dirty;     // Has frames waiting for the end of the current batch
+    bool overflow;  // Stopped reading long enough to fill its queue, closed on the next flush
+    uint64_t last_seen;  // Tick of the last read
+    timer heartbeat;
+    struct worker *owner;  // NULL once handed to a relay
+    mm_entry queue_entry;  // Guarded by matchmaking_lock
+    uint32_t spectating;   // Room watched through a relay, 0 for players
+} connection;
+
+// A connection changing worker, it joins the given room once adopted
+typedef struct {
+    int fd;
+    uint32_t room_id;  // 0 when the connection is not going to a room
+    bool matchmake;    // Waiting for a new room, but any lobby with space that showed up meanwhile will do
+    uint64_t ticket;   // Not 0 when a connection of this worker got matched into room_id
+    bool spectate;     // Going to watch room_id, the owner sends it to the relay with a snapshot
+} handoff;
+
+typedef struct {
+    handoff items[HANDOFF_QUEUE_SIZE];
+    int start;
+    int count;
+} handoff_queue;
+
+// Action chosen by an AI thread, posted back to the worker owning the room
+typedef struct {
+    uint32_t room_id;
+    uint32_t turn_serial;
+    uint8_t player;
+    sim_action action;
+} ai_result;
+
+typedef struct {
+    ai_result items[AI_QUEUE_SIZE];
+    int start;
+    int count;
+} ai_result_queue;
+
+// Each worker runs its own epoll loop on one core and owns a disjoint set of rooms
+typedef struct worker {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;
+    atomic_int load;  // Connections handled by this worker
+
+    pthread_mutex_t lock;
+    handoff_queue inbox;
+    // Connections waiting for a fresh room, a less loaded worker can steal them
+    handoff_queue new_rooms;
+    atomic_int new_rooms_count;
+    ai_result_queue ai_results;
+
+    // Connections with queued frames, flushed once per epoll batch
+    int *dirty;
+    int dirty_count;
+    int dirty_capacity;
+
+    // Timers of the rooms and connections owned by this worker
+    timer_wheel timers;
+    rng seeds;  // Of the matches played in its rooms
+} worker;
+
+// Sent by the worker owning a room to the relay serving it
+typedef enum {
+    RI_FRAME,        // A frame broadcast to the room
+    RI_VIEWER,       // A spectator whose snapshot is already queued
+    RI_ROOM_CLOSED,  // Its spectators are let go
+} relay_item_type;
+
+typedef struct {
+    relay_item_type type;
+    uint32_t room_id;
+    int fd;            // RI_VIEWER
+    net_frame *frame;  // RI_FRAME, the relay holds a reference
+} relay_item;
+
+typedef struct {
+    relay_item *items;
+    int count;
+    int capacity;
+} relay_items;
+
+// Spectators of a room, indexed by the room slot
+typedef struct {
+    uint32_t room_id;
+    int *viewers;
+    int count;
+    int capacity;
+} relay_room;
+
+// Fans the broadcasts of its rooms out to their spectators. Rooms only pay for one copy of each
+// frame whatever the audience, so players are not slowed down by the spectators.
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;
+
+    pthread_mutex_t lock;
+    relay_items incoming;  // Guarded by lock, swapped with pending when the relay wakes up
+    relay_items pending;
+
+    relay_room *rooms;
+    int viewer_count;
+    int *dirty;
+    int dirty_count;
+    int dirty_capacity;
+} relay;
+
+// A connection entry is only touched by the worker owning the fd
+connection *connections = NULL;
+int connections_capacity = 0;
 const char *server_password = "";
-
-// Players
-int clients[MAX_PLAYER_COUNT] = {0};
-player_info players[MAX_PLAYER_COUNT] = {0};
-bool player_ready[MAX_PLAYER_COUNT] = {0};
-int master_player = 0;
-
-// Game logic
-game_state gs = GS_WAITING;
-// Stores the order in which players will do their actions
-int player_round_order[MAX_PLAYER_COUNT] = {0};
-uint8_t round_scores[MAX_PLAYER_COUNT] = {0};
-time_t round_start_time = 0;
-uint8_t max_round_count = 3;
+int turn_time_ms = DEFAULT_TURN_TIME_MS;
+
+worker *workers = NULL;
+int worker_count = 0;
+__thread worker *current_worker = NULL;
+
+relay *relays = NULL;
+int relay_count = 1;
+
+// AI players, searching never runs on a worker so their turns don't stall other rooms
+typedef struct {
+    ai_result request;  // Without its action
+    worker *owner;
+    sim_state game;
+    rng rng;
+    uint8_t map[MAP_WIDTH * MAP_HEIGHT];
+    const int8_t (*distances)[MAP_CELL_COUNT];  // Of a compiled map, NULL for text maps
+} ai_job;
+
+int ai_fill = 0;  // Rooms are completed with AI players up to this count when a game starts
+ai_config ai_settings = {.budget_ms = AI_DEFAULT_BUDGET_MS, .threads = 1, .max_depth = AI_DEFAULT_MAX_DEPTH};
+pthread_mutex_t ai_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ai_ready = PTHREAD_COND_INITIALIZER;
+ai_job ai_jobs[AI_QUEUE_SIZE];
+int ai_jobs_start = 0;
+int ai_jobs_count = 0;
+
+// Rooms
+room *rooms = NULL;
+int max_rooms = DEFAULT_MAX_ROOMS;
+// Guards room allocation and seats, never taken while playing a turn
+pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+int room_count = 0;
+uint32_t room_serial = 0;
+
+// Matchmaking, the queue is shared by every worker
+pthread_mutex_t matchmaking_lock = PTHREAD_MUTEX_INITIALIZER;
+mm_queue matchmaking;
+rating_store *ratings = NULL;
+int match_size = 2;
 
 // Admin stuff
 const char ADMIN_PASSWORD[8] = {'p', 'a', 's', 's'};
@@ -58,455 +310,1669 @@ int ci(int a) {
     return a;
 }
 
-void broadcast_packet(net_packet *packet) {
+void queue_frame(int fd, net_frame *f);
+void queue_packet(int fd, net_packet *packet);
+void relay_frame(room *r, net_frame *f);
+
+// Server sends go through the connection's outbound queue
+#undef send_packet
+#define send_packet(PACKET_FUNC, FD)            \
+    do {                                        \
+        net_packet p##__LINE__ = (PACKET_FUNC); \
+        queue_packet(FD, &p##__LINE__);         \
+    } while (0)
+
+// The packet is encoded once whatever the number of players
+void broadcast_packet(room *r, net_packet *packet) {
+    net_frame *f = frame_encode(packet);
+    if (f == NULL) {
+        return;
+    }
     for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-        if (players[i].connected) {
-            send_sock(packet, clients[i]);
+        if (r->game.players[i].connected) {
+            queue_frame(r->clients[i], f);
         }
     }
+    if (r->spectated) {
+        relay_frame(r, f);
+    }
+    frame_release(f);
 }
 
-#define broadcast(PACKET_FUNC)                  \
+#define broadcast(R, PACKET_FUNC)               \
     do {                                        \
         net_packet p##__LINE__ = (PACKET_FUNC); \
-        broadcast_packet(&p##__LINE__);         \
+        broadcast_packet((R), &p##__LINE__);    \
     } while (0)
 
-int player_count() {
+int player_count(room *r) {
     int player_count = 0;
-    FOREACH_PLAYER(player) {
+    FOREACH_PLAYER(r, player) {
         player_count++;
     }
     return player_count;
 }
 
 // Map
-map_data current_map = {0};
-const char *all_maps[256] = {0};
-uint8_t *map_names_network = NULL;
+// Built from the headers of maps/*.map at startup and sorted by name, map ids index it
+typedef struct {
+    char *file;  // In maps/, without its extension
+    char *name;
+    map_data *data;  // Parsed map, NULL while it is not cached
+    uint64_t last_used;
+} map_entry;
+
+map_entry *map_index = NULL;
 int map_count = 0;
-int selected_map_idx = 0;
+uint8_t *map_names_network = NULL;
 
-void send_map(int fd) {
-    uint8_t map[MAP_WIDTH * MAP_HEIGHT] = {0};
-    uint8_t props[MAP_WIDTH * MAP_HEIGHT] = {0};
-    for (int i = 0; i < MAP_HEIGHT * MAP_WIDTH; i++) {
-        map[i] = current_map.map[i];
-        props[i] = current_map.props[i];
+// Parsed maps shared by every worker, the least recently used goes once MAP_CACHE_SIZE are held.
+// Compiled maps are only mapped and never go, rooms and AI jobs point into them.
+#define MAP_CACHE_SIZE 64
+pthread_mutex_t map_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+int cached_maps[MAP_CACHE_SIZE];
+int cached_map_count = 0;
+uint64_t map_cache_clock = 0;
+
+void cache_map(int id, map_data *m) {
+    if (m->compiled != NULL) {
+        // Left out of the LRU
+    } else if (cached_map_count < MAP_CACHE_SIZE) {
+        cached_maps[cached_map_count++] = id;
+    } else {
+        int oldest = 0;
+        for (int i = 1; i < MAP_CACHE_SIZE; i++) {
+            if (map_index[cached_maps[i]].last_used < map_index[cached_maps[oldest]].last_used) {
+                oldest = i;
+            }
+        }
+        map_entry *evicted = &map_index[cached_maps[oldest]];
+        free_map_data(evicted->data);
+        free(evicted->data);
+        evicted->data = NULL;
+        cached_maps[oldest] = id;
     }
+    map_index[id].data = m;
+}
 
-    send_packet(pkt_map(MAP_WIDTH, MAP_HEIGHT, MLT_BACKGROUND, map), fd);
-    send_packet(pkt_map(MAP_WIDTH, MAP_HEIGHT, MLT_PROPS, props), fd);
+// The room gets the layers, the spawns and the mapping of a compiled map, the headers stay with the cached map
+bool get_map_data(int id, map_data *out) {
+    map_entry *e = &map_index[id];
+    pthread_mutex_lock(&map_cache_lock);
+    bool cached = e->data != NULL;
+    pthread_mutex_unlock(&map_cache_lock);
+
+    // Parsed outside of the lock, a worker loading another map does not hold back the others
+    map_data *loaded = NULL;
+    if (cached == false) {
+        loaded = calloc(1, sizeof(map_data));
+        if (loaded == NULL || load_map(e->file, loaded) == false) {
+            LOGL(LL_ERROR, "Error loading map '%s'", e->file);
+            free(loaded);
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&map_cache_lock);
+    if (e->data == NULL) {
+        cache_map(id, loaded);
+        loaded = NULL;
+    }
+    e->last_used = ++map_cache_clock;
+    *out = *e->data;
+    pthread_mutex_unlock(&map_cache_lock);
+    memset(out->headers, 0, sizeof(out->headers));
+
+    // Another worker cached the same map meanwhile
+    if (loaded != NULL) {
+        free_map_data(loaded);
+        free(loaded);
+    }
+    return true;
 }
 
-// Player
+// Names go 32 bytes each in pages that fit a packet
+#define MAP_LIST_PAGE ((MAX_PACKET_SIZE - 16) / 32)
 
-net_packet pkt_from_info(player_info *p) {
-    return pkt_player_update(p->id, p->stats, p->x, p->y, p->effect, p->effect_round_left, p->banned, false);
+void send_map_list(int fd) {
+    for (int first = 0; first == 0 || first < map_count; first += MAP_LIST_PAGE) {
+        int count = map_count - first < MAP_LIST_PAGE ? map_count - first : MAP_LIST_PAGE;
+        send_packet(pkt_server_map_list(first, count, map_names_network + first * 32), fd);
+    }
 }
 
-void update_stats(player_info *p, const spell *s) {
-    if (s->stat_max) {
-        p->stats[s->stat].max = fmin(p->stats[s->stat].max + s->stat_value, 200);
-        p->stats[s->stat].value = fmin(p->stats[s->stat].value + s->stat_value, 200);
-    } else {
-        p->stats[s->stat].value = fmin(fmax(p->stats[s->stat].value + s->stat_value, 0), p->stats[s->stat].max);
+void set_room_map_frames(room *r) {
+    net_packet layers[2] = {pkt_map(MAP_WIDTH, MAP_HEIGHT, MLT_BACKGROUND, r->current_map.map),
+                            pkt_map(MAP_WIDTH, MAP_HEIGHT, MLT_PROPS, r->current_map.props)};
+    for (int i = 0; i < 2; i++) {
+        if (r->map_frames[i] != NULL) {
+            frame_release(r->map_frames[i]);
+        }
+        r->map_frames[i] = frame_encode(&layers[i]);
     }
-    broadcast(pkt_from_info(p));
+    r->map_hash = map_layers_hash(MAP_WIDTH, MAP_HEIGHT, r->current_map.map, r->current_map.props);
 }
 
-void damage_player(player_info *from, player_info *to, const spell *s) {
-    int damage = get_spell_damage(from, s);
-    to->stats[STAT_HEALTH].value = fmin(fmax(to->stats[STAT_HEALTH].value - damage, 0), to->stats[STAT_HEALTH].max);
-    if (s->effect != SE_NONE) {
-        apply_effect(to, s);
+void free_room_map_frames(room *r) {
+    for (int i = 0; i < 2; i++) {
+        if (r->map_frames[i] != NULL) {
+            frame_release(r->map_frames[i]);
+            r->map_frames[i] = NULL;
+        }
     }
 }
 
-void reset_player(player_info *player) {
-    for (int i = 0; i < STAT_COUNT; i++) {
-        player->stats[i].max = player->stats[i].base;
-        player->stats[i].value = player->stats[i].base;
+// Players get the hash of the map, the layers only go to the ones missing it
+void send_map(room *r) {
+    net_packet hash = pkt_map_hash(r->map_hash);
+    net_frame *f = frame_encode(&hash);
+    if (f == NULL) {
+        return;
     }
-    player->x = current_map.spawn_positions[player->id][0];
-    player->y = current_map.spawn_positions[player->id][1];
-    for (int i = 0; i < SE_COUNT; i++) {
-        player->effect[i] = false;
-        player->effect_round_left[i] = 0;
-        player->spell_effect[i] = NULL;
+    FOREACH_PLAYER(r, player) {
+        queue_frame(r->clients[player->id], f);
+    }
+    frame_release(f);
+}
+
+void send_map_layers(room *r, int fd) {
+    for (int i = 0; i < 2; i++) {
+        if (r->map_frames[i] != NULL) {
+            queue_frame(fd, r->map_frames[i]);
+        }
+    }
+}
+
+// Spectators have no map cache, the relay gets the layers once for all of them
+void relay_map(room *r) {
+    if (r->spectated == false) {
+        return;
     }
-    player->turn_effect = SE_NONE;
-    player->turn_effect_duration_left = 0;
-    player->last_spell = NO_SPELL;
-    player->spell = NO_SPELL;
-    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
-        player->banned[i] = false;
+    for (int i = 0; i < 2; i++) {
+        if (r->map_frames[i] != NULL) {
+            relay_frame(r, r->map_frames[i]);
+        }
     }
+}
 
-    net_packet u = pkt_from_info(player);
-    ((net_packet_player_update *)u.content)->immediate = true;
-    broadcast_packet(&u);
+net_packet pkt_from_info(player_info *p) {
+    uint8_t effect_spells[SE_COUNT];
+    for (int i = 0; i < SE_COUNT; i++) {
+        effect_spells[i] = spell_index(p->spell_effect[i]);
+    }
+    return pkt_player_update(p->id, p->stats, p->x, p->y, p->effect, p->effect_round_left, p->banned, effect_spells,
+                             p->last_spell, p->turn_effect, p->turn_effect_duration_left, false);
 }
 
-player_info *get_player_from_fd(int fd) {
+// Packs the player state as a delta against the last one sent to the room
+char *pack_room_player_state(room *r, char *buf, player_info *p) {
+    uint8_t state[NET_PLAYER_STATE_MAX_SIZE] = {0};
+    net_packet u = pkt_from_info(p);
+    packstruct((char *)state, u.content, PKT_PLAYER_UPDATE);
+
+    bool keyframe = !r->sent_state_valid[p->id] || r->deltas_since_keyframe[p->id] >= KEYFRAME_INTERVAL;
+    buf = pack_player_state(buf, p->id, r->sent_states[p->id], state, keyframe);
+    r->deltas_since_keyframe[p->id] = keyframe ? 0 : r->deltas_since_keyframe[p->id] + 1;
+    memcpy(r->sent_states[p->id], state, sizeof(state));
+    r->sent_state_valid[p->id] = true;
+    return buf;
+}
+
+void broadcast_player_state(room *r, player_info *p, bool immediate) {
+    uint8_t state[2 + NET_PLAYER_STATE_MAX_SIZE];
+    char *end = pack_room_player_state(r, (char *)state, p);
+    broadcast(r, pkt_player_state(immediate, end - (char *)state, state));
+}
+
+// The next state of every player is sent whole, for a client that has none of them yet
+void invalidate_player_states(room *r) {
     for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-        if (clients[i] == fd) {
-            return &players[i];
+        r->sent_state_valid[i] = false;
+    }
+}
+
+void reset_player(room *r, player_info *player) {
+    sim_reset_player(player, r->current_map.spawn_positions[player->id][0],
+                     r->current_map.spawn_positions[player->id][1]);
+    broadcast_player_state(r, player, true);
+}
+
+// Timers
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_link(timer_wheel *tw, timer *t) {
+    uint64_t max_delta = (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if (t->expires - tw->now > max_delta) {
+        t->expires = tw->now + max_delta;
+    }
+    uint64_t delta = t->expires - tw->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ull << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    timer **slot = &tw->slots[level][(t->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SIZE - 1)];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->prev = &t->next;
+    }
+    t->prev = slot;
+    *slot = t;
+}
+
+void timer_cancel(timer_wheel *tw, timer *t) {
+    if (t->prev == NULL) {
+        return;
+    }
+    *t->prev = t->next;
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->next = NULL;
+    t->prev = NULL;
+    tw->count--;
+}
+
+// Arms (or re-arms) the timer to run in delay_ms
+void timer_add(timer_wheel *tw, timer *t, timer_callback callback, int delay_ms) {
+    timer_cancel(tw, t);
+    int ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    t->expires = tw->now + (ticks > 0 ? ticks : 1);
+    t->callback = callback;
+    timer_link(tw, t);
+    tw->count++;
+}
+
+// Runs every timer that expired up to the given tick
+void timer_run(timer_wheel *tw, uint64_t now) {
+    if (tw->count == 0 && now > tw->now) {
+        tw->now = now;
+    }
+    while (tw->now < now) {
+        tw->now++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((tw->now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            timer **slot = &tw->slots[level][(tw->now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SIZE - 1)];
+            timer *t = *slot;
+            *slot = NULL;
+            while (t != NULL) {
+                timer *next = t->next;
+                timer_link(tw, t);
+                t = next;
+            }
+        }
+        // Callbacks may cancel or arm any timer, including the ones of this slot
+        timer **slot = &tw->slots[0][tw->now & (TIMER_WHEEL_SIZE - 1)];
+        while (*slot != NULL) {
+            timer *t = *slot;
+            timer_cancel(tw, t);
+            t->callback(t);
+        }
+    }
+}
+
+// Time until the next timer or the next cascade, -1 when nothing is armed
+int timer_timeout(timer_wheel *tw) {
+    if (tw->count == 0) {
+        return -1;
+    }
+    uint64_t next = tw->now + 1;
+    while ((next & (TIMER_WHEEL_SIZE - 1)) != 0 && tw->slots[0][next & (TIMER_WHEEL_SIZE - 1)] == NULL) {
+        next++;
+    }
+    int64_t timeout = (int64_t)(next * TIMER_TICK_MS) - (int64_t)monotonic_ms();
+    return timeout > 0 ? timeout : 0;
+}
+
+// Connections
+
+connection *get_connection(int fd) {
+    if (fd < 0 || fd >= connections_capacity || connections[fd].active == false) {
+        return NULL;
+    }
+    return &connections[fd];
+}
+
+connection *add_connection(int fd) {
+    if (fd >= connections_capacity) {
+        LOGL(LL_ERROR, "Connection %d is over the limit of %d", fd, connections_capacity);
+        return NULL;
+    }
+    recv_buffer *in = calloc(1, sizeof(recv_buffer));
+    send_queue *out = calloc(1, sizeof(send_queue));
+    if (in == NULL || out == NULL) {
+        LOGL(LL_ERROR, "Could not allocate buffers for %d", fd);
+        free(in);
+        free(out);
+        return NULL;
+    }
+    memset(&connections[fd], 0, sizeof(connection));
+    connections[fd].active = true;
+    connections[fd].player_id = -1;
+    connections[fd].in = in;
+    connections[fd].out = out;
+    return &connections[fd];
+}
+
+// Closing the fd also removes it from the epoll set
+void leave_matchmaking(int fd);
+
+void drop_connection(int fd) {
+    connection *c = get_connection(fd);
+    if (c != NULL) {
+        leave_matchmaking(fd);
+        c->active = false;
+        c->room = NULL;
+        c->player_id = -1;
+        free(c->in);
+        c->in = NULL;
+        // Best effort for the last packets, like the reason the connection is refused
+        send_queue_flush(c->out, fd);
+        send_queue_clear(c->out);
+        free(c->out);
+        c->out = NULL;
+    }
+    close(fd);
+}
+
+// The fd number may be reused by another worker as soon as it is closed
+void forget_dirty(int fd) {
+    connection *c = get_connection(fd);
+    if (c == NULL || c->dirty == false) {
+        return;
+    }
+    c->dirty = false;
+    for (int i = 0; i < current_worker->dirty_count; i++) {
+        if (current_worker->dirty[i] == fd) {
+            current_worker->dirty[i] = current_worker->dirty[--current_worker->dirty_count];
+            return;
         }
     }
-    LOG("Unknown player with fd=%d", fd);
-    exit(1);
+}
+
+void remove_connection(int fd) {
+    if (get_connection(fd) != NULL) {
+        timer_cancel(&current_worker->timers, &get_connection(fd)->heartbeat);
+        forget_dirty(fd);
+        atomic_fetch_sub(&current_worker->load, 1);
+    }
+    drop_connection(fd);
+}
+
+bool push_fd(int **fds, int *count, int *capacity, int fd) {
+    if (*count == *capacity) {
+        int new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+        int *new_fds = realloc(*fds, new_capacity * sizeof(int));
+        if (new_fds == NULL) {
+            return false;
+        }
+        *fds = new_fds;
+        *capacity = new_capacity;
+    }
+    (*fds)[(*count)++] = fd;
+    return true;
+}
+
+void mark_dirty(connection *c, int fd) {
+    if (c->dirty) {
+        return;
+    }
+    worker *w = current_worker;
+    if (push_fd(&w->dirty, &w->dirty_count, &w->dirty_capacity, fd) == false) {
+        LOGL(LL_ERROR, "Could not grow worker %d flush list", w->id);
+        return;
+    }
+    c->dirty = true;
+}
+
+void queue_frame(int fd, net_frame *f) {
+    connection *c = get_connection(fd);
+    if (c == NULL || c->overflow) {
+        return;
+    }
+    if (send_queue_push(c->out, f) == false) {
+        // Closing it here would change the room while it is being iterated
+        LOGL(LL_WARNING, "Connection %d stopped reading, dropping it", fd);
+        c->overflow = true;
+    }
+    mark_dirty(c, fd);
+}
+
+void queue_packet(int fd, net_packet *packet) {
+    net_frame *f = frame_encode(packet);
+    if (f == NULL) {
+        return;
+    }
+    queue_frame(fd, f);
+    frame_release(f);
+}
+
+player_info *get_player_from_fd(int fd) {
+    connection *c = get_connection(fd);
+    if (c == NULL || c->room == NULL || c->player_id < 0) {
+        LOG("Unknown player with fd=%d", fd);
+        return NULL;
+    }
+    return &c->room->game.players[c->player_id];
 }
 
 bool is_admin(int fd) {
+    player_info *player = get_player_from_fd(fd);
+    if (player == NULL) {
+        return false;
+    }
     // Master player does not have to login
-    if (fd == clients[master_player]) {
+    if (player->id == get_connection(fd)->room->master_player) {
         return true;
     }
-    return get_player_from_fd(fd)->admin;
+    return player->admin;
+}
+
+void send_server_message(int fd, log_level level, const char *message) {
+    char msg[128] = {0};
+    strncpy(msg, message, sizeof(msg) - 1);
+    send_packet(pkt_server_message(level, msg), fd);
+}
+
+// Workers
+
+bool handoff_push(handoff_queue *q, handoff h) {
+    if (q->count == HANDOFF_QUEUE_SIZE) {
+        return false;
+    }
+    q->items[(q->start + q->count) % HANDOFF_QUEUE_SIZE] = h;
+    q->count++;
+    return true;
+}
+
+bool handoff_pop(handoff_queue *q, handoff *h) {
+    if (q->count == 0) {
+        return false;
+    }
+    *h = q->items[q->start];
+    q->start = (q->start + 1) % HANDOFF_QUEUE_SIZE;
+    q->count--;
+    return true;
+}
+
+void wake_worker(worker *w) {
+    uint64_t one = 1;
+    if (write(w->event_fd, &one, sizeof(one)) < 0) {
+        LOGL(LL_ERROR, "Error waking worker %d %s", w->id, strerror(errno));
+    }
 }
 
-player_info *player_on_cell(int x, int y) {
-    FOREACH_PLAYER(player) {
-        if (player->x == x && player->y == y) {
-            return player;
+worker *least_loaded_worker() {
+    worker *best = &workers[0];
+    for (int i = 1; i < worker_count; i++) {
+        if (atomic_load(&workers[i].load) < atomic_load(&best->load)) {
+            best = &workers[i];
         }
     }
+    return best;
+}
+
+// Hands a connection to another worker, the caller must not touch it afterwards
+void post_handoff(worker *w, handoff h, bool new_room) {
+    pthread_mutex_lock(&w->lock);
+    bool queued = handoff_push(new_room ? &w->new_rooms : &w->inbox, h);
+    if (queued && new_room) {
+        atomic_fetch_add(&w->new_rooms_count, 1);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (queued == false) {
+        LOGL(LL_ERROR, "Worker %d handoff queue is full, dropping connection %d", w->id, h.fd);
+        drop_connection(h.fd);
+        return;
+    }
+    wake_worker(w);
+}
+
+// Only the owner of the room can play the action, it gets it back through its event_fd
+void post_ai_result(worker *w, ai_result result) {
+    ai_result_queue *q = &w->ai_results;
+    pthread_mutex_lock(&w->lock);
+    bool queued = q->count < AI_QUEUE_SIZE;
+    if (queued) {
+        q->items[(q->start + q->count) % AI_QUEUE_SIZE] = result;
+        q->count++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (queued == false) {
+        // The turn deadline plays for it
+        LOGL(LL_ERROR, "Worker %d AI results are full, dropping the action of room %u", w->id, result.room_id);
+        return;
+    }
+    wake_worker(w);
+}
+
+// Each AI thread owns its search tables and serves the turns of every worker
+void *ai_main(void *arg) {
+    ai *a = ai_create(ai_settings, ((uint64_t)time(NULL) << 24) ^ (uintptr_t)arg);
+    if (a == NULL) {
+        LOGL(LL_ERROR, "Could not allocate the AI search tables");
+        exit(1);
+    }
+    ai_job *job = malloc(sizeof(ai_job));
+    if (job == NULL) {
+        LOGL(LL_ERROR, "Could not allocate an AI job");
+        exit(1);
+    }
+    while (1) {
+        pthread_mutex_lock(&ai_lock);
+        while (ai_jobs_count == 0) {
+            pthread_cond_wait(&ai_ready, &ai_lock);
+        }
+        *job = ai_jobs[ai_jobs_start];
+        ai_jobs_start = (ai_jobs_start + 1) % AI_QUEUE_SIZE;
+        ai_jobs_count--;
+        pthread_mutex_unlock(&ai_lock);
+
+        ai_result result = job->request;
+        result.action = ai_choose_action(a, &job->game, &job->rng, result.player, job->map, job->distances);
+        post_ai_result(job->owner, result);
+    }
     return NULL;
 }
 
-// Game logic
+void start_ai_threads(int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ai_main, (void *)(uintptr_t)i) != 0) {
+            LOGL(LL_ERROR, "Could not start AI thread %d", i);
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    LOG("Started %d AI threads (%d ms per turn, %d searches each)", count, ai_settings.budget_ms,
+        ai_settings.threads);
+}
 
-void play_turn(player_info *player) {
-    if (player->action == PA_STUNNED) {
-        LOG("Player %d can't play this round", player->id);
-        broadcast(pkt_from_info(player));
-        broadcast(pkt_player_action(player->id, player->action, player->x, player->y, 0));
-        player->state = RS_PLAYING;
-    } else if (player->action == PA_SPELL) {
-        if (player->effect[SE_STUN]) {
-            LOG("Player can't do this action because he is stunned");
-            broadcast(pkt_from_info(player));
-            broadcast(pkt_player_action(player->id, PA_STUNNED, player->x, player->y, 0));
-            player->state = RS_PLAYING;
-            return;
+// Relays
+
+relay *room_relay(room *r) {
+    return &relays[(r->id & (MAX_ROOMS - 1)) % relay_count];
+}
+
+// Workers never wait on a relay: a full queue loses the item rather than blocking a room
+void post_relay(relay *rl, relay_item item) {
+    pthread_mutex_lock(&rl->lock);
+    relay_items *q = &rl->incoming;
+    bool wake = q->count == 0;
+    bool queued = true;
+    if (q->count == q->capacity) {
+        int new_capacity = q->capacity == 0 ? 256 : q->capacity * 2;
+        relay_item *items =
+            new_capacity <= RELAY_QUEUE_MAX ? realloc(q->items, new_capacity * sizeof(relay_item)) : NULL;
+        if (items != NULL) {
+            q->items = items;
+            q->capacity = new_capacity;
+        } else {
+            queued = false;
+        }
+    }
+    if (queued) {
+        q->items[q->count++] = item;
+    }
+    pthread_mutex_unlock(&rl->lock);
+
+    if (queued == false) {
+        LOGL(LL_ERROR, "Relay %d queue is full, dropping an item of room %u", rl->id, item.room_id);
+        if (item.type == RI_FRAME) {
+            frame_release(item.frame);
+        } else if (item.type == RI_VIEWER) {
+            drop_connection(item.fd);
         }
+        return;
+    }
+    // Only the first item since the relay last looked needs a wakeup
+    if (wake) {
+        uint64_t one = 1;
+        if (write(rl->event_fd, &one, sizeof(one)) < 0) {
+            LOGL(LL_ERROR, "Error waking relay %d %s", rl->id, strerror(errno));
+        }
+    }
+}
 
-        LOG("Player %d is using spell %s this round", player->id, all_spells[player->spell].name);
-        int build_spell_index = -1;
-        for (int i = 0; i < MAX_SPELL_COUNT; i++) {
-            if (player->spell == player->spells[i]) {
-                build_spell_index = i;
+// The relay holds its own reference until the frame went out to every viewer
+void relay_frame(room *r, net_frame *f) {
+    post_relay(room_relay(r), (relay_item){.type = RI_FRAME, .room_id = r->id, .frame = frame_retain(f)});
+}
+
+void relay_mark_dirty(relay *rl, connection *c, int fd) {
+    if (c->dirty) {
+        return;
+    }
+    if (push_fd(&rl->dirty, &rl->dirty_count, &rl->dirty_capacity, fd) == false) {
+        LOGL(LL_ERROR, "Could not grow relay %d flush list", rl->id);
+        return;
+    }
+    c->dirty = true;
+}
+
+void remove_viewer(relay *rl, int fd) {
+    connection *c = get_connection(fd);
+    if (c == NULL) {
+        return;
+    }
+    relay_room *rr = &rl->rooms[c->spectating & (MAX_ROOMS - 1)];
+    for (int i = 0; i < rr->count; i++) {
+        if (rr->viewers[i] == fd) {
+            rr->viewers[i] = rr->viewers[--rr->count];
+            break;
+        }
+    }
+    if (c->dirty) {
+        c->dirty = false;
+        for (int i = 0; i < rl->dirty_count; i++) {
+            if (rl->dirty[i] == fd) {
+                rl->dirty[i] = rl->dirty[--rl->dirty_count];
+                break;
             }
         }
-        if (build_spell_index == -1) {
-            LOG("Player is trying to cast a spell which is not in his build");
-            handle_player_disconnect(clients[player->id]);
-            return;
+    }
+    rl->viewer_count--;
+    epoll_ctl(rl->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    drop_connection(fd);
+}
+
+void add_viewer(relay *rl, relay_item *item) {
+    connection *c = get_connection(item->fd);
+    relay_room *rr = &rl->rooms[item->room_id & (MAX_ROOMS - 1)];
+    // The slot of a closed room is reused by the next one
+    if (rr->room_id != item->room_id) {
+        rr->room_id = item->room_id;
+        rr->count = 0;
+    }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = item->fd};
+    if (epoll_ctl(rl->epoll_fd, EPOLL_CTL_ADD, item->fd, &event) < 0 ||
+        push_fd(&rr->viewers, &rr->count, &rr->capacity, item->fd) == false) {
+        LOGL(LL_ERROR, "Relay %d could not take spectator %d", rl->id, item->fd);
+        epoll_ctl(rl->epoll_fd, EPOLL_CTL_DEL, item->fd, NULL);
+        drop_connection(item->fd);
+        return;
+    }
+    rl->viewer_count++;
+    // Its snapshot is already in the queue
+    relay_mark_dirty(rl, c, item->fd);
+    LOG("Spectator %d watches room %u (%d on relay %d)", item->fd, item->room_id, rl->viewer_count, rl->id);
+}
+
+void fan_out(relay *rl, relay_item *item) {
+    relay_room *rr = &rl->rooms[item->room_id & (MAX_ROOMS - 1)];
+    if (rr->room_id != item->room_id) {
+        return;
+    }
+    for (int i = 0; i < rr->count; i++) {
+        int fd = rr->viewers[i];
+        connection *c = get_connection(fd);
+        if (c->overflow) {
+            continue;
         }
+        if (send_queue_push(c->out, item->frame) == false) {
+            // Removed on the next flush, the viewer list is being iterated
+            LOGL(LL_WARNING, "Spectator %d stopped reading, dropping it", fd);
+            c->overflow = true;
+        }
+        relay_mark_dirty(rl, c, fd);
+    }
+}
 
-        const spell *s = &all_spells[player->spell];
-        net_packet action_packet = pkt_player_action(player->id, player->action, player->ax, player->ay, player->spell);
-        net_packet_player_action *action = (net_packet_player_action *)action_packet.content;
+void close_relay_room(relay *rl, uint32_t room_id) {
+    relay_room *rr = &rl->rooms[room_id & (MAX_ROOMS - 1)];
+    if (rr->room_id != room_id) {
+        return;
+    }
+    net_packet bye = pkt_server_message(LL_INFO, "The room has been closed");
+    while (rr->count > 0) {
+        int fd = rr->viewers[0];
+        connection *c = get_connection(fd);
+        net_frame *f = frame_encode(&bye);
+        if (f != NULL) {
+            send_queue_push(c->out, f);
+            frame_release(f);
+        }
+        // Dropping the connection flushes the message
+        remove_viewer(rl, fd);
+    }
+    rr->room_id = 0;
+}
 
-        if (player->banned[action->spell]) {
-            LOG("Player %s can't cast %s spell because it is banned.", player->name, s->name);
-            broadcast(pkt_from_info(player));
-            broadcast(pkt_player_action(player->id, PA_STUNNED, player->x, player->y, 0));
-            player->state = RS_PLAYING;
-            return;
+void drain_relay(relay *rl) {
+    pthread_mutex_lock(&rl->lock);
+    relay_items swap = rl->incoming;
+    rl->incoming = rl->pending;
+    rl->pending = swap;
+    pthread_mutex_unlock(&rl->lock);
+
+    for (int i = 0; i < rl->pending.count; i++) {
+        relay_item *item = &rl->pending.items[i];
+        if (item->type == RI_FRAME) {
+            fan_out(rl, item);
+            frame_release(item->frame);
+        } else if (item->type == RI_VIEWER) {
+            add_viewer(rl, item);
+        } else if (item->type == RI_ROOM_CLOSED) {
+            close_relay_room(rl, item->room_id);
+        }
+    }
+    rl->pending.count = 0;
+}
+
+// Spectators only receive, whatever they send is read and dropped
+bool drain_viewer(int fd) {
+    connection *c = get_connection(fd);
+    int status = 0;
+    do {
+        status = recv_buffer_fill(c->in, fd);
+        c->in->head = c->in->tail;
+    } while (status > 0);
+    return status == 0;
+}
+
+void flush_viewers(relay *rl) {
+    for (int i = 0; i < rl->dirty_count; i++) {
+        int fd = rl->dirty[i];
+        connection *c = get_connection(fd);
+        c->dirty = false;
+        if (c->overflow || send_queue_flush(c->out, fd) < 0) {
+            remove_viewer(rl, fd);
         }
+    }
+    rl->dirty_count = 0;
+}
 
-        broadcast_packet(&action_packet);
+void *relay_main(void *arg) {
+    relay *rl = arg;
+    // Workers go first when they share a core with a relay, spectators can wait a bit
+    if (setpriority(PRIO_PROCESS, gettid(), RELAY_NICE) != 0) {
+        LOGL(LL_WARNING, "Could not lower the priority of relay %d", rl->id);
+    }
 
-        player->last_spell = player->spell;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (1) {
+        int event_count = epoll_wait(rl->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGL(LL_ERROR, "Error in relay epoll_wait %s", strerror(errno));
+            exit(1);
+        }
 
-        if (s->type == ST_MOVE) {
-            if (s->effect == SE_DODGE) {
-                player->turn_effect = SE_DODGE;
-                player->turn_effect_duration_left = 0;
-                LOG("Player %d is ready to dodge", player->id);
-            } else {
-                if (player_on_cell(player->ax, player->ay)) {
-                    player->state = RS_PLAYING;
-                    return;
+        for (int i = 0; i < event_count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == rl->event_fd) {
+                uint64_t wakeups;
+                if (read(rl->event_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    LOGL(LL_ERROR, "Error reading relay %d events %s", rl->id, strerror(errno));
                 }
-                player->x = player->ax;
-                player->y = player->ay;
+                drain_relay(rl);
+                continue;
             }
-        } else if (s->type == ST_TARGET) {
-            if (s->effect == SE_BANISH) {
-                LOG("Banning %d for %s", build_spell_index, player->name);
-                player->banned[build_spell_index] = true;
+            // Closed by a previous event of this batch
+            connection *c = get_connection(fd);
+            if (c == NULL || c->spectating == 0) {
+                continue;
             }
-            player_info *other = player_on_cell(player->ax, player->ay);
-            if (other == NULL) {
-                player->state = RS_PLAYING;
-                return;
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+                ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && drain_viewer(fd) == false)) {
+                remove_viewer(rl, fd);
+                continue;
             }
-
-            if (other->turn_effect == SE_DODGE) {
-                if (player_on_cell(other->ax, other->ay)) {
-                    player->state = RS_PLAYING;
-                    return;
-                }
-                LOG("Player %d dodged!", player->id);
-                other->x = other->ax;
-                other->y = other->ay;
-            } else if (other->turn_effect == SE_BLOCK) {
-                LOG("Player %s blocked the attack and %s is stunned", other->name, player->name);
-                player->effect[SE_STUN] = true;
-                player->effect_round_left[SE_STUN] = 2;
-                player->spell_effect[SE_STUN] = &all_spells[6];  // TODO: Should not be hardcoded
-            } else {
-                if (s->cast_type == CT_CAST || s->cast_type == CT_CAST_EFFECT) {
-                    damage_player(player, other, s);
-                    if (s->stat_value != 0) {
-                        update_stats(other, s);
-                    }
-                } else if (s->cast_type == CT_EFFECT) {
-                    apply_effect(other, s);
-                }
+            if (events[i].events & EPOLLOUT) {
+                relay_mark_dirty(rl, c, fd);
             }
-        } else {
-            LOGL(LL_ERROR, "Unknown spell type %d from %s", s->type, s->name);
         }
-        player->state = RS_PLAYING;
-    } else {
-        fprintf(stderr, "Unsupported player action\n");
-        exit(1);
+        flush_viewers(rl);
+    }
+    return NULL;
+}
+
+void start_relays(int count) {
+    relays = calloc(count, sizeof(relay));
+    if (relays == NULL) {
+        LOGL(LL_ERROR, "Could not allocate %d relays", count);
+        exit(1);
+    }
+    relay_count = count;
+    for (int i = 0; i < count; i++) {
+        relay *rl = &relays[i];
+        rl->id = i;
+        pthread_mutex_init(&rl->lock, NULL);
+        rl->rooms = calloc(max_rooms, sizeof(relay_room));
+        if (rl->rooms == NULL) {
+            LOGL(LL_ERROR, "Could not allocate the rooms of relay %d", i);
+            exit(1);
+        }
+        rl->epoll_fd = ci(epoll_create1(0));
+        rl->event_fd = ci(eventfd(0, EFD_NONBLOCK));
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = rl->event_fd};
+        ci(epoll_ctl(rl->epoll_fd, EPOLL_CTL_ADD, rl->event_fd, &event));
+        if (pthread_create(&rl->thread, NULL, relay_main, rl) != 0) {
+            LOGL(LL_ERROR, "Could not start relay %d", i);
+            exit(1);
+        }
+    }
+    LOG("Started %d spectator relays", count);
+}
+
+// Removes the connection from this worker's epoll before giving it away, its queued frames go with it
+void detach_connection(int fd) {
+    timer_cancel(&current_worker->timers, &get_connection(fd)->heartbeat);
+    forget_dirty(fd);
+    epoll_ctl(current_worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    atomic_fetch_sub(&current_worker->load, 1);
+}
+
+// Pings idle connections and closes the ones that stopped answering
+void check_heartbeat(timer *t) {
+    connection *c = TIMER_OWNER(t, connection, heartbeat);
+    int fd = c - connections;
+    uint64_t idle_ms = (current_worker->timers.now - c->last_seen) * TIMER_TICK_MS;
+    if (idle_ms >= DEAD_PEER_MS) {
+        LOG("Connection %d timed out", fd);
+        handle_player_disconnect(fd);
+        return;
+    }
+    if (idle_ms >= HEARTBEAT_INTERVAL_MS) {
+        send_packet(pkt_heartbeat(), fd);
+    }
+    timer_add(&current_worker->timers, t, check_heartbeat, HEARTBEAT_INTERVAL_MS);
+}
+
+bool attach_connection(worker *w, int fd) {
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd};
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        LOGL(LL_ERROR, "Error registering connection %d %s", fd, strerror(errno));
+        drop_connection(fd);
+        return false;
+    }
+    atomic_fetch_add(&w->load, 1);
+    connection *c = get_connection(fd);
+    c->owner = w;
+    c->last_seen = w->timers.now;
+    timer_add(&w->timers, &c->heartbeat, check_heartbeat, HEARTBEAT_INTERVAL_MS);
+    if (c->out->head != c->out->tail) {
+        mark_dirty(c, fd);
+    }
+    return true;
+}
+
+// Rooms
+
+room *get_room(uint32_t id) {
+    room *r = &rooms[id & (MAX_ROOMS - 1)];
+    if ((int)(id & (MAX_ROOMS - 1)) >= max_rooms || r->active == false || r->id != id) {
+        return NULL;
+    }
+    return r;
+}
+
+// The room starts with one seat taken by its creator
+room *create_room(worker *owner) {
+    pthread_mutex_lock(&rooms_lock);
+    for (int i = 0; i < max_rooms; i++) {
+        room *r = &rooms[i];
+        if (r->active) {
+            continue;
+        }
+        memset(r, 0, sizeof(room));
+        room_serial++;
+        r->id = (room_serial << ROOM_SLOT_BITS) | i;
+        r->active = true;
+        r->owner = owner;
+        r->seats = 1;
+        r->gs = GS_WAITING;
+        r->game.map = r->current_map.map;
+        r->max_round_count = 3;
+        r->round_start_ms = monotonic_ms();
+        for (int j = 0; j < MAX_PLAYER_COUNT; j++) {
+            r->game.players[j].id = j;
+        }
+        room_count++;
+        LOG("Room %u created on worker %d (%d/%d rooms in use)", r->id, owner->id, room_count, max_rooms);
+        pthread_mutex_unlock(&rooms_lock);
+        return r;
+    }
+    LOGL(LL_ERROR, "No room left (%d/%d rooms in use)", room_count, max_rooms);
+    pthread_mutex_unlock(&rooms_lock);
+    return NULL;
+}
+
+// Must be called with rooms_lock held
+bool room_joinable(room *r) {
+    return r->active && r->matched == false && atomic_load(&r->in_game) == false && r->seats < MAX_PLAYER_COUNT;
+}
+
+// Takes a seat in a room so it stays alive until the player gets there
+room *reserve_room(uint32_t id) {
+    pthread_mutex_lock(&rooms_lock);
+    room *r = get_room(id);
+    if (r != NULL && room_joinable(r)) {
+        r->seats++;
+    } else {
+        r = NULL;
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return r;
+}
+
+// Reserves a seat in the first lobby with a free slot
+room *find_room_with_space() {
+    room *found = NULL;
+    pthread_mutex_lock(&rooms_lock);
+    for (int i = 0; i < max_rooms; i++) {
+        if (room_joinable(&rooms[i])) {
+            found = &rooms[i];
+            found->seats++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return found;
+}
+
+// Returns true when the room has been destroyed. Only called by the owner, which runs its timers.
+bool release_seat(room *r) {
+    pthread_mutex_lock(&rooms_lock);
+    r->seats--;
+    bool empty = r->seats == 0;
+    if (empty) {
+        timer_cancel(&r->owner->timers, &r->stats_timer);
+        timer_cancel(&r->owner->timers, &r->turn_deadline);
+        LOG("Room %u destroyed (%d/%d rooms in use)", r->id, room_count - 1, max_rooms);
+        free_room_map_frames(r);
+        r->active = false;
+        room_count--;
+        if (r->spectated) {
+            post_relay(room_relay(r), (relay_item){.type = RI_ROOM_CLOSED, .room_id = r->id});
+        }
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return empty;
+}
+
+void send_room_list(int fd) {
+    uint8_t entries[NET_MAX_LISTED_ROOMS * NET_ROOM_ENTRY_SIZE] = {0};
+    char *entry = (char *)entries;
+    int listed = 0;
+    pthread_mutex_lock(&rooms_lock);
+    for (int i = 0; i < max_rooms && listed < NET_MAX_LISTED_ROOMS; i++) {
+        room *r = &rooms[i];
+        if (room_joinable(r) == false) {
+            continue;
+        }
+        entry = packu32(entry, r->id);
+        entry = packu8(entry, r->seats);
+        // Other workers' game state can't be read here, listed rooms are all waiting for a game
+        entry = packu8(entry, GS_WAITING);
+        listed++;
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    send_packet(pkt_room_list(listed, entries), fd);
+}
+
+void send_game_stats(timer *t) {
+    room *r = TIMER_OWNER(t, room, stats_timer);
+    if (player_count(r) == 0) {
+        return;
+    }
+    broadcast(r, pkt_game_stats((monotonic_ms() - r->round_start_ms) / 1000));
+    timer_add(&r->owner->timers, t, send_game_stats, STATS_INTERVAL_MS);
+}
+
+// Completes the room with AI players up to ai_fill before a game starts
+void fill_ai_players(room *r) {
+    for (int i = 0; i < MAX_PLAYER_COUNT && player_count(r) < ai_fill; i++) {
+        player_info *pi = &r->game.players[i];
+        if (pi->connected) {
+            continue;
+        }
+        memset(pi, 0, sizeof(player_info));
+        pi->id = i;
+        pi->connected = true;
+        snprintf(pi->name, sizeof(pi->name), "AI %d", i);
+        ai_random_build(&r->owner->seeds, pi);
+        r->clients[i] = -1;
+        r->player_ready[i] = true;
+        r->ai_player[i] = true;
+        LOG("AI player %d joined room %u", i, r->id);
+        broadcast(r, pkt_player_joined(pi->id, pi->name));
+        broadcast(r, pkt_player_build(pi->id, pi->stats[STAT_HEALTH].base, pi->spells, pi->stats[STAT_STRENGTH].value,
+                                      pi->stats[STAT_SPEED].value));
+    }
+}
+
+// AI players only hold the slots nobody took, a joining human gets them back
+void remove_ai_players(room *r) {
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        if (r->ai_player[i] == false) {
+            continue;
+        }
+        r->ai_player[i] = false;
+        r->game.players[i].connected = false;
+        r->clients[i] = 0;
+        r->player_ready[i] = false;
+        broadcast(r, pkt_disconnect(i, r->master_player));
+    }
+}
+
+// The seat has been reserved by the caller
+void join_room(room *r, int fd) {
+    connection *c = get_connection(fd);
+    remove_ai_players(r);
+    int new_player_id = -1;
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        if (r->game.players[i].connected == false) {
+            new_player_id = i;
+            break;
+        }
+    }
+    if (new_player_id == -1) {
+        send_server_message(fd, LL_ERROR, "Room is full");
+        release_seat(r);
+        return;
+    }
+
+    player_info *pi = &r->game.players[new_player_id];
+    memset(pi, 0, sizeof(player_info));
+    pi->id = new_player_id;
+    pi->connected = true;
+    r->clients[new_player_id] = fd;
+    r->player_ready[new_player_id] = false;
+    c->room = r;
+    c->player_id = new_player_id;
+
+    memcpy(pi->name, c->username, sizeof(pi->name));
+    LOG("New player %s joined room %u with ID=%d", pi->name, r->id, new_player_id);
+
+    if (player_count(r) == 1) {
+        r->master_player = new_player_id;
+    }
+    send_packet(pkt_connected(new_player_id, r->master_player, r->id), fd);
+
+    // We refresh player list for everyone
+    invalidate_player_states(r);
+    FOREACH_PLAYER(r, player) {
+        broadcast(r, pkt_player_joined(player->id, player->name));
+        broadcast(r, pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
+                                      player->stats[STAT_STRENGTH].value, player->stats[STAT_SPEED].value));
+        broadcast_player_state(r, player, false);
+    }
+
+    send_map_list(fd);
+    broadcast(r, pkt_update_server_configuration(r->selected_map_idx, r->max_round_count));
+    if (r->stats_timer.prev == NULL) {
+        timer_add(&r->owner->timers, &r->stats_timer, send_game_stats, STATS_INTERVAL_MS);
+    }
+}
+
+void leave_room(int fd) {
+    connection *c = get_connection(fd);
+    if (c == NULL || c->room == NULL) {
+        return;
+    }
+    room *r = c->room;
+    player_info *player = &r->game.players[c->player_id];
+    player->connected = false;
+    r->clients[player->id] = 0;
+    r->player_ready[player->id] = false;
+    c->room = NULL;
+    c->player_id = -1;
+
+    if (release_seat(r)) {
+        return;
+    }
+    // The game stops as soon as anyone leaves, with its turn deadline, even when players on their way remain
+    timer_cancel(&r->owner->timers, &r->turn_deadline);
+    r->turn_serial++;
+    r->gs = GS_WAITING;
+    r->in_game = false;
+
+    int new_master = -1;
+    FOREACH_PLAYER(r, player) {
+        if (r->ai_player[player->id] == false && new_master == -1) {
+            new_master = player->id;
+        }
+    }
+    if (new_master == -1) {
+        // Only players on their way from another worker are left
+        return;
+    }
+    broadcast(r, pkt_disconnect(player->id, new_master));
+    r->master_player = new_master;
+}
+
+// Joins a reserved room, moving the connection to the worker owning it if needed.
+// Returns false when the connection left this worker.
+bool move_to_room(int fd, room *r) {
+    if (r->owner == current_worker) {
+        join_room(r, fd);
+        return true;
+    }
+    detach_connection(fd);
+    post_handoff(r->owner, (handoff){.fd = fd, .room_id = r->id}, false);
+    return false;
+}
+
+// New rooms are queued on this worker, a less loaded one may pick them up first
+void request_new_room(int fd, bool matchmake) {
+    detach_connection(fd);
+    post_handoff(current_worker, (handoff){.fd = fd, .matchmake = matchmake}, true);
+    worker *idle = least_loaded_worker();
+    if (idle != current_worker) {
+        wake_worker(idle);
+    }
+}
+
+// Matchmaking
+
+void leave_matchmaking(int fd) {
+    connection *c = get_connection(fd);
+    if (c == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&matchmaking_lock);
+    mm_remove(&matchmaking, &c->queue_entry);
+    // A match already on its way to the worker is given up
+    c->queue_entry.ticket = 0;
+    pthread_mutex_unlock(&matchmaking_lock);
+}
+
+// The player leaves its room to wait, asking again keeps its place in the queue
+void join_matchmaking(int fd) {
+    connection *c = get_connection(fd);
+    leave_room(fd);
+    int rating = ratings_get(ratings, c->username);
+    pthread_mutex_lock(&matchmaking_lock);
+    if (c->queue_entry.queued == false) {
+        mm_push(&matchmaking, &c->queue_entry, rating, monotonic_ms());
+    }
+    int waiting = matchmaking.count;
+    pthread_mutex_unlock(&matchmaking_lock);
+    LOG("%s is looking for a match with rating %d (%d waiting)", c->username, rating, waiting);
+    send_packet(pkt_matchmake_status(true, rating, waiting), fd);
+}
+
+// Called with matchmaking_lock held, every player is sent to the worker owning its connection
+void start_match(mm_entry **group, int size, void *ctx) {
+    (void)ctx;
+    room *r = create_room(least_loaded_worker());
+    if (r == NULL) {
+        // Back in line for the next tick, keeping the time waited
+        for (int i = 0; i < size; i++) {
+            mm_push(&matchmaking, group[i], group[i]->rating, group[i]->enqueued_ms);
+        }
+        return;
+    }
+    pthread_mutex_lock(&rooms_lock);
+    r->seats = size;
+    r->matched = true;
+    pthread_mutex_unlock(&rooms_lock);
+    for (int i = 0; i < size; i++) {
+        connection *c = (connection *)((char *)group[i] - offsetof(connection, queue_entry));
+        post_handoff(c->owner, (handoff){.fd = c - connections, .room_id = r->id, .ticket = group[i]->ticket}, false);
+    }
+}
+
+void *matchmaking_main(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec tick = {.tv_nsec = MATCHMAKING_TICK_MS * 1000000L};
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&matchmaking_lock);
+        int groups = mm_match(&matchmaking, match_size, monotonic_ms(), start_match, NULL);
+        int waiting = matchmaking.count;
+        pthread_mutex_unlock(&matchmaking_lock);
+        if (groups > 0) {
+            LOG("Matched %d group(s) of %d players, %d still waiting", groups, match_size, waiting);
+        }
+    }
+    return NULL;
+}
+
+// A matched connection of this worker goes to its room, unless it left the queue meanwhile
+void take_match(worker *w, handoff h) {
+    connection *c = get_connection(h.fd);
+    pthread_mutex_lock(&matchmaking_lock);
+    bool valid = c != NULL && c->owner == w && c->queue_entry.ticket == h.ticket;
+    if (valid) {
+        c->queue_entry.ticket = 0;
+    }
+    pthread_mutex_unlock(&matchmaking_lock);
+    // The seat reserved for it keeps the room alive
+    room *r = get_room(h.room_id);
+    if (valid == false) {
+        post_handoff(r->owner, (handoff){.fd = -1, .room_id = h.room_id}, false);
+        return;
+    }
+    move_to_room(h.fd, r);
+}
+
+// Only humans are rated, a game won by an AI player is a tie between them
+void rate_game(room *r, uint8_t winner_id) {
+    const char *names[MAX_PLAYER_COUNT];
+    int count = 0;
+    int winner = -1;
+    FOREACH_PLAYER(r, player) {
+        if (r->ai_player[player->id]) {
+            continue;
+        }
+        if (player->id == winner_id) {
+            winner = count;
+        }
+        names[count++] = player->name;
     }
+    ratings_update(ratings, names, count, winner);
 }
 
-int compare_players_action(const void *a, const void *b) {
-    int player1_id = *(int *)a;
-    int player2_id = *(int *)b;
+// Clients play the turn themselves from its actions
+void send_turn_result(room *r, turn_outcome outcome, uint8_t winner_id) {
+    uint8_t actions[MAX_PLAYER_COUNT * NET_TURN_ACTION_SIZE] = {0};
+    char *action = (char *)actions;
+    int action_count = 0;
+    FOREACH_PLAYER(r, player) {
+        sim_action *a = &r->actions[player->id];
+        action = packu8(action, player->id);
+        action = packu8(action, a->action);
+        action = packu8(action, a->x);
+        action = packu8(action, a->y);
+        action = packu8(action, a->spell);
+        action_count++;
+    }
+    broadcast(r, pkt_turn_result(outcome, winner_id, r->round_scores, action_count, actions,
+                                 (uint32_t)sim_hash(&r->game, &r->rng)));
+}
 
-    player_info *p1 = &players[player1_id];
-    player_info *p2 = &players[player2_id];
+// Keyframes of every player for a client which mispredicted, the room's baseline stays as is.
+// states holds MAX_PLAYER_COUNT entries.
+net_packet pkt_room_resync(room *r, uint8_t *states) {
+    char *state = (char *)states;
+    int state_count = 0;
+    FOREACH_PLAYER(r, player) {
+        uint8_t packed[NET_PLAYER_STATE_MAX_SIZE] = {0};
+        net_packet u = pkt_from_info(player);
+        packstruct((char *)packed, u.content, PKT_PLAYER_UPDATE);
+        state = pack_player_state(state, player->id, NULL, packed, true);
+        state_count++;
+    }
+    return pkt_resync(r->rng.state, state_count, state - (char *)states, states);
+}
 
-    const spell *s1 = &all_spells[p1->spell];
-    const spell *s2 = &all_spells[p2->spell];
+void send_resync(room *r, int fd) {
+    uint8_t states[MAX_PLAYER_COUNT * (2 + NET_PLAYER_STATE_MAX_SIZE)] = {0};
+    send_packet(pkt_room_resync(r, states), fd);
+}
 
-    int s1_final_speed = p1->stats[STAT_SPEED].value + s1->speed;
-    int s2_final_speed = p2->stats[STAT_SPEED].value + s2->speed;
+// Spectators
 
-    if (s1_final_speed == s2_final_speed) {
-        return rand() % 2 == 0 ? 1 : -1;  // If both spell have the same speed, its random (for now ?)
+// The connection is not attached to any worker, its queue goes to the relay with it
+void queue_snapshot_packet(connection *c, net_packet p) {
+    net_frame *f = frame_encode(&p);
+    if (f == NULL) {
+        return;
     }
+    send_queue_push(c->out, f);
+    frame_release(f);
+}
 
-    return s2_final_speed - s1_final_speed;
+// What a client needs to follow the room from now on, as the packets a player would have received
+void queue_snapshot(room *r, connection *c) {
+    queue_snapshot_packet(c, pkt_spectate_start(r->id, r->in_game, r->master_player, r->max_round_count,
+                                                r->round_scores));
+    FOREACH_PLAYER(r, player) {
+        queue_snapshot_packet(c, pkt_player_joined(player->id, player->name));
+        queue_snapshot_packet(c, pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
+                                                  player->stats[STAT_STRENGTH].value,
+                                                  player->stats[STAT_SPEED].value));
+    }
+    // Deltas of the live stream apply to the states last broadcast, not to the current ones
+    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
+        if (r->sent_state_valid[i]) {
+            uint8_t state[2 + NET_PLAYER_STATE_MAX_SIZE];
+            char *end = pack_player_state((char *)state, i, NULL, r->sent_states[i], true);
+            queue_snapshot_packet(c, pkt_player_state(false, end - (char *)state, state));
+        }
+    }
+    for (int i = 0; i < 2 && r->in_game; i++) {
+        if (r->map_frames[i] != NULL) {
+            send_queue_push(c->out, r->map_frames[i]);
+        }
+    }
+    uint8_t states[MAX_PLAYER_COUNT * (2 + NET_PLAYER_STATE_MAX_SIZE)] = {0};
+    queue_snapshot_packet(c, pkt_room_resync(r, states));
 }
 
-void sort_actions() {
-    for (int i = 0; i < player_count(); i++) {
-        player_round_order[i] = i;
+// The owner of the room takes the snapshot. Returns false once the connection left this worker.
+bool spectate_room(int fd, uint32_t room_id) {
+    pthread_mutex_lock(&rooms_lock);
+    room *r = get_room(room_id);
+    worker *owner = r != NULL ? r->owner : NULL;
+    pthread_mutex_unlock(&rooms_lock);
+    if (owner == NULL) {
+        send_server_message(fd, LL_ERROR, "Room is not available");
+        return true;
     }
-    qsort(player_round_order, player_count(), sizeof(int), &compare_players_action);
+    leave_matchmaking(fd);
+    leave_room(fd);
+    detach_connection(fd);
+    post_handoff(owner, (handoff){.fd = fd, .room_id = room_id, .spectate = true}, false);
+    return false;
 }
 
-void execute_turn() {
-    sort_actions();
+// Nothing can be broadcast between the snapshot and the first relayed frame, both come from here
+void add_spectator(worker *w, handoff h) {
+    room *r = get_room(h.room_id);
+    if (r == NULL) {
+        // The room closed on the way, the connection stays with this worker
+        if (attach_connection(w, h.fd)) {
+            send_server_message(h.fd, LL_ERROR, "Room is not available");
+        }
+        return;
+    }
+    connection *c = get_connection(h.fd);
+    c->owner = NULL;
+    c->spectating = r->id;
+    queue_snapshot(r, c);
+    r->spectated = true;
+    post_relay(room_relay(r), (relay_item){.type = RI_VIEWER, .room_id = r->id, .fd = h.fd});
+}
 
-    // Action execution
-    FOREACH_PLAYER(player) {
-        play_turn(&players[player_round_order[player->id]]);
+// The search runs on an AI thread, the action comes back through drain_ai_results
+void request_ai_action(room *r, player_info *player) {
+    ai_result request = {.room_id = r->id, .turn_serial = r->turn_serial, .player = player->id};
+    pthread_mutex_lock(&ai_lock);
+    bool queued = ai_jobs_count < AI_QUEUE_SIZE;
+    if (queued) {
+        ai_job *job = &ai_jobs[(ai_jobs_start + ai_jobs_count) % AI_QUEUE_SIZE];
+        job->request = request;
+        job->owner = r->owner;
+        job->game = r->game;
+        job->rng = r->rng;
+        memcpy(job->map, r->current_map.map, sizeof(job->map));
+        job->distances = r->current_map.compiled != NULL ? r->current_map.compiled->distances : NULL;
+        ai_jobs_count++;
+        pthread_cond_signal(&ai_ready);
+    }
+    pthread_mutex_unlock(&ai_lock);
+    if (queued == false) {
+        // Still posted so the turn is never played from inside start_turn
+        request.action = ai_random_action(&r->game, &r->owner->seeds, player->id);
+        post_ai_result(r->owner, request);
     }
+}
 
-    // Effect tick
-    FOREACH_PLAYER(player) {
-        for (int i = 0; i < SE_COUNT; i++) {
-            if (player->effect[i] && (player->spell_effect[i]->cast_type == CT_EFFECT ||
-                                      player->spell_effect[i]->cast_type == CT_CAST_EFFECT)) {
-                int damage = get_spell_damage(player, player->spell_effect[i]);
-                player->stats[STAT_HEALTH].value = fmax(player->stats[STAT_HEALTH].value - damage, 0);
-            }
+void turn_timed_out(timer *t);
 
-            if (player->effect_round_left[i] > 0) {
-                player->effect_round_left[i]--;
-                if (player->effect_round_left[i] == 0) {
-                    // Slow effect is not permanant
-                    if (i == SE_SLOW) {
-                        player->stats[STAT_SPEED].value = player->stats[STAT_SPEED].max;
-                    }
-                    player->effect[i] = false;
-                }
-            }
-        }
-        broadcast(pkt_from_info(player));
+void start_turn(room *r) {
+    r->turn_serial++;
+    r->gs = GS_STARTED;
+    FOREACH_PLAYER(r, player) {
+        player->state = RS_PLAYING;
     }
-
-    FOREACH_PLAYER(player) {
-        if (player->turn_effect_duration_left == 0) {
-            player->turn_effect = SE_NONE;
-        } else {
-            player->turn_effect_duration_left--;
+    FOREACH_PLAYER(r, player) {
+        if (r->ai_player[player->id]) {
+            request_ai_action(r, player);
         }
     }
+    // Lobbies and rooms between games never play turns on their own
+    if (turn_time_ms > 0 && r->in_game) {
+        timer_add(&r->owner->timers, &r->turn_deadline, turn_timed_out, turn_time_ms);
+    }
+}
 
-    int alive_count = 0;
-    FOREACH_PLAYER(player) {
-        alive_count += player->stats[STAT_HEALTH].value > 0;
+void execute_turn(room *r) {
+    uint8_t winner_id = GAME_TIE;
+    turn_outcome outcome = sim_step(&r->game, r->actions, &r->rng, &winner_id);
+    r->turn_serial++;
+    FOREACH_PLAYER(r, player) {
+        player->state = RS_PLAYING;
+        if (r->ai_player[player->id]) {
+            ai_tick_cooldowns(player);
+        }
     }
 
-    if (alive_count >= 2) {
-        broadcast(pkt_turn_end());
+    if (outcome == TO_CONTINUE) {
+        send_turn_result(r, TO_CONTINUE, GAME_TIE);
+        start_turn(r);
         return;
     }
+    timer_cancel(&r->owner->timers, &r->turn_deadline);
 
-    uint8_t end_verdict = GAME_TIE;
-    if (alive_count == 1) {
-        FOREACH_PLAYER(player) {
-            if (player->stats[STAT_HEALTH].value > 0) {
-                LOG("Player %s won the round !", players[player->id].name);
-                end_verdict = player->id;
-                round_scores[player->id]++;
-            }
-        }
-    } else if (alive_count == 0) {
+    if (winner_id != GAME_TIE) {
+        LOG("Player %s won the round !", r->game.players[winner_id].name);
+        r->round_scores[winner_id]++;
+    } else {
         LOG("Nobody won the game...");
-        end_verdict = GAME_TIE;
     }
 
-    broadcast(pkt_round_end(end_verdict, round_scores));
-
-    FOREACH_PLAYER(player) {
-        if (round_scores[player->id] == max_round_count) {
-            broadcast(pkt_game_end(player->id, round_scores));
+    uint8_t end_verdict = winner_id;
+    FOREACH_PLAYER(r, player) {
+        if (r->round_scores[player->id] == r->max_round_count) {
+            outcome = TO_GAME_END;
+            end_verdict = player->id;
+            r->in_game = false;
         }
     }
+    if (outcome == TO_GAME_END) {
+        rate_game(r, end_verdict);
+    }
+    send_turn_result(r, outcome, end_verdict);
 
-    gs = GS_WAITING;
+    r->gs = GS_WAITING;
 }
 
-void start_game() {
-    if (gs != GS_WAITING) {
+// Players who did not send their action skip the turn
+void turn_timed_out(timer *t) {
+    room *r = TIMER_OWNER(t, room, turn_deadline);
+    if (r->gs != GS_STARTED || r->in_game == false) {
         return;
     }
-
-    // TODO: Check that every player is really ready (build is set, etc.)
-    FOREACH_PLAYER(player) {
-        reset_player(player);
-        send_map(clients[player->id]);
+    FOREACH_PLAYER(r, player) {
+        if (player->state == RS_PLAYING) {
+            LOG("Player %d did not play in time in room %u", player->id, r->id);
+            r->actions[player->id].action = PA_STUNNED;
+            player->state = RS_WAITING;
+        }
     }
-    broadcast(pkt_game_start());
-    round_start_time = time(NULL);
+    execute_turn(r);
 }
 
-// Network
+// The turn is played once the last action is in
+void play_action(room *r, player_info *player, sim_action action) {
+    r->actions[player->id] = action;
+    player->state = RS_WAITING;
+    if (r->ai_player[player->id]) {
+        ai_start_cooldown(player, action);
+    }
 
-void handle_player_disconnect(int fd) {
-    FD_CLR(fd, &master_set);
-    LOG("Player %d left", fd);
-    player_info *player = get_player_from_fd(fd);
-    player->connected = false;
-    int new_master = -1;
-    FOREACH_PLAYER(player) {
-        if (player->connected && new_master == -1) {
-            new_master = player->id;
+    int all_played = true;
+    FOREACH_PLAYER(r, player) {
+        if (player->state == RS_PLAYING) {
+            all_played = false;
         }
     }
-    // Everyone left the game
-    if (new_master == -1) {
-        new_master = 0;
+
+    // TODO: Rework this part ?
+    if (all_played) {
+        execute_turn(r);
     }
-    broadcast(pkt_disconnect(player->id, new_master));
-    master_player = new_master;
-    gs = GS_WAITING;
 }
 
-void handle_message(int fd) {
-    net_packet p = {0};
-    if (packet_read(&p, fd) < 0) {
-        handle_player_disconnect(fd);
-        return;
+// Returns the seed of the new match, for PKT_GAME_START
+uint64_t seed_match(room *r) {
+    uint64_t seed = rng_next(&r->owner->seeds);
+    rng_seed(&r->rng, seed);
+    return seed;
+}
+
+void start_game(room *r) {
+    fill_ai_players(r);
+    // TODO: Check that every player is really ready (build is set, etc.)
+    FOREACH_PLAYER(r, player) {
+        reset_player(r, player);
     }
+    send_map(r);
+    relay_map(r);
+    broadcast(r, pkt_game_start(seed_match(r)));
+    r->round_start_ms = monotonic_ms();
+    r->in_game = true;
+    start_turn(r);
+}
+
+// Network
 
-    if (p.type == PKT_PING) {
-        send_sock(&p, fd);
-    } else if (p.type == PKT_JOIN) {
-        net_packet_join *j = (net_packet_join *)p.content;
+void handle_player_disconnect(int fd) {
+    LOG("Player %d left", fd);
+    leave_room(fd);
+    remove_connection(fd);
+}
 
-        if (server_password != NULL && strncmp(server_password, j->password.str, strlen(server_password)) != 0) {
+// Returns false once the connection is closed or handled by another worker
+bool handle_message(int fd, net_packet *p) {
+    connection *c = get_connection(fd);
+    room *r = c->room;
+
+    if (p->type == PKT_PING) {
+        queue_packet(fd, p);
+    } else if (p->type == PKT_JOIN) {
+        net_packet_join *j = (net_packet_join *)p->content;
+
+        if (j->protocol_version != NET_PROTOCOL_VERSION) {
+            LOG("%.*s uses protocol %08x (version %.*s), expected %08x", NSTR(j->username), j->protocol_version,
+                NSTR(j->version), NET_PROTOCOL_VERSION);
+            send_server_message(fd, LL_ERROR, "Incompatible client version, please update");
+            remove_connection(fd);
+            return false;
+        }
+        if (j->version.len != strlen(GIT_VERSION) || memcmp(j->version.str, GIT_VERSION, j->version.len) != 0) {
+            // Same protocol, the builds can still play together
+            LOGL(LL_WARNING, "%.*s runs version %.*s, server is %s", NSTR(j->username), NSTR(j->version), GIT_VERSION);
+        }
+        if (server_password != NULL && (j->password.len != strlen(server_password) ||
+                                        memcmp(server_password, j->password.str, j->password.len) != 0)) {
             LOG("Wrong password for %.*s => '%.*s'", NSTR(j->username), NSTR(j->password));
-            char msg[128] = {0};
-            strncpy(msg, "Wrong password", 128);
-            net_packet msg_p = pkt_server_message(LL_ERROR, msg);
-            send_sock(&msg_p, fd);
-            FD_CLR(fd, &master_set);
-            close(fd);
-            return;
+            send_server_message(fd, LL_ERROR, "Wrong password");
+            remove_connection(fd);
+            return false;
         }
-
-        int new_player_id = -1;
-        for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-            if (players[i].connected == false) {
-                players[i].connected = true;
-                clients[i] = fd;
-                new_player_id = i;
-                break;
-            }
+        if (c->joined) {
+            return true;
         }
-        assert(new_player_id != -1);
 
-        memcpy(players[new_player_id].name, j->username.str, j->username.len);
-        LOG("New player %s joined with ID=%d", players[new_player_id].name, new_player_id);
+        c->joined = true;
+        memset(c->username, 0, sizeof(c->username));
+        memcpy(c->username, j->username.str, j->username.len);
+        int programs_size = 0;
+        uint32_t programs_hash = 0;
+        const uint8_t *programs = get_spell_programs(&programs_size, &programs_hash);
+        send_packet(pkt_spell_programs(programs_hash, programs_size, (uint8_t *)programs), fd);
+
+        room *target = find_room_with_space();
+        if (target == NULL) {
+            request_new_room(fd, true);
+            return false;
+        }
+        return move_to_room(fd, target);
+    } else if (p->type == PKT_ROOM_LIST_REQUEST) {
+        send_room_list(fd);
+    } else if (p->type == PKT_ROOM_CREATE || p->type == PKT_ROOM_JOIN) {
+        if (c->joined == false) {
+            send_server_message(fd, LL_ERROR, "You have to join the server first");
+            return true;
+        }
 
-        // We refresh player list for everyone
-        FOREACH_PLAYER(player) {
-            broadcast(pkt_player_joined(player->id, player->name));
-            broadcast(pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
-                                       player->stats[STAT_STRENGTH].value, player->stats[STAT_SPEED].value));
-            broadcast(pkt_from_info(player));
+        leave_matchmaking(fd);
+        if (p->type == PKT_ROOM_CREATE) {
+            // Leave first so a single player moving around does not need two rooms
+            leave_room(fd);
+            request_new_room(fd, false);
+            return false;
         }
 
-        player_info *pi = &players[new_player_id];
-        broadcast(pkt_from_info(pi));
-        send_packet(pkt_connected(new_player_id, master_player), fd);
-        send_packet(pkt_server_map_list(map_count, map_names_network), fd);
-        broadcast(pkt_update_server_configuration(selected_map_idx, max_round_count));
-    } else if (p.type == PKT_UPDATE_SERVER_CONFIGURATION) {
-        net_packet_update_server_configuration *config = (net_packet_update_server_configuration *)p.content;
-        if (config->map_index >= map_count) {
-            return;
+        net_packet_room_join *j = (net_packet_room_join *)p->content;
+        if (r != NULL && r->id == j->room_id) {
+            return true;
+        }
+        room *target = reserve_room(j->room_id);
+        if (target == NULL) {
+            send_server_message(fd, LL_ERROR, "Room is not available");
+            return true;
+        }
+        leave_room(fd);
+        return move_to_room(fd, target);
+    } else if (p->type == PKT_MATCHMAKE) {
+        if (c->joined == false) {
+            send_server_message(fd, LL_ERROR, "You have to join the server first");
+            return true;
+        }
+        if (((net_packet_matchmake *)p->content)->join) {
+            join_matchmaking(fd);
+        } else {
+            leave_matchmaking(fd);
+            send_packet(pkt_matchmake_status(false, ratings_get(ratings, c->username), 0), fd);
+        }
+    } else if (p->type == PKT_SPECTATE) {
+        if (c->joined == false) {
+            send_server_message(fd, LL_ERROR, "You have to join the server first");
+            return true;
+        }
+        return spectate_room(fd, ((net_packet_spectate *)p->content)->room_id);
+    } else if (r == NULL) {
+        // Every other packet needs the player to be inside a room
+        LOG("Ignoring packet %d from %d which is not inside a room", p->type, fd);
+    } else if (p->type == PKT_UPDATE_SERVER_CONFIGURATION) {
+        net_packet_update_server_configuration *config = (net_packet_update_server_configuration *)p->content;
+        if (config->map_index >= (uint32_t)map_count) {
+            return true;
         }
         if (config->round_count < 3 || config->round_count > 15) {
-            return;
+            return true;
         }
-        selected_map_idx = config->map_index;
-        max_round_count = config->round_count;
-        broadcast_packet(&p);
-    } else if (p.type == PKT_REQUEST_GAME_START) {
-        net_packet_request_game_start *s = (net_packet_request_game_start *)p.content;
-        if (s->map_id >= map_count) {
-            return;
+        r->selected_map_idx = config->map_index;
+        r->max_round_count = config->round_count;
+        broadcast_packet(r, p);
+    } else if (p->type == PKT_REQUEST_GAME_START) {
+        net_packet_request_game_start *s = (net_packet_request_game_start *)p->content;
+        if (r->in_game) {
+            LOG("Recieved PKT_REQUEST_GAME_START but a game is running");
+            return true;
+        }
+        if (s->map_id >= (uint32_t)map_count) {
+            return true;
         }
         if (s->round_count < 3 || s->round_count > 15) {
-            return;
+            return true;
         }
 
-        const char *map = all_maps[s->map_id];
-        if (load_map(map, &current_map) == false) {
-            LOGL(LL_ERROR, "Error loading map '%s'", map);
-            return;
+        if (get_map_data(s->map_id, &r->current_map) == false) {
+            return true;
         }
+        set_room_map_frames(r);
         for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-            round_scores[i] = 0;
+            r->round_scores[i] = 0;
         }
-        round_start_time = time(NULL);
-        max_round_count = s->round_count;
-        start_game();
-    } else if (p.type == PKT_PLAYER_BUILD) {
+        r->round_start_ms = monotonic_ms();
+        r->max_round_count = s->round_count;
+        start_game(r);
+    } else if (p->type == PKT_PLAYER_BUILD) {
         // TODO: Handle error
-        if (gs == GS_STARTED) {
+        if (r->gs == GS_STARTED) {
             LOG("Recieved PKT_PLAYER_BUILD but game has already started");
-            exit(0);
+            return true;
         }
-        net_packet_player_build *b = (net_packet_player_build *)p.content;
+        net_packet_player_build *b = (net_packet_player_build *)p->content;
         player_info *player = get_player_from_fd(fd);
         // We force the id to avoid a player setting the build of another player
         b->id = player->id;
-        broadcast_packet(&p);
+        broadcast_packet(r, p);
 
         for (int i = 0; i < MAX_SPELL_COUNT; i++) {
             player->spells[i] = b->spells[i];
@@ -523,109 +1989,413 @@ void handle_message(int fd) {
         player->stats[STAT_SPEED].base = b->speed;
         player->stats[STAT_SPEED].max = b->speed;
         player->stats[STAT_SPEED].value = b->speed;
-        // We send a PKT_PLAYER_UPDATE to set the base_health for all clients
-        broadcast(pkt_from_info(player));
-    } else if (p.type == PKT_PLAYER_ACTION) {
-        net_packet_player_action *a = (net_packet_player_action *)p.content;
-        LOG("Player %d played : %d at %d %d", a->id, a->action, a->x, a->y);
-
-        players[a->id].action = a->action;
-        players[a->id].ax = a->x;
-        players[a->id].ay = a->y;
-        players[a->id].state = RS_WAITING;
-        players[a->id].spell = a->spell;
-
-        int all_played = true;
-        FOREACH_PLAYER(player) {
-            if (player->state == RS_PLAYING) {
-                all_played = false;
-            }
+        // We send the player state to set the base_health for all clients
+        broadcast_player_state(r, player, false);
+    } else if (p->type == PKT_PLAYER_ACTION) {
+        net_packet_player_action *a = (net_packet_player_action *)p->content;
+        player_info *player = get_player_from_fd(fd);
+        // Only one action per player and turn
+        if (r->gs != GS_STARTED || player->state != RS_PLAYING) {
+            LOG("Ignoring action of player %d outside of their turn", player->id);
+            return true;
         }
-
-        // TODO: Rework this part ?
-        if (all_played) {
-            execute_turn();
+        // Same as builds, a player can only play for himself
+        a->id = player->id;
+        LOG("Player %d played : %d at %d %d", a->id, a->action, a->x, a->y);
+        play_action(r, player, (sim_action){.action = a->action, .x = a->x, .y = a->y, .spell = a->spell});
+    } else if (p->type == PKT_PLAYER_READY) {
+        // Players get ready for the next round of the running game
+        if (r->in_game == false || r->gs == GS_STARTED) {
+            return true;
         }
-    } else if (p.type == PKT_PLAYER_READY) {
-        player_ready[get_player_from_fd(fd)->id] = true;
+        player_info *player = get_player_from_fd(fd);
+        r->player_ready[player->id] = true;
         int ready_count = 0;
         for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-            ready_count += player_ready[i];
+            ready_count += r->player_ready[i];
         }
-        if (ready_count == player_count()) {
-            FOREACH_PLAYER(player) {
-                reset_player(player);
-                broadcast(pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
-                                           player->stats[STAT_STRENGTH].value, player->stats[STAT_SPEED].value));
-                broadcast(pkt_from_info(player));
+        if (ready_count == player_count(r)) {
+            FOREACH_PLAYER(r, player) {
+                // Readiness is for one round, AI players are always ready
+                r->player_ready[player->id] = r->ai_player[player->id];
+                reset_player(r, player);
+                broadcast(r, pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
+                                              player->stats[STAT_STRENGTH].value, player->stats[STAT_SPEED].value));
+                broadcast_player_state(r, player, false);
             }
-            broadcast(pkt_round_start());
+            broadcast(r, pkt_round_start());
+            start_turn(r);
         }
-    } else if (p.type == PKT_GAME_RESET) {
-        // Only first player (owner) can reset the game
-        if (fd != connections[0]) {
-            player_info *player = get_player_from_fd(fd);
+    } else if (p->type == PKT_GAME_RESET) {
+        // Only the lobby's master can reset the game
+        player_info *player = get_player_from_fd(fd);
+        if (player->id != r->master_player) {
             LOG("%s tried to reset the game but they are not the owner.", player->name);
-            return;
+            return true;
         }
         LOG("Serv: game reset");
         for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-            round_scores[i] = 0;
+            r->round_scores[i] = 0;
         }
-        round_start_time = time(NULL);
-        gs = GS_WAITING;
-        broadcast(pkt_game_reset());
+        r->round_start_ms = monotonic_ms();
+        r->gs = GS_WAITING;
+        r->in_game = true;
+        broadcast(r, pkt_game_reset());
+        fill_ai_players(r);
         // We send previously connected players informations to the new player
-        FOREACH_PLAYER(player) {
-            reset_player(player);
-            broadcast(pkt_player_joined(player->id, player->name));
-
-            broadcast(pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
-                                       player->stats[STAT_STRENGTH].value, player->stats[STAT_SPEED].value));
+        FOREACH_PLAYER(r, player) {
+            reset_player(r, player);
+            broadcast(r, pkt_player_joined(player->id, player->name));
 
-            net_packet u = pkt_from_info(player);
-            ((net_packet_player_update *)u.content)->immediate = true;
-            broadcast_packet(&u);
+            broadcast(r, pkt_player_build(player->id, player->stats[STAT_HEALTH].base, player->spells,
+                                          player->stats[STAT_STRENGTH].value, player->stats[STAT_SPEED].value));
 
-            send_map(connections[player->id]);
+            broadcast_player_state(r, player, true);
         }
-        broadcast(pkt_game_start());
-    } else if (p.type == PKT_ADMIN_UPDATE_PLAYER_INFO) {
+        send_map(r);
+        relay_map(r);
+        broadcast(r, pkt_game_start(seed_match(r)));
+        start_turn(r);
+    } else if (p->type == PKT_RESYNC_REQUEST) {
+        LOGL(LL_WARNING, "Player %d of room %u mispredicted a turn", c->player_id, r->id);
+        send_resync(r, fd);
+    } else if (p->type == PKT_MAP_REQUEST) {
+        net_packet_map_request *m = (net_packet_map_request *)p->content;
+        // The room may have moved on to another map since the hash was sent
+        if (r->in_game && m->hash == r->map_hash) {
+            send_map_layers(r, fd);
+        }
+    } else if (p->type == PKT_ADMIN_UPDATE_PLAYER_INFO) {
         if (is_admin(fd)) {
-            net_packet_admin_update_player_info *info = (net_packet_admin_update_player_info *)p.content;
+            net_packet_admin_update_player_info *info = (net_packet_admin_update_player_info *)p->content;
+            if (info->id >= MAX_PLAYER_COUNT) {
+                return true;
+            }
+            player_info *target = &r->game.players[info->id];
             if (info->property == PIP_HEALTH) {
-                players[info->id].stats[STAT_HEALTH].value = info->value;
-                if (players[info->id].stats[STAT_HEALTH].value > players[info->id].stats[STAT_HEALTH].max) {
-                    players[info->id].stats[STAT_HEALTH].max = info->value;
+                target->stats[STAT_HEALTH].value = info->value;
+                if (target->stats[STAT_HEALTH].value > target->stats[STAT_HEALTH].max) {
+                    target->stats[STAT_HEALTH].max = info->value;
                 }
-                net_packet u = pkt_from_info(&players[info->id]);
-                ((net_packet_player_update *)u.content)->immediate = true;
-                broadcast_packet(&u);
+                broadcast_player_state(r, target, true);
             }
         } else {
-            char msg[128] = {0};
-            strncpy(msg, "You are not allowed to execute this command", 128);
-            net_packet response = pkt_server_message(LL_ERROR, msg);
-            send_sock(&response, fd);
+            send_server_message(fd, LL_ERROR, "You are not allowed to execute this command");
+        }
+    }
+    return true;
+}
+
+// Handles every packet already received, several can arrive in a single read.
+// Returns false once the connection is closed or handled by another worker.
+bool handle_readable(int fd) {
+    recv_buffer *in = get_connection(fd)->in;
+    get_connection(fd)->last_seen = current_worker->timers.now;
+    // Strings of the packet being handled point inside its frame body
+    uint8_t body[MAX_PACKET_SIZE] = {0};
+    int status = 0;
+    do {
+        status = recv_buffer_fill(in, fd);
+        net_packet p = {0};
+        int parsed = 0;
+        while ((parsed = packet_parse(in, &p, body)) > 0) {
+            if (handle_message(fd, &p) == false) {
+                return false;
+            }
+        }
+        if (parsed < 0) {
+            LOG("Closing %d after a malformed packet", fd);
+            status = -1;
         }
+    } while (status > 0);
+
+    if (status < 0) {
+        handle_player_disconnect(fd);
+        return false;
     }
+    return true;
 }
 
 // Main
 
-int sort_string(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
+// Adopts a connection handed by another thread
+void adopt_connection(worker *w, handoff h, bool new_room) {
+    room *r = NULL;
+    if (h.fd < 0) {
+        // Seat of a matched player who left before getting there
+        r = get_room(h.room_id);
+        if (r != NULL) {
+            release_seat(r);
+        }
+        return;
+    }
+    if (new_room && h.matchmake) {
+        // Players arriving at the same time would otherwise all get their own room
+        r = find_room_with_space();
+        if (r != NULL && r->owner != w) {
+            post_handoff(r->owner, (handoff){.fd = h.fd, .room_id = r->id}, false);
+            return;
+        }
+    }
+    if (attach_connection(w, h.fd) == false) {
+        if (r != NULL) {
+            release_seat(r);
+        }
+        return;
+    }
+    if (new_room && r == NULL) {
+        r = create_room(w);
+        if (r == NULL) {
+            send_server_message(h.fd, LL_ERROR, "Server is full");
+        }
+    } else if (new_room == false && h.room_id != 0) {
+        // The seat was reserved by the sending worker so the room is still alive
+        r = get_room(h.room_id);
+    }
+    if (r != NULL) {
+        join_room(r, h.fd);
+    }
+    // Packets that came along with the one that moved the connection are already buffered
+    handle_readable(h.fd);
 }
 
-// TODO: We should only parse header
-const char *extract_map_name(const char *filepath) {
-    map_data m = {0};
-    if (load_map(filepath, &m) == false) {
-        return NULL;
+void drain_inbox(worker *w) {
+    handoff h;
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        bool has_handoff = handoff_pop(&w->inbox, &h);
+        pthread_mutex_unlock(&w->lock);
+        if (has_handoff == false) {
+            return;
+        }
+        if (h.ticket != 0) {
+            take_match(w, h);
+        } else if (h.spectate) {
+            add_spectator(w, h);
+        } else {
+            adopt_connection(w, h, false);
+        }
+    }
+}
+
+// Actions of the AI players of this worker's rooms
+void drain_ai_results(worker *w) {
+    ai_result result;
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        bool has_result = w->ai_results.count > 0;
+        if (has_result) {
+            result = w->ai_results.items[w->ai_results.start];
+            w->ai_results.start = (w->ai_results.start + 1) % AI_QUEUE_SIZE;
+            w->ai_results.count--;
+        }
+        pthread_mutex_unlock(&w->lock);
+        if (has_result == false) {
+            return;
+        }
+        // The turn may have timed out, the game stopped or the room been destroyed meanwhile
+        room *r = get_room(result.room_id);
+        if (r == NULL || r->turn_serial != result.turn_serial || r->ai_player[result.player] == false ||
+            r->game.players[result.player].state != RS_PLAYING) {
+            continue;
+        }
+        play_action(r, &r->game.players[result.player], result.action);
+    }
+}
+
+// Pending new rooms go to the least loaded worker: a busy creator leaves them to be stolen
+void steal_new_rooms(worker *w) {
+    for (int i = 0; i < worker_count; i++) {
+        worker *victim = &workers[(w->id + i) % worker_count];
+        while (atomic_load(&victim->new_rooms_count) > 0) {
+            worker *idle = least_loaded_worker();
+            if (atomic_load(&idle->load) < atomic_load(&w->load)) {
+                wake_worker(idle);
+                return;
+            }
+
+            handoff h;
+            pthread_mutex_lock(&victim->lock);
+            bool has_handoff = handoff_pop(&victim->new_rooms, &h);
+            if (has_handoff) {
+                atomic_fetch_sub(&victim->new_rooms_count, 1);
+            }
+            pthread_mutex_unlock(&victim->lock);
+            if (has_handoff == false) {
+                break;
+            }
+            if (victim != w) {
+                LOG("Worker %d stole a new room from worker %d", w->id, victim->id);
+            }
+            adopt_connection(w, h, true);
+        }
+    }
+}
+
+// Sends everything queued during the batch, one writev per connection
+void flush_connections(worker *w) {
+    // Closing a connection can queue frames for its room, those are appended and flushed in the same pass
+    for (int i = 0; i < w->dirty_count; i++) {
+        int fd = w->dirty[i];
+        connection *c = get_connection(fd);
+        c->dirty = false;
+        if (c->overflow || send_queue_flush(c->out, fd) < 0) {
+            handle_player_disconnect(fd);
+        }
+    }
+    w->dirty_count = 0;
+}
+
+void *worker_main(void *arg) {
+    worker *w = arg;
+    current_worker = w;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        LOGL(LL_WARNING, "Could not pin worker %d to a core", w->id);
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (1) {
+        // Blocks until there is something to do or a timer is due
+        int event_count = epoll_wait(w->epoll_fd, events, MAX_EPOLL_EVENTS, timer_timeout(&w->timers));
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGL(LL_ERROR, "Error in epoll_wait %s", strerror(errno));
+            exit(1);
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == w->event_fd) {
+                uint64_t wakeups;
+                if (read(w->event_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    LOGL(LL_ERROR, "Error reading worker %d events %s", w->id, strerror(errno));
+                }
+                drain_inbox(w);
+                drain_ai_results(w);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                handle_player_disconnect(fd);
+                continue;
+            }
+
+            // The kernel buffer has room again, a later flush would just add latency
+            if (events[i].events & EPOLLOUT) {
+                connection *c = get_connection(fd);
+                if (c->dirty == false && c->out->head != c->out->tail && send_queue_flush(c->out, fd) < 0) {
+                    handle_player_disconnect(fd);
+                    continue;
+                }
+            }
+
+            // Edge-triggered: we have to consume everything that is already buffered
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                handle_readable(fd);
+            }
+        }
+        timer_run(&w->timers, monotonic_ms() / TIMER_TICK_MS);
+        steal_new_rooms(w);
+        flush_connections(w);
+    }
+    return NULL;
+}
+
+void start_workers(int count) {
+    workers = calloc(count, sizeof(worker));
+    if (workers == NULL) {
+        LOGL(LL_ERROR, "Could not allocate %d workers", count);
+        exit(1);
+    }
+    worker_count = count;
+    for (int i = 0; i < count; i++) {
+        worker *w = &workers[i];
+        w->id = i;
+        w->timers.now = monotonic_ms() / TIMER_TICK_MS;
+        rng_seed(&w->seeds, ((uint64_t)time(NULL) << 24) ^ ((uint64_t)getpid() << 8) ^ i);
+        pthread_mutex_init(&w->lock, NULL);
+        w->epoll_fd = ci(epoll_create1(0));
+        w->event_fd = ci(eventfd(0, EFD_NONBLOCK));
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = w->event_fd};
+        ci(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &event));
+    }
+    // Threads are started once every worker exists since they look at each other
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            LOGL(LL_ERROR, "Could not start worker %d", i);
+            exit(1);
+        }
+    }
+    LOG("Started %d workers", count);
+}
+
+// Accepting stops for this long when the process is out of descriptors or memory
+#define ACCEPT_BACKOFF_MS 100
+
+// accept reports the network errors of the pending connection, the next one may be fine
+bool is_connection_error(int error) {
+    return error == EINTR || error == ECONNABORTED || error == EPROTO || error == ENETDOWN || error == ENOPROTOOPT ||
+           error == EHOSTDOWN || error == ENONET || error == EHOSTUNREACH || error == EOPNOTSUPP ||
+           error == ENETUNREACH;
+}
+
+// New connections go to the least loaded worker
+void accept_connections(int sockfd) {
+    // Given up to take the pending connection and close it when we are out of descriptors,
+    // instead of leaving it in the backlog where accept fails on it again right away
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    bool backing_off = false;
+    while (1) {
+        // Writes must never block a worker, reads already use MSG_DONTWAIT
+        int connfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            int error = errno;
+            if (is_connection_error(error)) {
+                continue;
+            } else if (error != EMFILE && error != ENFILE && error != ENOBUFS && error != ENOMEM) {
+                LOGL(LL_ERROR, "Error accepting connection %s", strerror(error));
+                exit(1);
+            }
+            if (backing_off == false) {
+                LOGL(LL_WARNING, "Refusing connections: %s", strerror(error));
+                backing_off = true;
+            }
+            if ((error == EMFILE || error == ENFILE) && spare_fd >= 0) {
+                close(spare_fd);
+                int refused = accept(sockfd, NULL, NULL);
+                if (refused >= 0) {
+                    close(refused);
+                }
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            struct timespec backoff = {.tv_nsec = ACCEPT_BACKOFF_MS * 1000000L};
+            nanosleep(&backoff, NULL);
+            continue;
+        }
+        if (backing_off) {
+            LOGL(LL_WARNING, "Accepting connections again");
+            backing_off = false;
+        }
+
+        if (add_connection(connfd) == NULL) {
+            close(connfd);
+            continue;
+        }
+        LOG("new connection %d", connfd);
+        post_handoff(least_loaded_worker(), (handoff){.fd = connfd}, false);
     }
-    const char *res = m.headers[MAP_HEADER_NAME].value == NULL ? NULL : strdup(m.headers[MAP_HEADER_NAME].value);
-    free_map_data(&m);
-    return res;
+}
+
+int sort_map_entry(const void *a, const void *b) {
+    const map_entry *ma = a, *mb = b;
+    int by_name = strcmp(ma->name, mb->name);
+    return by_name != 0 ? by_name : strcmp(ma->file, mb->file);
 }
 
 bool ends_with(const char *s, const char *suffix) {
@@ -637,43 +2407,57 @@ bool ends_with(const char *s, const char *suffix) {
 }
 
 void load_maps() {
-    const char *map_names[256] = {0};
+    int capacity = 0;
     DIR *d;
     struct dirent *dir;
 
     if ((d = opendir("maps"))) {
         while ((dir = readdir(d)) != NULL) {
-            if (dir->d_type == DT_REG && ends_with(dir->d_name, ".map")) {
+            bool compiled = ends_with(dir->d_name, ".mapb");
+            if (dir->d_type == DT_REG && (compiled || ends_with(dir->d_name, ".map"))) {
                 char *filename = strdup(dir->d_name);
-                filename[strlen(filename) - strlen(".map")] = '\0';
-                all_maps[map_count] = filename;
-                map_names[map_count] = extract_map_name(filename);
-                if (all_maps[map_count] == NULL) {
+                filename[strrchr(filename, '.') - filename] = '\0';
+                // A map compiled from its text is indexed once, under the text
+                char text_path[256];
+                map_file_path(text_path, filename, ".map");
+                if (compiled && access(text_path, F_OK) == 0) {
+                    free(filename);
+                    continue;
+                }
+                char *name = load_map_name(filename);
+                if (name == NULL) {
                     LOGL(LL_ERROR, "Error while loading map %s", dir->d_name);
                     exit(-1);
                 }
-                map_count++;
-                if (map_count == 256) {
-                    LOGL(LL_ERROR, "Too many maps to load");
-                    break;
+                if (map_count == capacity) {
+                    capacity = capacity == 0 ? 64 : capacity * 2;
+                    map_index = realloc(map_index, capacity * sizeof(map_entry));
+                    if (map_index == NULL) {
+                        LOGL(LL_ERROR, "Not enough memory to index maps");
+                        exit(-1);
+                    }
                 }
+                map_index[map_count++] = (map_entry){.file = filename, .name = name};
             }
         }
         closedir(d);
     }
 
-    qsort(map_names, map_count, sizeof(all_maps[0]), sort_string);
-    map_names_network = calloc(map_count, 32);
-    for (int i = 0; i < map_count; i++) {
-        memcpy(map_names_network + i * 32, map_names[i], fmin(32, strlen(map_names[i])));
-    }
+    // Ids are positions in the sorted index, the names sent to clients come in the same order
+    qsort(map_index, map_count, sizeof(map_entry), sort_map_entry);
+    map_names_network = calloc(map_count + 1, 32);
     for (int i = 0; i < map_count; i++) {
-        free((void *)map_names[i]);
+        memcpy(map_names_network + i * 32, map_index[i].name, fmin(32, strlen(map_index[i].name)));
     }
+    LOG("%d maps indexed", map_count);
 }
 
 int main(int argc, char **argv) {
+    const char *spells_path = "spells/default.spells";
     int port = 3000;
+    int workers_arg = sysconf(_SC_NPROCESSORS_ONLN);
+    int ai_pool = 1;
+    const char *ratings_path = NULL;
     POPARG(argc, argv);
     while (argc > 0) {
         const char *arg = POPARG(argc, argv);
@@ -683,6 +2467,72 @@ int main(int argc, char **argv) {
                 LOG("Error parsing port to int '%s'", value);
                 exit(1);
             }
+        } else if (strcmp(arg, "--max-rooms") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &max_rooms) || max_rooms <= 0 || max_rooms > MAX_ROOMS) {
+                LOG("Invalid room count '%s' (1-%d)", value, MAX_ROOMS);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--workers") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &workers_arg) || workers_arg <= 0 || workers_arg > MAX_WORKERS) {
+                LOG("Invalid worker count '%s' (1-%d)", value, MAX_WORKERS);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--turn-time") == 0) {
+            const char *value = POPARG(argc, argv);
+            int seconds = 0;
+            if (!strtoint(value, &seconds) || seconds < 0) {
+                LOG("Invalid turn time '%s' (seconds, 0 to wait forever)", value);
+                exit(1);
+            }
+            turn_time_ms = seconds * 1000;
+        } else if (strcmp(arg, "--ai-players") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &ai_fill) || ai_fill < 0 || ai_fill > MAX_PLAYER_COUNT) {
+                LOG("Invalid AI player count '%s' (0-%d)", value, MAX_PLAYER_COUNT);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--ai-ms") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &ai_settings.budget_ms) || ai_settings.budget_ms <= 0) {
+                LOG("Invalid AI time budget '%s' (milliseconds per turn)", value);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--ai-threads") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &ai_settings.threads) || ai_settings.threads <= 0) {
+                LOG("Invalid AI search thread count '%s'", value);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--ai-pool") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &ai_pool) || ai_pool <= 0) {
+                LOG("Invalid AI pool size '%s'", value);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--match-size") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &match_size) || match_size < 2 || match_size > MAX_PLAYER_COUNT) {
+                LOG("Invalid match size '%s' (2-%d)", value, MAX_PLAYER_COUNT);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--relays") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!strtoint(value, &relay_count) || relay_count <= 0 || relay_count > MAX_RELAYS) {
+                LOG("Invalid relay count '%s' (1-%d)", value, MAX_RELAYS);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--log") == 0) {
+            const char *value = POPARG(argc, argv);
+            if (!set_log_levels(value)) {
+                LOG("Invalid log levels '%s' (comma separated: info, warning, debug, error)", value);
+                exit(1);
+            }
+        } else if (strcmp(arg, "--ratings") == 0) {
+            ratings_path = POPARG(argc, argv);
+        } else if (strcmp(arg, "--spells") == 0) {
+            spells_path = POPARG(argc, argv);
         } else if (strcmp(arg, "--pass") == 0) {
             server_password = POPARG(argc, argv);
             LOG("Server password is %s", server_password);
@@ -702,65 +2552,56 @@ int main(int argc, char **argv) {
     memset(&addr.sin_zero, 0, 8);
 
     ci(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)));
-    ci(listen(sockfd, 5));
+    ci(listen(sockfd, SOMAXCONN));
 
     LOG("Listening on port %d", port);
 
-    FD_ZERO(&master_set);
-    FD_ZERO(&read_fds);
-    FD_SET(sockfd, &master_set);
-    int fd_count = sockfd;
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-
-    struct sockaddr client = {0};
-    socklen_t len = sizeof(client);
-
     load_maps();
-
-    for (int i = 0; i < MAX_PLAYER_COUNT; i++) {
-        players[i].id = i;
+    if (load_spell_programs(spells_path) == false) {
+        LOGL(LL_ERROR, "Could not load spell programs from %s", spells_path);
+        exit(1);
     }
 
-    while (1) {
-        read_fds = master_set;
-        int activity = ci(select(fd_count + 1, &read_fds, NULL, NULL, &timeout));
-        if (activity < 0) {
-            LOGL(LL_ERROR, "Error in select");
-            exit(1);
-        }
+    // The pool is reserved up front so a busy server never allocates while running games
+    rooms = calloc(max_rooms, sizeof(room));
+    if (rooms == NULL) {
+        LOGL(LL_ERROR, "Could not allocate %d rooms", max_rooms);
+        exit(1);
+    }
+    LOG("Reserved %d rooms (%zu bytes per room, %zu KB total)", max_rooms, sizeof(room),
+        (max_rooms * sizeof(room)) / 1024);
+
+    // The connection table can't move once workers use it, so it is sized for every fd we may get
+    struct rlimit fd_limit = {0};
+    ci(getrlimit(RLIMIT_NOFILE, &fd_limit));
+    connections_capacity = fd_limit.rlim_cur == RLIM_INFINITY ? 1 << 20 : (int)fd_limit.rlim_cur;
+    connections = calloc(connections_capacity, sizeof(connection));
+    if (connections == NULL) {
+        LOGL(LL_ERROR, "Could not allocate %d connections", connections_capacity);
+        exit(1);
+    }
 
-        for (int i = 0; i <= fd_count; i++) {
-            if (FD_ISSET(i, &read_fds)) {
-                if (i == sockfd) {
-                    // New connection
-                    int connfd = ci(accept(sockfd, &client, &len));
-                    FD_SET(connfd, &master_set);
-                    if (connfd > fd_count) {
-                        fd_count = connfd;
-                    }
-                    LOG("new connection %d", connfd);
-                    // TODO: Check if there is any space left
-                    if (false) {  // player_count == MAX_PLAYER_COUNT) {
-                        // TODO: Tell the player the game is full
-                        LOG("Full");
-                        FD_CLR(connfd, &master_set);
-                        close(connfd);
-                    } else {
-                        connections[connection_count] = connfd;
-                        connection_count++;
-                    }
-                } else {
-                    handle_message(i);
-                    time_t round_timer = time(NULL) - round_start_time;
-                    broadcast(pkt_game_stats(round_timer));
-                }
-            }
-        }
-        usleep(16000);  // TODO: Sleep to avoid 100% CPU usage while I implement a better solution
+    // Without a file, ratings only last as long as the server
+    ratings = ratings_open(ratings_path);
+    if (ratings == NULL) {
+        LOGL(LL_ERROR, "Could not open the ratings");
+        exit(1);
+    }
+    mm_init(&matchmaking, time(NULL));
+
+    // Peers closing while we write are reported by writev
+    signal(SIGPIPE, SIG_IGN);
+    start_relays(relay_count);
+    start_workers(workers_arg);
+    pthread_t matcher;
+    if (pthread_create(&matcher, NULL, matchmaking_main, NULL) != 0) {
+        LOGL(LL_ERROR, "Could not start the matchmaking thread");
+        exit(1);
+    }
+    if (ai_fill > 0) {
+        start_ai_threads(ai_pool);
     }
+    accept_connections(sockfd);
 
     LOG("Client connected");
 
@@ -0,0 +1,328 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ai.h"
+#include "common.h"
+
+// Plays headless matches with the server's turn rules across every core.
+// Usage: simulate [--matches 100000] [--threads N] [--seed S] [--players 2] [--max-turns 200]
+//                 [--map default] [--build a.build --build b.build ...] [--spells spells/default.spells]
+//                 [--bench-hits N] [--ai-players N] [--ai-ms 50] [--ai-threads 1]
+// Builds given with --build are used by the players in order, the others get random ones.
+// The first --ai-players players search their actions with ai_choose_action, the others play at random.
+// --bench-hits times the spell programs against the native rules instead of playing matches.
+
+extern const spell all_spells[];
+extern const int spell_count;
+
+#define MAX_THREADS 256
+
+typedef struct {
+    bool set;
+    uint8_t spells[MAX_SPELL_COUNT];
+    uint8_t health, strength, speed;
+} build;
+
+typedef struct {
+    uint64_t seed;
+    int matches;
+
+    uint64_t turns;
+    uint64_t unfinished;  // Stopped after max_turns
+    uint64_t ties;
+    uint64_t wins[MAX_PLAYER_COUNT];
+    uint64_t ai_decisions;
+    uint64_t ai_ns;
+    uint64_t ai_max_ns;
+    uint64_t ai_iterations;
+} sim_thread;
+
+int player_count = 2;
+int max_turns = 200;
+int ai_players = 0;
+ai_config ai_settings = {.budget_ms = AI_DEFAULT_BUDGET_MS, .threads = 1, .max_depth = AI_DEFAULT_MAX_DEPTH};
+uint8_t *map_walls = NULL;  // Given to the AI, NULL without --map
+map_data loaded_map = {0};  // Kept loaded, the AI reads the distances of a compiled map from it
+build scripted_builds[MAX_PLAYER_COUNT] = {0};
+uint8_t spawns[MAX_PLAYER_COUNT][2] = {{0, 0}, {MAP_WIDTH - 1, MAP_HEIGHT - 1}, {MAP_WIDTH - 1, 0}, {0, MAP_HEIGHT - 1}};
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Same layout as the builds saved by the game
+bool load_build(const char *filepath, build *b) {
+    uint8_t buf[4 + MAX_SPELL_COUNT + STAT_COUNT] = {0};
+    FILE *f = fopen(filepath, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    size_t read = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (read != sizeof(buf) || buf[0] != MAX_SPELL_COUNT || buf[1] != STAT_COUNT) {
+        return false;
+    }
+    for (int i = 0; i < MAX_SPELL_COUNT; i++) {
+        if (buf[2 + i] >= spell_count) {
+            return false;
+        }
+        b->spells[i] = buf[2 + i];
+    }
+    const int8_t *sliders = (const int8_t *)&buf[3 + MAX_SPELL_COUNT];
+    b->health = 50 + sliders[0];
+    b->strength = sliders[1];
+    b->speed = 100 + sliders[2];
+    b->set = true;
+    return true;
+}
+
+void setup_match(sim_state *s, rng *r) {
+    memset(s, 0, sizeof(*s));
+    s->map = map_walls;
+    for (int i = 0; i < player_count; i++) {
+        player_info *p = &s->players[i];
+        const build *b = &scripted_builds[i];
+        p->id = i;
+        p->connected = true;
+        if (b->set) {
+            memcpy(p->spells, b->spells, MAX_SPELL_COUNT);
+            p->stats[STAT_HEALTH].base = b->health;
+            p->stats[STAT_STRENGTH].base = b->strength;
+            p->stats[STAT_SPEED].base = b->speed;
+        } else {
+            ai_random_build(r, p);
+        }
+        sim_reset_player(p, spawns[i][0], spawns[i][1]);
+    }
+}
+
+void *run_matches(void *arg) {
+    sim_thread *t = arg;
+    rng r;
+    rng_seed(&r, t->seed);
+    sim_state s;
+    sim_action actions[MAX_PLAYER_COUNT] = {0};
+    ai *players_ai[MAX_PLAYER_COUNT] = {0};
+    for (int i = 0; i < ai_players; i++) {
+        players_ai[i] = ai_create(ai_settings, rng_next(&r));
+        assert(players_ai[i] != NULL);
+    }
+    for (int m = 0; m < t->matches; m++) {
+        setup_match(&s, &r);
+        turn_outcome outcome = TO_CONTINUE;
+        uint8_t winner_id = GAME_TIE;
+        int turn = 0;
+        for (; turn < max_turns && outcome == TO_CONTINUE; turn++) {
+            for (int i = 0; i < player_count; i++) {
+                if (players_ai[i] == NULL) {
+                    actions[i] = ai_random_action(&s, &r, i);
+                    continue;
+                }
+                uint64_t start = now_ns();
+                actions[i] = ai_choose_action(players_ai[i], &s, &r, i, map_walls,
+                                              loaded_map.compiled != NULL ? loaded_map.compiled->distances : NULL);
+                uint64_t spent = now_ns() - start;
+                ai_start_cooldown(&s.players[i], actions[i]);
+                t->ai_decisions++;
+                t->ai_ns += spent;
+                t->ai_max_ns = spent > t->ai_max_ns ? spent : t->ai_max_ns;
+                t->ai_iterations += ai_last_iterations(players_ai[i]);
+            }
+            outcome = sim_step(&s, actions, &r, &winner_id);
+            for (int i = 0; i < ai_players; i++) {
+                ai_tick_cooldowns(&s.players[i]);
+            }
+        }
+        t->turns += turn;
+        if (outcome == TO_CONTINUE) {
+            t->unfinished++;
+        } else if (winner_id == GAME_TIE) {
+            t->ties++;
+        } else {
+            t->wins[winner_id]++;
+        }
+    }
+    for (int i = 0; i < ai_players; i++) {
+        ai_destroy(players_ai[i]);
+    }
+    return NULL;
+}
+
+// Every target spell hits a neighbour hits times with each implementation, the target is reset before each hit
+void bench_spells(int hits, uint64_t seed) {
+    rng r;
+    rng_seed(&r, seed);
+    sim_state s;
+    player_count = 2;
+    setup_match(&s, &r);
+    s.players[1].x = s.players[0].x + 1;
+    s.players[1].y = s.players[0].y;
+    const player_info target = s.players[1];
+
+    printf("%-14s %12s %12s  %s\n", "spell", "native ns", "program ns", "result");
+    uint64_t native_total = 0, program_total = 0;
+    for (int i = 0; i < spell_count; i++) {
+        const spell *sp = &all_spells[i];
+        if (sp->type != ST_TARGET) {
+            continue;
+        }
+        sim_state native = s, program = s;
+        sim_spell_hit_native(&native, &native.players[0], &native.players[1], sp);
+        sim_spell_hit(&program, &program.players[0], &program.players[1], sp);
+        bool same = memcmp(native.players, program.players, sizeof(native.players)) == 0 &&
+                    native.event_count == program.event_count &&
+                    memcmp(native.events, program.events, native.event_count * sizeof(turn_event)) == 0;
+
+        uint64_t start = now_ns();
+        for (int k = 0; k < hits; k++) {
+            native.players[1] = target;
+            native.event_count = 0;
+            sim_spell_hit_native(&native, &native.players[0], &native.players[1], sp);
+        }
+        uint64_t native_ns = now_ns() - start;
+        start = now_ns();
+        for (int k = 0; k < hits; k++) {
+            program.players[1] = target;
+            program.event_count = 0;
+            sim_spell_hit(&program, &program.players[0], &program.players[1], sp);
+        }
+        uint64_t program_ns = now_ns() - start;
+        native_total += native_ns;
+        program_total += program_ns;
+        printf("%-14s %12.1f %12.1f  %s\n", sp->name, (double)native_ns / hits, (double)program_ns / hits,
+               same ? "same" : "differs");
+    }
+    printf("%-14s %12.1f %12.1f\n", "total", native_total / 1e6, program_total / 1e6);
+}
+
+int parse_int(const char *arg, const char *value, int min, int max) {
+    int out = 0;
+    if (value == NULL || !strtoint(value, &out) || out < min || out > max) {
+        LOG("Invalid value for %s '%s', expected %d to %d", arg, value == NULL ? "" : value, min, max);
+        exit(1);
+    }
+    return out;
+}
+
+int main(int argc, char **argv) {
+    int match_count = 100000;
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = time(NULL);
+    int build_count = 0;
+    int bench_hits = 0;
+    const char *spells_path = "spells/default.spells";
+    POPARG(argc, argv);
+    while (argc > 0) {
+        const char *arg = POPARG(argc, argv);
+        const char *value = argc > 0 ? POPARG(argc, argv) : NULL;
+        if (strcmp(arg, "--matches") == 0) {
+            match_count = parse_int(arg, value, 1, INT_MAX);
+        } else if (strcmp(arg, "--threads") == 0) {
+            thread_count = parse_int(arg, value, 1, MAX_THREADS);
+        } else if (strcmp(arg, "--seed") == 0) {
+            seed = parse_int(arg, value, 0, INT_MAX);
+        } else if (strcmp(arg, "--players") == 0) {
+            player_count = parse_int(arg, value, 2, MAX_PLAYER_COUNT);
+        } else if (strcmp(arg, "--max-turns") == 0) {
+            max_turns = parse_int(arg, value, 1, INT_MAX);
+        } else if (strcmp(arg, "--map") == 0 && value != NULL) {
+            free_map_data(&loaded_map);
+            if (load_map(value, &loaded_map) == false) {
+                LOG("Could not load map '%s'", value);
+                exit(1);
+            }
+            memcpy(spawns, loaded_map.spawn_positions, sizeof(spawns));
+            map_walls = loaded_map.map;
+        } else if (strcmp(arg, "--build") == 0 && value != NULL) {
+            if (build_count == MAX_PLAYER_COUNT || load_build(value, &scripted_builds[build_count]) == false) {
+                LOG("Could not load build '%s'", value);
+                exit(1);
+            }
+            build_count++;
+        } else if (strcmp(arg, "--spells") == 0 && value != NULL) {
+            spells_path = value;
+        } else if (strcmp(arg, "--ai-players") == 0) {
+            ai_players = parse_int(arg, value, 0, MAX_PLAYER_COUNT);
+        } else if (strcmp(arg, "--ai-ms") == 0) {
+            ai_settings.budget_ms = parse_int(arg, value, 1, 60000);
+        } else if (strcmp(arg, "--ai-threads") == 0) {
+            ai_settings.threads = parse_int(arg, value, 1, MAX_THREADS);
+        } else if (strcmp(arg, "--bench-hits") == 0) {
+            bench_hits = parse_int(arg, value, 1, INT_MAX);
+        } else {
+            LOG("Unknown arg : '%s'", arg);
+            exit(1);
+        }
+    }
+    if (load_spell_programs(spells_path) == false) {
+        LOG("Could not load spell programs from '%s'", spells_path);
+        exit(1);
+    }
+    if (bench_hits > 0) {
+        bench_spells(bench_hits, seed);
+        return 0;
+    }
+    if (build_count > player_count) {
+        player_count = build_count;
+    }
+    if (ai_players > player_count) {
+        player_count = ai_players;
+    }
+    if (thread_count > match_count) {
+        thread_count = match_count;
+    }
+    thread_count = thread_count < 1 ? 1 : thread_count > MAX_THREADS ? MAX_THREADS : thread_count;
+
+    sim_thread threads[MAX_THREADS] = {0};
+    pthread_t handles[MAX_THREADS];
+    rng seeder;
+    rng_seed(&seeder, seed);
+    uint64_t start = now_ns();
+    for (int i = 0; i < thread_count; i++) {
+        threads[i].seed = rng_next(&seeder);
+        threads[i].matches = match_count / thread_count + (i < match_count % thread_count);
+        pthread_create(&handles[i], NULL, run_matches, &threads[i]);
+    }
+
+    sim_thread total = {0};
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(handles[i], NULL);
+        total.turns += threads[i].turns;
+        total.unfinished += threads[i].unfinished;
+        total.ties += threads[i].ties;
+        total.ai_decisions += threads[i].ai_decisions;
+        total.ai_ns += threads[i].ai_ns;
+        total.ai_iterations += threads[i].ai_iterations;
+        if (threads[i].ai_max_ns > total.ai_max_ns) {
+            total.ai_max_ns = threads[i].ai_max_ns;
+        }
+        for (int j = 0; j < MAX_PLAYER_COUNT; j++) {
+            total.wins[j] += threads[i].wins[j];
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%d matches of %d players on %d threads in %.2fs (seed %" PRIu64 ")\n", match_count, player_count,
+           thread_count, seconds, seed);
+    printf("turns: %" PRIu64 " (%.0f/s, %.1f per match)\n", total.turns, total.turns / seconds,
+           (double)total.turns / match_count);
+    printf("matches: %.0f/s, ties: %" PRIu64 ", unfinished after %d turns: %" PRIu64 "\n", match_count / seconds,
+           total.ties, max_turns, total.unfinished);
+    for (int i = 0; i < player_count; i++) {
+        printf("player %d (%s build, %s): %" PRIu64 " wins (%.1f%%)\n", i, scripted_builds[i].set ? "scripted" : "random",
+               i < ai_players ? "ai" : "random play", total.wins[i], 100.0 * total.wins[i] / match_count);
+    }
+    if (total.ai_decisions > 0) {
+        printf("ai: %" PRIu64 " decisions, %.1fms average, %.1fms max, %.0f iterations per decision\n",
+               total.ai_decisions, total.ai_ns / 1e6 / total.ai_decisions, total.ai_max_ns / 1e6,
+               (double)total.ai_iterations / total.ai_decisions);
+    }
+    return 0;
+}